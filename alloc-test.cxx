@@ -0,0 +1,180 @@
+#include <atomic>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <random>
+#include <vector>
+#include "NeuralNet.h"
+
+// Checks that the training steps do not allocate once their buffers have
+// been through one step: per event, in mini-batches, in single precision,
+// and in train_threaded epochs. Every operator new is counted; the count
+// may not move over the steps after the first. Exits non-zero if it does.
+
+std::atomic<long> allocations(0);
+
+void* operator new(std::size_t bytes)
+{
+    ++allocations;
+    void *p = std::malloc(bytes ? bytes : 1);
+    if (!p)
+    {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void *p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void *p, std::size_t) noexcept
+{
+    std::free(p);
+}
+
+template <typename T>
+void fill(MemoryDataset<T> &store, int n_events, int n_inputs, int n_outputs)
+{
+    std::mt19937 rng(n_events);
+    std::normal_distribution<double> gauss(0, 1);
+    std::vector<double> input(n_inputs), output(n_outputs);
+    store.reset(n_inputs, n_outputs);
+    for (int i = 0; i < n_events; ++i)
+    {
+        for (auto &x : input)
+        {
+            x = gauss(rng);
+        }
+        std::fill(output.begin(), output.end(), 0);
+        output[i % n_outputs] = 1;
+        store.add(input, output, 1);
+    }
+    store.normalize(std::vector<double>(n_inputs, 0), std::vector<double>(n_inputs, 1));
+}
+
+int failures = 0;
+
+// Fails if step allocated since the count was taken.
+void check(const char *step, long before, long expected = 0)
+{
+    const long made = allocations - before;
+    std::cout << step << ": " << made << " allocations" << std::endl;
+    if (made != expected)
+    {
+        ++failures;
+    }
+}
+
+struct TrainingSteps
+{
+    static void run()
+    {
+        const std::vector<int> structure = {27, 40, 20, 3};
+        const int n_ins = structure.front(), n_outs = structure.back();
+        NeuralNet net(structure);
+        net.shuffle = true;
+        net.memory_label.resize(n_outs);
+        fill(net.dataset_mem, 1024, n_ins, n_outs);
+        const int n = net.dataset_mem.size();
+        net.shuffle_order(0, n);
+
+        // per event, streamed and from memory
+        std::vector<double> event(n_ins, 0.5), label(n_outs, 0);
+        label[0] = 1;
+        net.train(event, label, 1);
+        long before = allocations;
+        for (int i = 0; i < 100; ++i)
+        {
+            net.train(event, label, 1);
+        }
+        check("per event", before);
+        before = allocations;
+        for (int i = 0; i < n; ++i)
+        {
+            const int k = net.epoch_order[i];
+            net.dataset_mem.outputs(k, net.memory_label.data());
+            net.train_normalized(net.dataset_mem.row(k), net.memory_label.data(),
+                                 net.dataset_mem.weight(k));
+        }
+        check("per event in memory", before);
+
+        // mini-batches, shuffled so that batches are copied, then in order
+        // so that they run in place
+        net.setBatchSize(16);
+        for (int i = 0; i < 16; ++i)
+        {
+            net.train_batched(net.epoch_order[i]);
+        }
+        before = allocations;
+        for (int i = 16; i < n; ++i)
+        {
+            net.train_batched(net.epoch_order[i]);
+        }
+        net.flush_batch();
+        for (int i = 0; i < n; ++i)
+        {
+            net.train_batched(i);
+        }
+        net.flush_batch();
+        check("mini-batches", before);
+
+        // train_threaded on one thread runs its loop inline, so nothing but
+        // the loop may allocate
+        net.setThreads(1, false);
+        net.train_threaded(net.shards, net.dataset_mem, 0, 2, false);
+        before = allocations;
+        net.train_threaded(net.shards, net.dataset_mem, 1, 2, false);
+        check("train_threaded, 1 thread", before);
+
+        // on more, starting the threads allocates, the same for every
+        // epoch: an epoch of 16 times the steps may not make more
+        for (int hogwild = 0; hogwild < 2; ++hogwild)
+        {
+            net.setThreads(4, hogwild);
+            MemoryDataset<double> small;
+            fill(small, 64, n_ins, n_outs);
+            net.shuffle_order(0, small.size());
+            net.train_threaded(net.shards, small, 0, 1, false);
+            before = allocations;
+            net.train_threaded(net.shards, small, 0, 1, false);
+            const long per_epoch = allocations - before;
+            net.shuffle_order(0, n);
+            net.train_threaded(net.shards, net.dataset_mem, 0, 1, false);
+            before = allocations;
+            net.train_threaded(net.shards, net.dataset_mem, 0, 1, false);
+            check(hogwild ? "train_threaded, 4 threads, hogwild" : "train_threaded, 4 threads",
+                  before, per_epoch);
+        }
+
+        // single precision
+        net.Net->use_float();
+        net.single_precision = true;
+        fill(net.float_mem, 1024, n_ins, n_outs);
+        net.shuffle_order(0, n);
+        for (int i = 0; i < 16; ++i)
+        {
+            net.train_batched(net.epoch_order[i]);
+        }
+        before = allocations;
+        for (int i = 16; i < n; ++i)
+        {
+            net.train_batched(net.epoch_order[i]);
+        }
+        net.flush_batch();
+        check("float mini-batches", before);
+        net.setThreads(1, false);
+        net.train_threaded(net.float_shards, net.float_mem, 0, 2, false);
+        before = allocations;
+        net.train_threaded(net.float_shards, net.float_mem, 1, 2, false);
+        check("float train_threaded, 1 thread", before);
+    }
+};
+
+int main()
+{
+    TrainingSteps::run();
+    std::cout << failures << " failures" << std::endl;
+    return (failures == 0) ? 0 : 1;
+}
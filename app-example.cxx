@@ -86,5 +86,70 @@ int main(int argc, char const *argv[])
     {
         std::cout << entry->first << ": " << entry->second << std::endl;
     }
+
+    // Many jets can be scored in one call by packing them row-wise in the 
+    // order given by get_input_layout(). Jets outside the trained pt/eta 
+    // range are flagged in the returned mask rather than throwing.
+    const std::vector<std::string>& layout = net.get_input_layout();
+    const std::vector<std::string>& outputs = net.get_output_names();
+    const int n_jets = 2;
+    std::vector<double> jets(n_jets * layout.size());
+    std::vector<double> probabilities(n_jets * outputs.size());
+    for (unsigned int i = 0; i < layout.size(); ++i)
+    {
+        jets[i] = data[layout[i]];
+        jets[layout.size() + i] = data[layout[i]];
+    }
+    jets[layout.size() + (std::find(layout.begin(), layout.end(), "eta") - layout.begin())] = 3.0;
+
+    std::vector<bool> valid = net.predict_batch(&jets[0], n_jets, &probabilities[0]);
+    for (int n = 0; n < n_jets; ++n)
+    {
+        std::cout << "jet " << n << (valid[n] ? "" : " (out of range)") << ":";
+        for (unsigned int i = 0; i < outputs.size(); ++i)
+        {
+            std::cout << " " << outputs[i] << "=" << probabilities[n * outputs.size() + i];
+        }
+        std::cout << std::endl;
+    }
+
+    // The same files can be loaded into single-precision weights for
+    // faster scoring; max_probability_deviation compares such a net with
+    // the double one over a sample of jets. Float rounding should move no
+    // probability by more than float_tolerance.
+    const double float_tolerance = 1e-5;
+    JetTagger::FloatNeuralNet float_net;
+    std::stringstream float_spec_stream, float_net_stream;
+    add_to_stream(spec_name, float_spec_stream);
+    add_to_stream(net_name, float_net_stream);
+    if (!float_net.load_specifications(float_spec_stream) || 
+        !float_net.load_net(float_net_stream))
+    {
+        printf("float net not good\n");
+        return -1;
+    }
+    const double float_deviation = 
+        JetTagger::max_probability_deviation(net, float_net, &jets[0], n_jets);
+    std::cout << "max float deviation: " << float_deviation << std::endl;
+    if (!(float_deviation <= float_tolerance))
+    {
+        printf("float net deviates by more than %g\n", float_tolerance);
+        return -1;
+    }
+
+    // Loading folds the input normalization into the first layer, so that
+    // scoring is pure layer evaluation; optimize(false) makes a copy
+    // evaluate the net literally, which should agree to rounding.
+    const double folding_tolerance = 1e-12;
+    JetTagger::NeuralNet literal(net);
+    literal.optimize(false);
+    const double folding_deviation = 
+        JetTagger::max_probability_deviation(literal, net, &jets[0], n_jets);
+    std::cout << "max folding deviation: " << folding_deviation << std::endl;
+    if (!(folding_deviation <= folding_tolerance))
+    {
+        printf("folded net deviates by more than %g\n", folding_tolerance);
+        return -1;
+    }
     return 0;
 }
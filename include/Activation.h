@@ -22,6 +22,21 @@ double dsig(double x);
 std::vector<double> sigmoid(std::vector<double> A);
 std::vector<double> dsigmoid(std::vector<double> A);
 std::vector<double> softmax(std::vector<double> A);
+
+/**
+\details Vectorized, in-place forms of sigmoid, dsigmoid and softmax. These use 
+a polynomial exp with relative error below 1e-14 on [-708, 709] and pick 
+AVX-512, AVX2 or SSE2 code at start-up; softmax subtracts the maximum first. 
+The float sigmoid evaluates in double.
+*/
+void sigmoid_inplace(double* A, int n);
+void sigmoid_inplace(float* A, int n);
+void dsigmoid_inplace(double* A, int n);
+void softmax_inplace(double* A, int n);
+/**
+\return The name of the instruction set the in-place kernels were dispatched to.
+*/
+const char* activation_kernels();
 void vector_print(std::vector<double> v);
 
 /**
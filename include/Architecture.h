@@ -8,6 +8,7 @@
 
 #include "Layer.h"
 #include "Activation.h"
+#include "Arena.h"
 #include <cmath>
 #include <string>
 #include <random>
@@ -22,28 +23,59 @@ class Architecture
 {
 public:
 //----------------------------------------------------------------------------
-	Architecture(std::vector<int> structure, std::vector<double> (*sigmoid_function) (std::vector<double>), double (*sigmoid_derivative) (double));
+	Architecture(std::vector<int> structure, void (*sigmoid_function) (double*, int), double (*sigmoid_derivative) (double));
+	Architecture(const Architecture &A);
 	~Architecture();
-	std::vector<double> test(std::vector<double> Event);
-	void backpropagate(std::vector<double> error, std::vector<double> Event, double weight);
+	std::vector<double> test(const std::vector<double> &Event);
+	void backpropagate(const std::vector<double> &error, const std::vector<double> &Event, double weight);
+	const double* test(const double *event);
+	void backpropagate(const double *error, const double *event, double weight);
+	double* event_workspace();
+	double* error_workspace();
+	template <typename T>
+	void reserve_batch(BasicBatchWorkspace<T> &batch, int n_events) const;
+	template <typename T>
+	const T* test_batch(const T *events, int n_events, BasicBatchWorkspace<T> &batch) const;
+	template <typename T>
+	void gradient_batch(const double *errors, const T *events, const double *weights, 
+	                    int n_events, BasicBatchWorkspace<T> &batch) const;
+	template <typename T>
+	void reduce_batch(BasicBatchWorkspace<T> &batch, const BasicBatchWorkspace<T> &other) const;
+	template <typename T>
+	void descend(const BasicBatchWorkspace<T> &batch);
+	void use_float();
 	void setLearning(double x);
 	void make_denoising();
-	void encode(std::vector<std::vector<double>> input, double learning, std::vector<double> weight, bool verbose, int epochs = 6);
+	void encode(const double *events, const double *weights, int n_events, double learning, 
+	            bool verbose, int epochs = 6, int batch_size = 1, int n_threads = 1);
 	void setMomentum(double x);
+	void setOptimizer(std::unique_ptr<Optimizer> optimizer);
+	const Optimizer& getOptimizer() const;
 	void anneal(double x);
 	std::vector<std::vector<double>> get_first_layer();
 private:
 //----------------------------------------------------------------------------
 	friend class NeuralNet;
+	void build(bool initialize);
+	// Every layer's weights, momenta, deltas and outputs, back to back, 
+	// followed by step_event.
+	Arena arena;
+	// Room for the normalized event of a per-event training step.
+	double *step_event;
+	// Every layer's Synapse in single precision, once use_float() is called; 
+	// refreshed after every descend().
+	FloatArena float_weights;
+	void sync_float();
 	std::vector< std::unique_ptr<Layer> > Bundle;
+	std::unique_ptr<Optimizer> optimizer;
 	std::vector<double> reconstruction_error;
 	std::vector<int> structure;
 	int layers;
 	bool is_denoising;
 	double eta, lambda;
 	double (*_sigmoid_derivative) (double);
-	std::vector<double> (*_sigmoid_function) (std::vector<double>);
-	
+	void (*_sigmoid_function) (double*, int);
+
 };
 #endif
 
@@ -0,0 +1,64 @@
+//------------------------------------------------------
+//				Arena.h
+//------------------------------------------------------
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <vector>
+
+//----------------------------------------------------------------------------
+// Allocator handing out blocks aligned to a cache line, so that every
+// weight matrix carved out of an arena starts on a 64 byte boundary.
+//----------------------------------------------------------------------------
+template <typename T, std::size_t Alignment = 64>
+struct AlignedAllocator
+{
+	typedef T value_type;
+	template <typename U> struct rebind { typedef AlignedAllocator<U, Alignment> other; };
+
+	AlignedAllocator() {}
+	template <typename U>
+	AlignedAllocator(const AlignedAllocator<U, Alignment>&) {}
+
+	T* allocate(std::size_t n)
+	{
+		void *raw = ::operator new(n * sizeof(T) + Alignment + sizeof(void*));
+		std::uintptr_t base = reinterpret_cast<std::uintptr_t>(raw) + sizeof(void*);
+		void *aligned = reinterpret_cast<void*>((base + Alignment - 1) & ~(Alignment - 1));
+		static_cast<void**>(aligned)[-1] = raw;
+		return static_cast<T*>(aligned);
+	}
+	void deallocate(T *ptr, std::size_t)
+	{
+		::operator delete(static_cast<void**>(static_cast<void*>(ptr))[-1]);
+	}
+};
+
+template <typename T, typename U, std::size_t Alignment>
+inline bool operator==(const AlignedAllocator<T, Alignment>&, const AlignedAllocator<U, Alignment>&)
+{
+	return true;
+}
+template <typename T, typename U, std::size_t Alignment>
+inline bool operator!=(const AlignedAllocator<T, Alignment>&, const AlignedAllocator<U, Alignment>&)
+{
+	return false;
+}
+
+typedef std::vector<double, AlignedAllocator<double> > Arena;
+typedef std::vector<float, AlignedAllocator<float> > FloatArena;
+
+//----------------------------------------------------------------------------
+// Rounds a block length up to a whole cache line of doubles, so that blocks
+// laid out back to back in an arena each stay aligned.
+//----------------------------------------------------------------------------
+inline std::size_t arena_padded(std::size_t n)
+{
+	return (n + 7) & ~static_cast<std::size_t>(7);
+}
+
+#endif
@@ -11,9 +11,81 @@
 #include <map>
 #include <TFile.h>
 #include <TTree.h>
+#include <TROOT.h>
 
 struct Numeric;
 
+//----------------------------------------------------------------------------
+/**
+\details A branch as read for every entry: the address ROOT fills and its type.
+*/
+struct Column
+{
+	enum Type { Double, Float, Int };
+	Type type;
+	const void *value;
+	inline double get() const
+	{
+		switch (type)
+		{
+			case Double: return *static_cast<const double*>(value);
+			case Float: return *static_cast<const float*>(value);
+			default: return *static_cast<const int*>(value);
+		}
+	}
+	inline int get_int() const
+	{
+		switch (type)
+		{
+			case Double: return static_cast<int>(*static_cast<const double*>(value));
+			case Float: return static_cast<int>(*static_cast<const float*>(value));
+			default: return *static_cast<const int*>(value);
+		}
+	}
+};
+//----------------------------------------------------------------------------
+/**
+\details Columns gathered into a row of doubles, grouped by type, so that reading 
+a row is one tight loop per type with no lookups.
+*/
+class ColumnTable
+{
+public:
+	void add(int position, const Column &column);
+	void read(double *row) const;
+private:
+	std::vector<std::pair<int, const double*> > doubles;
+	std::vector<std::pair<int, const float*> > floats;
+	std::vector<std::pair<int, const int*> > ints;
+};
+
+//----------------------------------------------------------------------------
+/**
+\details One cut of a selection: a column's value, or its absolute value, 
+compared with a constant.
+*/
+struct Cut
+{
+	enum Op { Less, LessEqual, Greater, GreaterEqual, Equal, NotEqual };
+	int column;
+	bool absolute;
+	Op op;
+	double value;
+	inline bool passes(double x) const
+	{
+		x = absolute ? fabs(x) : x;
+		switch (op)
+		{
+			case Less: return x < value;
+			case LessEqual: return x <= value;
+			case Greater: return x > value;
+			case GreaterEqual: return x >= value;
+			case Equal: return x == value;
+			default: return x != value;
+		}
+	}
+};
+
 struct Reweighting
 {
 	std::vector<std::vector<double> > charm_correction { 0 };
@@ -69,8 +141,37 @@ public:
 
 	
 	double get_value(std::string name);
+	//----------------------------------------------------------------------------
+	/**
+	\details Branch values by column, for reading many entries: look the column up 
+	once with column(), then get_value(column) is a direct read.
+	\return The column of the branch name, or -1 if it was not set.
+	*/
+	int column(const std::string &name) const;
+	inline double get_value(int column) const
+	{
+		return columns[column].get();
+	}
 	void operator[]( const int index );
 	void at( const int index );
+	//----------------------------------------------------------------------------
+	/**
+	\details Sets the cuts entries must all pass, e.g. "pt > 20, abs(eta) < 2.5", 
+	separated by commas or &&. Each compares a variable set from the spec, or 
+	its abs(), with a number by <, <=, >, >=, == or !=. The branches the 
+	cuts read are split off, for at_selected() to read first.
+	\return Returns a 1 if every cut was understood, 0 otherwise (keeping the 
+	previous selection).
+	*/
+	bool set_selection(const std::string &cuts);
+	//----------------------------------------------------------------------------
+	/**
+	\details Loads an entry in two phases: the branches the selection reads, 
+	then, only if it passes, the rest.
+	\return Whether the entry passed; if not, only its selection branches are 
+	loaded.
+	*/
+	bool at_selected( const long index );
 	std::vector<double> &input();
 	std::vector<double> &output();
 	std::vector<std::string> get_output_vars();
@@ -91,7 +192,26 @@ public:
 		m_num_eta_bins = m_eta_bins.size() - 1;
 	}
 	double get_physics_reweighting();
-	void determine_reweighting(bool cdf = true, bool relative = true);
+	bool determine_reweighting(bool cdf = true, bool relative = true);
+	//----------------------------------------------------------------------------
+	/**
+	\details Only the branches set are read: the others are switched off when the 
+	file is opened. This sets up the TTreeCache for those branches alone, so 
+	that they are fetched in large reads from the first entry on.
+	\param bytes The cache size; -1 sizes it to hold one cluster of entries.
+	*/
+	void prepare_cache(long long bytes = -1);
+	//----------------------------------------------------------------------------
+	/**
+	\details Lets ROOT decompress the baskets of an entry's branches on n_threads 
+	threads (0: as many as the machine has). Applies to every file opened.
+	*/
+	static void enable_parallel_unzip(int n_threads = 0);
+	//----------------------------------------------------------------------------
+	/**
+	\return Bytes read from the file per entry loaded so far.
+	*/
+	double bytes_per_entry() const;
 	
 private:
 	inline int get_cat_eta(double eta)
@@ -134,11 +254,29 @@ private:
 			return 0;
 		}
 	}
+	bool add_variable(const std::string &name, const std::string &type, bool has_branch);
+	void bind_columns();
+	void set_categories();
 	TFile *file;
 	TTree *tree;
 	bool fail;
 	std::map<std::string, std::unique_ptr<Numeric>> variables;
+	// Every variable set, compiled from the spec as it is read: columns 
+	// indexed through column_index, the input and output rows, and the 
+	// columns the categories and physics reweighting use (null if absent).
+	std::vector<Column> columns;
+	std::map<std::string, int> column_index;
+	ColumnTable input_table, output_table;
+	const Column *eta_column = nullptr, *pt_column = nullptr, *light_column = nullptr, 
+	             *charm_column = nullptr, *bottom_column = nullptr, *flavor_column = nullptr;
+	int *cat_eta = nullptr, *cat_pT = nullptr;
+	// The selection, and the branches read before and after applying it.
+	std::vector<Cut> cuts;
+	std::vector<TBranch*> selection_branches, other_branches;
 	unsigned int n_entries, m_num_eta_bins, m_num_pt_bins;
+	// entries loaded with at(), and the active branches
+	long n_loaded = 0;
+	std::vector<std::string> active;
 	std::vector<std::string> input_vars, output_vars, control_vars;
 	std::vector<double> m_input, m_output, m_pt_bins, m_eta_bins;
 	Reweighting reweighting;
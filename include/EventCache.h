@@ -0,0 +1,228 @@
+//------------------------------------------------------
+//				EventCache.h
+//------------------------------------------------------
+
+#ifndef EVENTCACHE_H
+#define EVENTCACHE_H
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include "MemoryDataset.h"
+
+//----------------------------------------------------------------------------
+// Preprocessed event cache, version 1: the selected, categorized and
+// reweighted training events of a dataset, normalized, and the validation
+// holdout, laid out so that a mapped file is trained on in place. key
+// identifies the input file, spec and options the events came from;
+// values are in the byte order of the machine that wrote it. Every
+// section starts on a 64 byte boundary.
+//   header      EventCacheHeader
+//   features    n_events x n_inputs values of scalar_bytes, row-major
+//   labels      n_events class indices, as signed chars
+//   weights     n_events doubles
+//   transform   n_inputs means then as many stddevs, as doubles
+//   holdout     n_holdout x n_inputs doubles, then labels and weights
+//----------------------------------------------------------------------------
+const char event_cache_magic[8] = {'#', '-', '>', 'G', 'A', 'I', 'A', 'C'};
+const uint32_t event_cache_version = 1;
+const uint32_t event_cache_byte_order = 0x01020304;
+
+struct EventCacheHeader
+{
+	char magic[8];
+	uint32_t version, byte_order;
+	uint32_t scalar_bytes; // 8 for double features, 4 for float
+	uint32_t n_inputs, n_outputs;
+	uint32_t reserved;
+	uint64_t key;
+	uint64_t n_events, n_holdout;
+	uint64_t features_offset, labels_offset, weights_offset, transform_offset;
+	uint64_t holdout_offset, holdout_labels_offset, holdout_weights_offset;
+	uint64_t file_bytes;
+};
+
+inline uint64_t event_cache_padded(uint64_t offset)
+{
+	return (offset + 63) & ~uint64_t(63);
+}
+
+//----------------------------------------------------------------------------
+// Writes an event cache as the events are read, so that they never need
+// to fit in memory: features go straight to the file, raw, and finish()
+// normalizes them there in chunks before adding the rest.
+//----------------------------------------------------------------------------
+class EventCacheWriter
+{
+public:
+	EventCacheWriter() : n_inputs(0), scalar_bytes(0), n_events(0) {}
+	bool open(const std::string &filename, uint64_t key, int n_in, int n_out, int scalar)
+	{
+		file.open(filename.c_str(), std::ios::in | std::ios::out | std::ios::binary | std::ios::trunc);
+		std::memset(&header, 0, sizeof(header));
+		std::memcpy(header.magic, event_cache_magic, sizeof(event_cache_magic));
+		header.version = event_cache_version;
+		header.byte_order = event_cache_byte_order;
+		header.scalar_bytes = scalar;
+		header.n_inputs = n_in;
+		header.n_outputs = n_out;
+		header.key = key;
+		header.features_offset = event_cache_padded(sizeof(header));
+		n_inputs = n_in;
+		scalar_bytes = scalar;
+		n_events = 0;
+		labels.clear();
+		weights.clear();
+		// the header is written, complete, by finish()
+		pad_to(header.features_offset);
+		return file.good();
+	}
+	void add(const std::vector<double> &input, const std::vector<double> &output, double weight)
+	{
+		if (scalar_bytes == sizeof(float))
+		{
+			floats.assign(input.begin(), input.end());
+			file.write(reinterpret_cast<const char*>(floats.data()), floats.size() * sizeof(float));
+		}
+		else
+		{
+			file.write(reinterpret_cast<const char*>(input.data()), input.size() * sizeof(double));
+		}
+		labels.push_back(MemoryDataset<double>::label_of(output));
+		weights.push_back(weight);
+		++n_events;
+	}
+	// Normalizes the features written with Mean and Stddev, and writes the
+	// rest of the cache.
+	bool finish(const std::vector<double> &Mean, const std::vector<double> &Stddev,
+	            const MemoryDataset<double> &holdout)
+	{
+		if (scalar_bytes == sizeof(float))
+		{
+			normalize_features<float>(Mean, Stddev);
+		}
+		else
+		{
+			normalize_features<double>(Mean, Stddev);
+		}
+		file.seekp(0, std::ios::end);
+		header.n_events = n_events;
+		header.labels_offset = append(labels.data(), labels.size());
+		header.weights_offset = append(weights.data(), weights.size() * sizeof(double));
+		header.transform_offset = append(Mean.data(), Mean.size() * sizeof(double));
+		append(Stddev.data(), Stddev.size() * sizeof(double), false);
+		header.n_holdout = holdout.size();
+		header.holdout_offset = append(holdout.row(0), holdout.size() * n_inputs * sizeof(double));
+		header.holdout_labels_offset = append(holdout.label_data(), holdout.size());
+		header.holdout_weights_offset = append(holdout.weights(), holdout.size() * sizeof(double));
+		header.file_bytes = file.tellp();
+		file.seekp(0);
+		file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		file.close();
+		return !file.fail();
+	}
+private:
+	template <typename T>
+	void normalize_features(const std::vector<double> &Mean, const std::vector<double> &Stddev)
+	{
+		const std::vector<double> Scale = MemoryDataset<T>::safe_scale(Stddev);
+		const uint64_t chunk = 4096;
+		std::vector<T> rows(chunk * n_inputs);
+		file.flush();
+		for (uint64_t first = 0; first < n_events; first += chunk)
+		{
+			const uint64_t n = std::min(chunk, n_events - first);
+			const uint64_t at = header.features_offset + first * n_inputs * sizeof(T);
+			file.seekg(at);
+			file.read(reinterpret_cast<char*>(rows.data()), n * n_inputs * sizeof(T));
+			MemoryDataset<T>::normalize_rows(rows.data(), n, n_inputs, Mean.data(), Scale.data());
+			file.seekp(at);
+			file.write(reinterpret_cast<const char*>(rows.data()), n * n_inputs * sizeof(T));
+		}
+	}
+	void pad_to(uint64_t offset)
+	{
+		const uint64_t at = file.tellp();
+		if (offset > at)
+		{
+			std::vector<char> zeros(offset - at, 0);
+			file.write(zeros.data(), zeros.size());
+		}
+	}
+	// Writes bytes from data at the end of the file, from a 64 byte
+	// boundary if aligned, and returns where.
+	uint64_t append(const void *data, std::size_t bytes, bool aligned = true)
+	{
+		if (aligned)
+		{
+			pad_to(event_cache_padded(file.tellp()));
+		}
+		const uint64_t at = file.tellp();
+		if (bytes > 0)
+		{
+			file.write(static_cast<const char*>(data), bytes);
+		}
+		return at;
+	}
+	std::fstream file;
+	EventCacheHeader header;
+	int n_inputs, scalar_bytes;
+	uint64_t n_events;
+	std::vector<signed char> labels;
+	std::vector<double> weights;
+	std::vector<float> floats;
+};
+
+//----------------------------------------------------------------------------
+// Attaches store and holdout to the events of a cache of bytes at data,
+// checking that it was written with key, for store's inputs, outputs and
+// scalar type, and reads its normalization into Mean and Stddev. data
+// must outlive both stores.
+// \return Returns a 1 if the cache fits, 0 otherwise (leaving all alone).
+template <typename T>
+inline bool attach_event_cache(const char *data, std::size_t bytes, uint64_t key,
+                               MemoryDataset<T> &store, MemoryDataset<double> &holdout,
+                               std::vector<double> &Mean, std::vector<double> &Stddev)
+{
+	EventCacheHeader header;
+	if (bytes < sizeof(header))
+	{
+		return false;
+	}
+	std::memcpy(&header, data, sizeof(header));
+	const uint64_t n_in = header.n_inputs;
+	if ((std::memcmp(header.magic, event_cache_magic, sizeof(event_cache_magic)) != 0) ||
+	    (header.version != event_cache_version) ||
+	    (header.byte_order != event_cache_byte_order) ||
+	    (header.scalar_bytes != sizeof(T)) || (header.key != key) ||
+	    ((int)header.n_inputs != store.n_inputs()) ||
+	    ((int)header.n_outputs != store.n_outputs()) ||
+	    (header.file_bytes != bytes) ||
+	    (header.features_offset + header.n_events * n_in * sizeof(T) > header.labels_offset) ||
+	    (header.labels_offset + header.n_events > header.weights_offset) ||
+	    (header.weights_offset + header.n_events * sizeof(double) > header.transform_offset) ||
+	    (header.transform_offset + 2 * n_in * sizeof(double) > header.holdout_offset) ||
+	    (header.holdout_offset + header.n_holdout * n_in * sizeof(double) > header.holdout_labels_offset) ||
+	    (header.holdout_labels_offset + header.n_holdout > header.holdout_weights_offset) ||
+	    (header.holdout_weights_offset + header.n_holdout * sizeof(double) > bytes))
+	{
+		return false;
+	}
+	const double *transform = reinterpret_cast<const double*>(data + header.transform_offset);
+	Mean.assign(transform, transform + n_in);
+	Stddev.assign(transform + n_in, transform + 2 * n_in);
+	store.attach(reinterpret_cast<const T*>(data + header.features_offset),
+	             reinterpret_cast<const signed char*>(data + header.labels_offset),
+	             reinterpret_cast<const double*>(data + header.weights_offset),
+	             header.n_events, Mean, Stddev);
+	holdout.attach(reinterpret_cast<const double*>(data + header.holdout_offset),
+	               reinterpret_cast<const signed char*>(data + header.holdout_labels_offset),
+	               reinterpret_cast<const double*>(data + header.holdout_weights_offset),
+	               header.n_holdout, Mean, Stddev);
+	return true;
+}
+
+#endif
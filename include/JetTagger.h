@@ -17,6 +17,23 @@
 #include <string>
 #include <cmath>
 #include <stdexcept>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <new>
+#include <stdint.h>
+#if (defined(__unix__) || defined(__APPLE__)) && !defined(JETTAGGER_NO_MMAP)
+#define JETTAGGER_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#if defined(__GNUC__) && defined(__x86_64__) && !defined(JETTAGGER_NO_SIMD)
+#define JETTAGGER_SIMD
+#include <immintrin.h>
+#endif
 
 //make a namespace for safety
 namespace JetTagger 
@@ -26,19 +43,43 @@ namespace JetTagger
 //-----------------------------------------------------------------------------
 const double eta_bins[5] = {0, 0.6, 1.2, 1.8, 2.5};
 const double pt_bins[8] = {15, 25, 35, 50, 80, 120, 200, 999999};
+const int batch_size = 256; // jets scored per pass in predict_batch
 inline double sig(double x);
 inline double dsig(double x);
 inline std::vector<double> sigmoid(std::vector<double> A);
 inline std::vector<double> dsigmoid(std::vector<double> A);
 inline std::vector<double> softmax(std::vector<double> A);
+inline void sigmoid_inplace(double* A, int n);
+inline void softmax_inplace(double* A, int n);
+inline void sigmoid_inplace(float* A, int n);
+inline void softmax_inplace(float* A, int n);
+inline void affine_inplace(const double* events, int n_events, int ins, 
+                           const double* weights, int outs, double* out);
+inline void affine_inplace(const float* events, int n_events, int ins, 
+                           const float* weights, int outs, float* out);
+inline void int16_dot_inplace(const short* x, int n_events, int n_pairs, 
+                              const short* weights, int outs, int* out);
+inline void quantize_inplace(const float* x, int n, float inverse_scale, 
+                             float lowest, float highest, short* out);
+inline const char* activation_kernels();
 
 inline std::string trim(const std::string& str, 
 	                    const std::string& whitespace = " ");
 
 inline void set_physics_category(double pt, double eta, 
                                  std::map<std::string, double> &map);
+inline bool find_physics_category(double pt, double eta, 
+                                  int &cat_pT, int &cat_eta);
 inline double find_or_throw(const std::map<std::string, double>&, 
                             const std::string&);
+template <typename T>
+inline void normalize_jet(const T* jet, int cat_pT, int cat_eta, 
+                          const std::vector<int> &layout_index, 
+                          const std::vector<double> &mean, 
+                          const std::vector<double> &stddev, T* input);
+template <typename T>
+inline void gather_jet(const T* jet, int cat_pT, int cat_eta, 
+                       const std::vector<int> &layout_index, T* input);
 
 template <typename T>
 void delete_pointed_to(T* const ptr)
@@ -46,25 +87,480 @@ void delete_pointed_to(T* const ptr)
     delete ptr;
 }
 
+//----------------------------------------------------------------------------
+// The inference classes are templated on their scalar type. The double 
+// instantiation is the reference; the float one halves the footprint of 
+// weights and activations and doubles the number of SIMD lanes, and is 
+// loaded from the same .nnet files.
+template <typename T> class BasicLayer;
+template <typename T> class BasicInferenceContext;
+template <typename T> class BasicNetworkArchitecture;
+template <typename T> class BasicNeuralNet;
+
+typedef BasicLayer<double> Layer;
+typedef BasicInferenceContext<double> InferenceContext;
+typedef BasicNetworkArchitecture<double> NetworkArchitecture;
+typedef BasicNeuralNet<double> NeuralNet;
+
+typedef BasicInferenceContext<float> FloatInferenceContext;
+typedef BasicNeuralNet<float> FloatNeuralNet;
+
+class QuantizedNeuralNet;
+
+template <typename A, typename B>
+double max_probability_deviation(const BasicNeuralNet<A> &reference, 
+                                 const BasicNeuralNet<B> &candidate, 
+                                 const double* jets, int n_jets);
+
+//----------------------------------------------------------------------------
+// Allocator handing out blocks aligned to a cache line, so that every 
+// weight matrix carved out of an arena starts on a 64 byte boundary.
+template <typename T>
+class AlignedAllocator
+{
+public:
+	typedef T value_type;
+	typedef T* pointer;
+	typedef const T* const_pointer;
+	typedef T& reference;
+	typedef const T& const_reference;
+	typedef std::size_t size_type;
+	typedef std::ptrdiff_t difference_type;
+	template <typename U> struct rebind { typedef AlignedAllocator<U> other; };
+	enum { alignment = 64 };
+
+	AlignedAllocator() {}
+	template <typename U> AlignedAllocator(const AlignedAllocator<U>&) {}
+
+	pointer address(reference x) const { return &x; }
+	const_pointer address(const_reference x) const { return &x; }
+	size_type max_size() const { return size_type(-1) / sizeof(T); }
+	void construct(pointer p, const T& value) { new (static_cast<void*>(p)) T(value); }
+	void destroy(pointer p) { p->~T(); }
+
+	pointer allocate(size_type n, const void* = 0)
+	{
+		void* raw = ::operator new(n * sizeof(T) + alignment + sizeof(void*));
+		std::size_t base = reinterpret_cast<std::size_t>(raw) + sizeof(void*);
+		void* aligned = reinterpret_cast<void*>((base + alignment - 1) & ~std::size_t(alignment - 1));
+		static_cast<void**>(aligned)[-1] = raw;
+		return static_cast<pointer>(aligned);
+	}
+	void deallocate(pointer p, size_type)
+	{
+		::operator delete(static_cast<void**>(static_cast<void*>(p))[-1]);
+	}
+};
+template <typename T, typename U>
+inline bool operator==(const AlignedAllocator<T>&, const AlignedAllocator<U>&) { return true; }
+template <typename T, typename U>
+inline bool operator!=(const AlignedAllocator<T>&, const AlignedAllocator<U>&) { return false; }
+
+// Rounds a block length up to a whole cache line of T, so that blocks 
+// laid out back to back in an arena each stay aligned.
+template <typename T>
+inline std::size_t arena_padded(std::size_t n)
+{
+	const std::size_t line = AlignedAllocator<T>::alignment / sizeof(T);
+	return (n + line - 1) & ~(line - 1);
+}
+
+//----------------------------------------------------------------------------
+// Read-only view of a whole file. Where the platform allows it the file is 
+// memory-mapped, so every process scoring with the same model shares its 
+// pages; elsewhere it is read into an aligned buffer.
+class MappedFile
+{
+public:
+	MappedFile(): data(0), bytes(0), mapped(false) {}
+	~MappedFile() { close(); }
+	bool open(const std::string &filename);
+	void close();
+	const char* begin() const { return data; }
+	std::size_t size() const { return bytes; }
+private:
+	MappedFile(const MappedFile&);
+	MappedFile& operator=(const MappedFile&);
+	const char* data;
+	std::size_t bytes;
+	bool mapped;
+	std::vector<char, AlignedAllocator<char> > buffer;
+};
+
+inline bool MappedFile::open(const std::string &filename)
+{
+	close();
+#ifdef JETTAGGER_MMAP
+	int fd = ::open(filename.c_str(), O_RDONLY);
+	if (fd < 0) 
+	{
+		return false;
+	}
+	struct stat info;
+	void* view = MAP_FAILED;
+	if (fstat(fd, &info) == 0 && info.st_size > 0) 
+	{
+		view = mmap(0, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	}
+	::close(fd);
+	if (view == MAP_FAILED) 
+	{
+		return false;
+	}
+	data = static_cast<const char*>(view);
+	bytes = info.st_size;
+	mapped = true;
+#else
+	std::ifstream file(filename.c_str(), std::ios::binary);
+	if (!file.is_open()) 
+	{
+		return false;
+	}
+	buffer.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+	data = buffer.empty() ? 0 : &buffer[0];
+	bytes = buffer.size();
+#endif
+	return bytes > 0;
+}
+
+inline void MappedFile::close()
+{
+#ifdef JETTAGGER_MMAP
+	if (mapped) 
+	{
+		munmap(const_cast<char*>(data), bytes);
+	}
+#endif
+	buffer.clear();
+	data = 0;
+	bytes = 0;
+	mapped = false;
+}
+
+//----------------------------------------------------------------------------
+// Binary model (.nnb) layout, version 1. Offsets count from the start of 
+// the file; integers and weights are in the byte order of the machine that 
+// wrote it, which byte_order records.
+//   header      BinaryModelHeader
+//   structure   n_layers uint32, as on the second line of a .nnet
+//   transform   structure[0] means then as many stddevs, as doubles
+//   schema      the spec file text, as read by load_specifications
+//   weights     each layer's row-major (ins + 1) x outs block, bias last, 
+//               padded to 64 bytes and starting on a 64 byte boundary: 
+//               exactly the in-memory arena, used in place where mapped
+const char binary_magic[8] = {'#', '-', '>', 'N', 'N', 'B', 'I', 'N'};
+const uint32_t binary_version = 1;
+const uint32_t binary_byte_order = 0x01020304;
+const uint32_t binary_sigmoid_softmax = 0; // sigmoid hidden layers, softmax output
+// bounds on what a file may declare, checked before anything is sized from it
+const uint32_t binary_max_layers = 256;
+const uint32_t binary_max_layer_size = 1 << 20;
+
+struct BinaryModelHeader
+{
+	char magic[8];
+	uint32_t version, byte_order;
+	uint32_t scalar_bytes; // 8 for double weights, 4 for float
+	uint32_t activation;
+	uint32_t n_layers;
+	uint32_t reserved;
+	uint64_t structure_offset, transform_offset;
+	uint64_t schema_offset, schema_bytes;
+	uint64_t weights_offset, weights_bytes;
+	uint64_t file_bytes;
+};
+
+// Whether bytes at offset lie within a file of size, without overflowing.
+inline bool binary_section_fits(uint64_t offset, uint64_t bytes, uint64_t size)
+{
+	return (offset <= size) && (bytes <= size - offset);
+}
+
+// Scalars in the arena of a net with this structure, stored as U.
+template <typename U>
+inline std::size_t arena_size(const std::vector<int> &structure)
+{
+	std::size_t total = 0;
+	for (unsigned int l = 0; l + 1 < structure.size(); ++l) 
+	{
+		total += arena_padded<U>((structure[l] + 1) * structure[l + 1]);
+	}
+	return total;
+}
+// Copies an arena between scalar types, whose layer padding differs.
+template <typename From, typename To>
+inline void convert_arena(const From* source, const std::vector<int> &structure, 
+                          To* target)
+{
+	for (unsigned int l = 0; l + 1 < structure.size(); ++l) 
+	{
+		std::size_t n = (structure[l] + 1) * structure[l + 1];
+		std::copy(source, source + n, target);
+		std::fill(target + n, target + arena_padded<To>(n), To(0));
+		source += arena_padded<From>(n);
+		target += arena_padded<To>(n);
+	}
+}
+
+//----------------------------------------------------------------------------
+// A .nnet file, as the trainer writes it:
+//   #->NNET
+//   0, n_0, n_1, ..., n_L      layer sizes
+//   learning?momentum
+//   BUNDLE                     then (n_l + 1) rows of n_(l+1) weights, 
+//   ...                        bias last, for every layer
+//   TRANS
+//   n_0 means
+//   n_0 stddevs
+// The trainer and this header share the one parser below, which makes a 
+// single pass over the text with strtod and no per-field streams.
+struct NetText
+{
+	std::vector<int> structure;
+	double learning, momentum;
+	std::vector<double> weights; // every layer's rows back to back, unpadded
+	std::vector<double> mean, stddev;
+	std::size_t end; // just past the TRANS rows, where trainer checkpoints go on
+};
+
+// Converts the number at text like strtod. Decimals of at most 15 digits 
+// scaled by at most 10^22 -- everything the trainer writes -- are exact 
+// after one multiply or divide (Clinger's fast path); the rest, and 
+// anything unusual, go to strtod.
+inline double parse_double(const char* text, char** after)
+{
+	static const double powers[23] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 
+	                                  1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 
+	                                  1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+	const char* at = text;
+	bool negative = (*at == '-');
+	if (*at == '-' || *at == '+') 
+	{
+		++at;
+	}
+	uint64_t mantissa = 0;
+	int n_digits = 0, exponent = 0;
+	for (; *at >= '0' && *at <= '9' && n_digits <= 15; ++at, ++n_digits) 
+	{
+		mantissa = 10 * mantissa + (*at - '0');
+	}
+	if (*at == '.') 
+	{
+		for (++at; *at >= '0' && *at <= '9' && n_digits <= 15; ++at, ++n_digits, --exponent) 
+		{
+			mantissa = 10 * mantissa + (*at - '0');
+		}
+	}
+	if ((*at == 'e' || *at == 'E') && n_digits > 0) 
+	{
+		const char* power = at + 1;
+		bool below = (*power == '-');
+		if (*power == '-' || *power == '+') 
+		{
+			++power;
+		}
+		int scale = 0, n_scale = 0;
+		for (; *power >= '0' && *power <= '9' && n_scale < 4; ++power, ++n_scale) 
+		{
+			scale = 10 * scale + (*power - '0');
+		}
+		if (n_scale > 0) 
+		{
+			exponent += below ? -scale : scale;
+			at = power;
+		}
+	}
+	if (n_digits == 0 || n_digits > 15 || exponent < -22 || exponent > 22 || 
+	    (*at >= '0' && *at <= '9') || *at == '.' || *at == 'e' || *at == 'E') 
+	{
+		return std::strtod(text, after);
+	}
+	double value = static_cast<double>(mantissa);
+	value = (exponent < 0) ? value / powers[-exponent] : value * powers[exponent];
+	*after = const_cast<char*>(at);
+	return negative ? -value : value;
+}
+// Appends the separator-delimited numbers on the line at text to out and 
+// moves text to the start of the next line. Fails on anything that is not 
+// a number, without reading past the end of the line.
+inline bool read_fields(const char* &text, char separator, std::vector<double> &out)
+{
+	for (;;) 
+	{
+		while (*text == ' ' || *text == '\t') 
+		{
+			++text;
+		}
+		if (*text == '\n' || *text == '\r' || *text == '\0') 
+		{
+			return false;
+		}
+		char* after;
+		out.push_back(parse_double(text, &after));
+		if (after == text) 
+		{
+			return false;
+		}
+		text = after;
+		while (*text == ' ' || *text == '\t' || *text == '\r') 
+		{
+			++text;
+		}
+		if (*text != separator) 
+		{
+			break;
+		}
+		++text;
+	}
+	if (*text == '\n') 
+	{
+		++text;
+		return true;
+	}
+	return *text == '\0';
+}
+// Consumes a line holding only keyword, ignoring surrounding blanks.
+inline bool read_keyword(const char* &text, const char* keyword)
+{
+	const char* at = text;
+	while (*at == ' ' || *at == '\t') 
+	{
+		++at;
+	}
+	std::size_t length = std::strlen(keyword);
+	if (std::strncmp(at, keyword, length) != 0) 
+	{
+		return false;
+	}
+	at += length;
+	while (*at == ' ' || *at == '\t' || *at == '\r') 
+	{
+		++at;
+	}
+	if (*at != '\n' && *at != '\0') 
+	{
+		return false;
+	}
+	text = (*at == '\n') ? at + 1 : at;
+	return true;
+}
+// Parses the whole of a .nnet file held in text. On failure prints the 
+// offending line and returns false.
+inline bool parse_net_text(const std::string &text, NetText &net)
+{
+	const char* at = text.c_str();
+	std::vector<double> fields;
+	int line = 1;
+	const char* failure = 0;
+	net.structure.clear();
+	net.weights.clear();
+	net.mean.clear();
+	net.stddev.clear();
+	if (!read_keyword(at, "#->NNET")) 
+	{
+		failure = "file type not recognised";
+	}
+	else if (++line, !read_fields(at, ',', fields) || fields.size() < 3) 
+	{
+		failure = "expected the layer sizes";
+	}
+	else 
+	{
+		for (unsigned int i = 1; i < fields.size(); ++i) 
+		{
+			net.structure.push_back(static_cast<int>(fields[i]));
+			if (net.structure.back() < 1 || net.structure.back() != fields[i]) 
+			{
+				failure = "expected the layer sizes";
+			}
+		}
+		fields.clear();
+	}
+	if (!failure && (++line, !read_fields(at, '?', fields) || fields.size() != 2)) 
+	{
+		failure = "expected learning?momentum";
+	}
+	if (!failure) 
+	{
+		net.learning = fields[0];
+		net.momentum = fields[1];
+		std::size_t total = 0;
+		for (unsigned int l = 0; l + 1 < net.structure.size(); ++l) 
+		{
+			total += (net.structure[l] + 1) * net.structure[l + 1];
+		}
+		net.weights.reserve(total);
+	}
+	for (unsigned int l = 0; !failure && l + 1 < net.structure.size(); ++l) 
+	{
+		if (++line, !read_keyword(at, "BUNDLE")) 
+		{
+			failure = "expected BUNDLE";
+		}
+		for (int row = 0; !failure && row <= net.structure[l]; ++row) 
+		{
+			std::size_t before = net.weights.size();
+			if (++line, !read_fields(at, ',', net.weights) || 
+			    net.weights.size() - before != static_cast<unsigned int>(net.structure[l + 1])) 
+			{
+				failure = "wrong number of weights";
+			}
+		}
+	}
+	if (!failure && (++line, !read_keyword(at, "TRANS"))) 
+	{
+		failure = "expected TRANS";
+	}
+	if (!failure && (++line, !read_fields(at, ',', net.mean) || 
+	                 net.mean.size() != static_cast<unsigned int>(net.structure[0]))) 
+	{
+		failure = "wrong number of means";
+	}
+	if (!failure && (++line, !read_fields(at, ',', net.stddev) || 
+	                 net.stddev.size() != static_cast<unsigned int>(net.structure[0]))) 
+	{
+		failure = "wrong number of stddevs";
+	}
+	if (failure) 
+	{
+		std::cout << "\nError: .nnet line " << line << ": " << failure << "." << std::endl;
+		return false;
+	}
+	net.end = at - text.c_str();
+	return true;
+}
+
 //-----------------------------------------------------------------------------
 //	CLASS: LAYER for mediating inter-layer interactions
 //-----------------------------------------------------------------------------
-class Layer
+template <typename T>
+class BasicLayer
 {
 public:
 //----------------------------------------------------------------------------
-	Layer(int ins, int outs, bool last, 
-          std::vector<double> (*Activation_function)(std::vector<double>));
+	typedef std::vector<T, AlignedAllocator<T> > Arena;
+
+	BasicLayer(int ins, int outs, bool last, 
+	           std::vector<double> (*Activation_function)(std::vector<double>), 
+	           T* storage = 0);
 
-	Layer(std::vector<std::vector<double> > Synapse, bool last);
-	~Layer();
+	BasicLayer(std::vector<std::vector<double> > Synapse, bool last);
+	~BasicLayer();
+	static std::size_t storage_size(int ins, int outs);
 	std::vector<double> fire();
 	void feed(std::vector<double> event);
+	void feed(const T* event, T* out) const;
+	void feed_batch(const T* events, int n_events, T* out) const;
 private:
 //----------------------------------------------------------------------------
-	friend class NetworkArchitecture;
-	friend class NeuralNet;
-	std::vector<std::vector<double> > Synapse;
+	template <typename> friend class BasicNetworkArchitecture;
+	template <typename> friend class BasicNeuralNet;
+	friend class QuantizedNeuralNet;
+	// Row-major (ins + 1) x outs weights, the last row holding the bias. 
+	// Points into the NetworkArchitecture arena, or into own_storage for 
+	// a free-standing layer.
+	T* Synapse;
+	Arena own_storage;
 	std::vector<double> Outs;
 	std::vector<double> (*_sigmoid)(std::vector<double>);
 	int ins, outs;
@@ -75,34 +571,52 @@ private:
 //-----------------------------------------------------------------------------
 //	Implementation of CLASS: LAYER
 //-----------------------------------------------------------------------------
-Layer::Layer(int ins, int outs, bool last, 
-	         std::vector<double> (*Activation_function)(std::vector<double>)): 
-	Outs(outs, 0.00), _sigmoid(Activation_function), 
+template <typename T>
+inline BasicLayer<T>::BasicLayer(int ins, int outs, bool last, 
+	         std::vector<double> (*Activation_function)(std::vector<double>), 
+	         T* storage): 
+	Synapse(storage), Outs(outs, 0.00), _sigmoid(Activation_function), 
 	ins(ins), outs(outs), last(last)
 {
-	std::vector<double> new_vec(outs, 0.00);
-	for (int i = 0; i < ins + 1; ++i) 
+	if (!Synapse) 
+	{
+		own_storage.assign(storage_size(ins, outs), T(0));
+		Synapse = &own_storage[0];
+	}
+}
+//----------------------------------------------------------------------------
+template <typename T>
+inline BasicLayer<T>::BasicLayer(std::vector<std::vector<double> > Synapse, bool last) : 
+	Outs(Synapse.at(0).size(), 0.00), _sigmoid(sigmoid), 
+	ins(Synapse.size() - 1), outs(Synapse.at(0).size()), last(last)
+{
+	own_storage.assign(storage_size(ins, outs), T(0));
+	this->Synapse = &own_storage[0];
+	for (int i = 0; i <= ins; ++i) 
 	{
-		Synapse.push_back(new_vec);
+		std::copy(Synapse[i].begin(), Synapse[i].end(), this->Synapse + i * outs);
 	}
 }
 //----------------------------------------------------------------------------
-Layer::Layer(std::vector<std::vector<double> > Synapse, bool /*last*/) : 
-	Synapse ( Synapse ), 
-	Outs(outs, 0.00)
+template <typename T>
+inline BasicLayer<T>::~BasicLayer() 
 {
 }
 //----------------------------------------------------------------------------
-Layer::~Layer() 
+template <typename T>
+inline std::size_t BasicLayer<T>::storage_size(int ins, int outs) 
 {
+	return arena_padded<T>((ins + 1) * outs);
 }
 //----------------------------------------------------------------------------
-inline std::vector<double> Layer::fire() 
+template <typename T>
+inline std::vector<double> BasicLayer<T>::fire() 
 {
 	return Outs;
 }
 //----------------------------------------------------------------------------
-inline void Layer::feed(std::vector<double> event) 
+template <typename T>
+inline void BasicLayer<T>::feed(std::vector<double> event) 
 {
 	event.push_back(1);
 	double sum;
@@ -111,7 +625,7 @@ inline void Layer::feed(std::vector<double> event)
 		sum = 0;
 		for (int j = 0; j <= ins; ++j) 
 		{
-			sum += event.at(j) * (Synapse.at(j).at(i));
+			sum += event.at(j) * Synapse[j * outs + i];
 		}
 		Outs.at(i) = sum;
 	}
@@ -120,43 +634,119 @@ inline void Layer::feed(std::vector<double> event)
 		Outs = _sigmoid(Outs);
 	}
 }
+//----------------------------------------------------------------------------
+// Allocation-free variant of feed(): writes into the caller's out buffer, 
+// with the same summation order, bias last.
+template <typename T>
+inline void BasicLayer<T>::feed(const T* event, T* out) const
+{
+	affine_inplace(event, 1, ins, Synapse, outs, out);
+	if (!last) 
+	{
+		sigmoid_inplace(out, outs);
+	}
+}
+//----------------------------------------------------------------------------
+// Feeds a row-major (n_events x ins) block through the layer as one 
+// matrix-matrix product, vectorized across the outputs of each jet. The 
+// summation order matches feed(), bias last.
+template <typename T>
+inline void BasicLayer<T>::feed_batch(const T* events, int n_events, 
+                                      T* BatchOuts) const
+{
+	affine_inplace(events, n_events, ins, Synapse, outs, BatchOuts);
+	if (!last) 
+	{
+		sigmoid_inplace(BatchOuts, n_events * outs);
+	}
+}
+
+//-----------------------------------------------------------------------------
+//	CLASS: INFERENCECONTEXT holding per-thread scratch space
+//-----------------------------------------------------------------------------
+// A loaded NeuralNet is read-only; everything a prediction writes lives in 
+// a context. Give each thread its own context and many threads can share 
+// one net without locking. A context sizes itself on first use, after 
+// which predictions through it do not allocate.
+template <typename T>
+class BasicInferenceContext
+{
+private:
+	template <typename> friend class BasicNetworkArchitecture;
+	template <typename> friend class BasicNeuralNet;
+	friend class QuantizedNeuralNet;
+	std::vector<std::vector<T> > outs, batch_outs;
+	std::vector<T> input_vector, batch_input, jet_vector;
+};
 
 //-----------------------------------------------------------------------------
 //	CLASS: NETWORKARCHITECTURE for joining layers
 //-----------------------------------------------------------------------------
 
-class NetworkArchitecture
+template <typename T>
+class BasicNetworkArchitecture
 {
 public:
 //----------------------------------------------------------------------------
-	NetworkArchitecture(std::vector<int> structure, 
+	typedef BasicLayer<T> Layer;
+	typedef BasicInferenceContext<T> InferenceContext;
+	typedef typename Layer::Arena Arena;
+
+	BasicNetworkArchitecture(std::vector<int> structure, 
 		std::vector<double> (*sigmoid_function) (std::vector<double>), 
 		double (*sigmoid_derivative) (double)):
+			mapping( 0 ), 
+			folded( 0 ), 
 			structure( structure ),  
 			is_denoising( false ),
 			_sigmoid_derivative(sigmoid_derivative), 
 			_sigmoid_function(sigmoid_function)
 	{
-		layers = structure.size();
-		int l;
-		bool final;
-		for (l = 0; l < (layers - 1); ++l) 
-		{
-			final = ((l == (layers - 2)) ? true : false);
-
-			Bundle.push_back(new Layer(structure.at(l), 
-									   structure.at(l + 1), 
-									   final, _sigmoid_function));
-		}
-		layers = Bundle.size();
-		lambda = 0;
+		build(0);
+	}
+	// Layers reading their weights from an arena laid out elsewhere, such 
+	// as a mapped binary model; takes ownership of the mapping.
+	BasicNetworkArchitecture(std::vector<int> structure, 
+		std::vector<double> (*sigmoid_function) (std::vector<double>), 
+		double (*sigmoid_derivative) (double), 
+		MappedFile *mapping, const T* weights):
+			mapping( mapping ), 
+			folded( 0 ), 
+			structure( structure ),  
+			is_denoising( false ),
+			_sigmoid_derivative(sigmoid_derivative), 
+			_sigmoid_function(sigmoid_function)
+	{
+		build(weights);
 	}
-	~NetworkArchitecture();
+	BasicNetworkArchitecture(const BasicNetworkArchitecture &A);
+	~BasicNetworkArchitecture();
 	std::vector<double> test(std::vector<double> Event);
+	const T* test(const T* Event, InferenceContext &context) const;
+	const T* test_batch(const T* Events, int n_events, 
+	                    InferenceContext &context) const;
 	std::vector<std::vector<double> > get_first_layer();
+
+	// Folds the input normalization into a copy of the first layer, which 
+	// the context-based test() and test_batch() then use: they take raw 
+	// inputs, and scoring is pure layer evaluation. The layers keep their 
+	// trained weights, so saving and mapped weights are unaffected.
+	void fold_normalization(const std::vector<double> &mean, 
+	                        const std::vector<double> &stddev);
+	void unfold();
+	bool is_folded() const;
 private:
 //----------------------------------------------------------------------------
-	friend class NeuralNet;
+	template <typename> friend class BasicNeuralNet;
+	friend class QuantizedNeuralNet;
+	void build(const T* weights);
+	void prepare(InferenceContext &context, int n_events) const;
+	const Layer& input_layer() const;
+	// Every layer's weights, back to back, unless they are read in place 
+	// from a mapped file.
+	Arena arena;
+	MappedFile *mapping;
+	Layer *folded;
 	std::vector<Layer*> Bundle;
 	std::vector<double> reconstruction_error;
 	std::vector<int> structure;
@@ -170,13 +760,70 @@ private:
 //-----------------------------------------------------------------------------
 //	Implementation of CLASS: NETWORKARCHITECTURE
 //-----------------------------------------------------------------------------
-NetworkArchitecture::~NetworkArchitecture() 
+// Carves one arena into per-layer weight blocks; the arena is allocated 
+// unless the weights are already laid out as one.
+template <typename T>
+inline void BasicNetworkArchitecture<T>::build(const T* weights)
+{
+	layers = structure.size();
+	int l;
+	bool final;
+	if (!weights) 
+	{
+		arena.assign(arena_size<T>(structure), T(0));
+		weights = arena.empty() ? 0 : &arena[0];
+	}
+	// layers never write through Synapse while scoring
+	T* block = const_cast<T*>(weights);
+	for (l = 0; l < (layers - 1); ++l) 
+	{
+		final = ((l == (layers - 2)) ? true : false);
+
+		Bundle.push_back(new Layer(structure.at(l), 
+								   structure.at(l + 1), 
+								   final, _sigmoid_function, block));
+		block += Layer::storage_size(structure.at(l), structure.at(l + 1));
+	}
+	layers = Bundle.size();
+	lambda = 0;
+}
+//----------------------------------------------------------------------------
+// Clones the weights of A with a single copy of its arena; a clone of a 
+// mapped net owns its weights.
+template <typename T>
+inline BasicNetworkArchitecture<T>::BasicNetworkArchitecture(const BasicNetworkArchitecture &A):
+	mapping( 0 ), 
+	folded( 0 ), 
+	structure( A.structure ),  
+	is_denoising( false ),
+	_sigmoid_derivative(A._sigmoid_derivative), 
+	_sigmoid_function(A._sigmoid_function)
+{
+	build(0);
+	if (!arena.empty()) 
+	{
+		std::copy(A.Bundle[0]->Synapse, A.Bundle[0]->Synapse + arena.size(), arena.begin());
+	}
+	if (A.folded) 
+	{
+		folded = new Layer(A.folded->ins, A.folded->outs, A.folded->last, 
+		                   _sigmoid_function, 0);
+		std::copy(A.folded->own_storage.begin(), A.folded->own_storage.end(), 
+		          folded->own_storage.begin());
+	}
+}
+//----------------------------------------------------------------------------
+template <typename T>
+inline BasicNetworkArchitecture<T>::~BasicNetworkArchitecture() 
 {
 	std::for_each(Bundle.begin(), Bundle.end(), delete_pointed_to<Layer>);
 	Bundle.clear();
+	delete_pointed_to(folded);
+	delete_pointed_to(mapping);
 }
 //----------------------------------------------------------------------------
-inline std::vector<double> NetworkArchitecture::test(std::vector<double> Event) 
+template <typename T>
+inline std::vector<double> BasicNetworkArchitecture<T>::test(std::vector<double> Event) 
 {
 	Bundle.at(0)->feed((Event));
 	unsigned int l;
@@ -188,46 +835,229 @@ inline std::vector<double> NetworkArchitecture::test(std::vector<double> Event)
 	return (Bundle.at(l - 1)->fire());
 }
 //----------------------------------------------------------------------------
-inline std::vector<std::vector<double> > NetworkArchitecture::get_first_layer()
+// Returns a view of the last layer's outputs in the context, valid until 
+// the context is next used.
+template <typename T>
+inline const T* BasicNetworkArchitecture<T>::test(const T* Event, 
+                                                  InferenceContext &context) const
 {
-	return Bundle.at(0)->Synapse;
+	prepare(context, 0);
+	input_layer().feed(Event, &context.outs[0][0]);
+	unsigned int l;
+
+	for (l = 1; l < (Bundle.size()); ++l)
+	{
+		Bundle[l]->feed(&context.outs[l - 1][0], &context.outs[l][0]);
+	}
+	return &context.outs[l - 1][0];
 }
-//-----------------------------------------------------------------------------
-//	CLASS: NEURALNET for dealing with serialization and final prediction
-//-----------------------------------------------------------------------------
-class NeuralNet
-{
-public:
 //----------------------------------------------------------------------------
-	NeuralNet( std::vector<int> structure);
-	NeuralNet();
-	~NeuralNet();
-	NeuralNet( NeuralNet &A );
-
-	bool load_specifications(std::stringstream& spec_file);
-	bool load_specifications(const std::string &filename);
-
-
-	void setActivationFunctions(
-		std::vector<double> (*sigmoid_function)(std::vector<double>),
-		double (*sigmoid_derivative)(double), 
-		std::vector<double> (*softmax_function) (std::vector<double>)
-		);
-
-	std::vector<double> transform( std::vector<double> Event );
+// Returns a row-major (n_events x outs) view of the last layer in the 
+// context, valid until the context is next used.
+template <typename T>
+inline const T* BasicNetworkArchitecture<T>::test_batch(const T* Events, 
+                                                        int n_events, 
+                                                        InferenceContext &context) const
+{
+	prepare(context, n_events);
+	input_layer().feed_batch(Events, n_events, &context.batch_outs[0][0]);
+	unsigned int l;
 
-	std::map<std::string, double> predict(std::map<std::string, double> Event);
-	NeuralNet& operator=( const NeuralNet &A );
-	bool load_net( const std::string &filename );
-	bool load_net( std::stringstream& net_file );
-private:
+	for (l = 1; l < (Bundle.size()); ++l)
+	{
+		Bundle[l]->feed_batch(&context.batch_outs[l - 1][0], n_events, 
+		                      &context.batch_outs[l][0]);
+	}
+	return &context.batch_outs[l - 1][0];
+}
 //----------------------------------------------------------------------------
-	NetworkArchitecture *Net;
-	std::vector<int> structure;
-	std::vector<std::string> input_names, output_names;
-	int count;
-	std::vector<double> mean, stddev, input_vector;
-	double (*_sigmoid_derivative) (double);
+// Sizes the per-layer buffers of a context for this net and for blocks of 
+// up to n_events jets. Only allocates the first time, or for larger blocks.
+template <typename T>
+inline void BasicNetworkArchitecture<T>::prepare(InferenceContext &context, 
+                                         int n_events) const
+{
+	if (context.outs.size() != Bundle.size()) 
+	{
+		context.outs.resize(Bundle.size());
+		context.batch_outs.resize(Bundle.size());
+	}
+	for (unsigned int l = 0; l < Bundle.size(); ++l) 
+	{
+		unsigned int n_batch = std::max(n_events, batch_size) * Bundle[l]->outs;
+		if (context.outs[l].size() != static_cast<unsigned int>(Bundle[l]->outs)) 
+		{
+			context.outs[l].assign(Bundle[l]->outs, T(0));
+		}
+		if (n_events > 0 && context.batch_outs[l].size() < n_batch) 
+		{
+			context.batch_outs[l].resize(n_batch, T(0));
+		}
+	}
+}
+//----------------------------------------------------------------------------
+template <typename T>
+inline std::vector<std::vector<double> > BasicNetworkArchitecture<T>::get_first_layer()
+{
+	const Layer &first = *Bundle.at(0);
+	std::vector<std::vector<double> > rows;
+	for (int i = 0; i <= first.ins; ++i)
+	{
+		rows.push_back(std::vector<double>(first.Synapse + i * first.outs, 
+		                                   first.Synapse + (i + 1) * first.outs));
+	}
+	return rows;
+}
+//----------------------------------------------------------------------------
+// With x' = (x - mean) / stddev, the first layer computes 
+//   sum_i w_ij x'_i + b_j = sum_i (w_ij / stddev_i) x_i 
+//                           + (b_j - sum_i w_ij mean_i / stddev_i), 
+// which is evaluated in double and stored at the precision of the net.
+template <typename T>
+inline void BasicNetworkArchitecture<T>::fold_normalization(const std::vector<double> &mean, 
+                                                            const std::vector<double> &stddev)
+{
+	unfold();
+	const Layer &first = *Bundle.at(0);
+	if (mean.size() != static_cast<unsigned int>(first.ins) || stddev.size() != mean.size()) 
+	{
+		return;
+	}
+	folded = new Layer(first.ins, first.outs, first.last, _sigmoid_function, 0);
+	std::vector<double> bias(first.outs);
+	for (int j = 0; j < first.outs; ++j) 
+	{
+		bias[j] = first.Synapse[first.ins * first.outs + j];
+	}
+	for (int i = 0; i < first.ins; ++i) 
+	{
+		double scale = (stddev[i] < 1e-7) ? 1e-4 : stddev[i]; // as in normalize_jet
+		for (int j = 0; j < first.outs; ++j) 
+		{
+			double weight = first.Synapse[i * first.outs + j] / scale;
+			folded->Synapse[i * first.outs + j] = static_cast<T>(weight);
+			bias[j] -= weight * mean[i];
+		}
+	}
+	for (int j = 0; j < first.outs; ++j) 
+	{
+		folded->Synapse[first.ins * first.outs + j] = static_cast<T>(bias[j]);
+	}
+}
+//----------------------------------------------------------------------------
+template <typename T>
+inline void BasicNetworkArchitecture<T>::unfold()
+{
+	delete_pointed_to(folded);
+	folded = 0;
+}
+//----------------------------------------------------------------------------
+template <typename T>
+inline bool BasicNetworkArchitecture<T>::is_folded() const
+{
+	return folded != 0;
+}
+//----------------------------------------------------------------------------
+template <typename T>
+inline const BasicLayer<T>& BasicNetworkArchitecture<T>::input_layer() const
+{
+	return folded ? *folded : *Bundle[0];
+}
+//-----------------------------------------------------------------------------
+//	CLASS: NEURALNET for dealing with serialization and final prediction
+//-----------------------------------------------------------------------------
+template <typename T>
+class BasicNeuralNet
+{
+public:
+//----------------------------------------------------------------------------
+	typedef BasicNetworkArchitecture<T> NetworkArchitecture;
+	typedef BasicInferenceContext<T> InferenceContext;
+	typedef BasicLayer<T> Layer;
+
+	BasicNeuralNet( std::vector<int> structure);
+	BasicNeuralNet();
+	~BasicNeuralNet();
+	BasicNeuralNet( BasicNeuralNet &A );
+
+	bool load_specifications(std::stringstream& spec_file);
+	bool load_specifications(const std::string &filename);
+
+
+	void setActivationFunctions(
+		std::vector<double> (*sigmoid_function)(std::vector<double>),
+		double (*sigmoid_derivative)(double), 
+		std::vector<double> (*softmax_function) (std::vector<double>)
+		);
+
+	std::vector<double> transform( std::vector<double> Event );
+
+	std::map<std::string, double> predict(const std::map<std::string, double> &Event);
+
+	// Scores one jet laid out as get_input_layout(), writing its class 
+	// probabilities into the caller's buffer in the order of 
+	// get_output_names(). Performs no heap allocation; returns false 
+	// (and zeroes probabilities) if the jet is outside the pt/eta range.
+	bool predict(const T* jet, T* probabilities);
+
+	// Scores n_jets at once. Row n of jets holds one jet in the order 
+	// given by get_input_layout(); row n of probabilities receives its 
+	// class probabilities in the order of get_output_names(). Jets outside 
+	// the classifiable pt/eta range are flagged false in the returned mask 
+	// and their probabilities are zeroed instead of throwing.
+	std::vector<bool> predict_batch(const T* jets, int n_jets, 
+	                                T* probabilities);
+
+	// Thread-safe forms of the above: the net itself is not modified, all 
+	// scratch space comes from the caller's context. The overloads without 
+	// a context share one built into the net and must not be called 
+	// concurrently.
+	std::map<std::string, double> predict(const std::map<std::string, double> &Event, 
+	                                      InferenceContext &context) const;
+	bool predict(const T* jet, T* probabilities, 
+	             InferenceContext &context) const;
+	std::vector<bool> predict_batch(const T* jets, int n_jets, 
+	                                T* probabilities, 
+	                                InferenceContext &context) const;
+	const std::vector<std::string>& get_input_layout() const;
+	const std::vector<std::string>& get_output_names() const;
+	int input_index(const std::string &name) const;
+	int output_index(const std::string &name) const;
+
+	BasicNeuralNet& operator=( const BasicNeuralNet &A );
+	bool load_net( const std::string &filename );
+	bool load_net( std::stringstream& net_file );
+
+	// Binary models (.nnb) carry the schema along with the weights and need 
+	// no spec file. Weights stored at the precision of this net are used in 
+	// place from the mapped file; others are converted while loading.
+	bool load_binary( const std::string &filename );
+	bool save_binary( const std::string &filename, int scalar_bytes = sizeof(T) ) const;
+	// Text forms of a loaded net, for turning a binary model back into a 
+	// .nnet and spec file.
+	bool save_net( const std::string &filename ) const;
+	bool save_specifications( const std::string &filename ) const;
+
+	// Rewrites the loaded net for scoring; every loader calls it. Currently 
+	// folds the input normalization into the first layer. optimize(false) 
+	// returns to evaluating the net literally, as a check on the pass.
+	void optimize( bool enable = true );
+private:
+//----------------------------------------------------------------------------
+	friend class QuantizedNeuralNet;
+	bool load_net_text(const std::string &text);
+	void compile_schema();
+	void prepare_input(const T* jet, int cat_pT, int cat_eta, T* input) const;
+	void prepare(InferenceContext &context) const;
+	NetworkArchitecture *Net;
+	std::vector<int> structure;
+	std::vector<std::string> input_names, output_names, layout_names;
+	std::vector<int> layout_index;
+	std::string spec_text; // as read, for writing back out
+	int count, pt_slot, eta_slot;
+	std::vector<double> mean, stddev;
+	InferenceContext default_context;
+	double (*_sigmoid_derivative) (double);
 	std::vector<double> (*_softmax_function) (std::vector<double>);
 	std::vector<double> (*_sigmoid) (std::vector<double>);
 };
@@ -235,7 +1065,8 @@ private:
 //-----------------------------------------------------------------------------
 //	Implementation of CLASS: NEURALNET
 //-----------------------------------------------------------------------------
-NeuralNet::NeuralNet(std::vector<int> structure): 
+template <typename T>
+inline BasicNeuralNet<T>::BasicNeuralNet(std::vector<int> structure): 
 	Net(0), 
         structure( structure ), 
         mean(structure.at(0), 0.0), 
@@ -245,38 +1076,33 @@ NeuralNet::NeuralNet(std::vector<int> structure):
 	Net = new NetworkArchitecture(structure, _sigmoid, _sigmoid_derivative);
 }
 //----------------------------------------------------------------------------
-NeuralNet::NeuralNet(): Net(0)
+template <typename T>
+inline BasicNeuralNet<T>::BasicNeuralNet(): Net(0)
 {
 }
 //----------------------------------------------------------------------------
-NeuralNet::~NeuralNet() 
+template <typename T>
+inline BasicNeuralNet<T>::~BasicNeuralNet() 
 {
 	delete_pointed_to(Net);
 }
 //----------------------------------------------------------------------------
-NeuralNet::NeuralNet(NeuralNet &A) : 
-	Net(new NetworkArchitecture(A.Net->structure, 
-		A.Net->_sigmoid_function, 
-		A.Net->_sigmoid_derivative)) 
+template <typename T>
+inline BasicNeuralNet<T>::BasicNeuralNet(BasicNeuralNet &A) : 
+	Net(new NetworkArchitecture(*A.Net)), 
+	structure(A.structure), 
+	input_names(A.input_names), output_names(A.output_names), 
+	layout_names(A.layout_names), layout_index(A.layout_index), 
+	spec_text(A.spec_text), pt_slot(A.pt_slot), eta_slot(A.eta_slot), 
+	mean(A.mean), stddev(A.stddev)
 {
 	setActivationFunctions(A._sigmoid, 
                            A._sigmoid_derivative, 
                            A._softmax_function);
-
-	for (unsigned int l = 0; l < Net->Bundle.size(); ++l) 
-	{
-		for (int i = 0; i <= Net->Bundle.at(l)->ins; ++i) 
-		{
-			for (int j = 0; j < Net->Bundle.at(l)->outs; ++j) 
-			{
-				Net->Bundle.at(l)->Synapse.at(i).at(j) = 
-								A.Net->Bundle.at(l)->Synapse.at(i).at(j);
-			}
-		}
-	}
 }
 //----------------------------------------------------------------------------
-inline NeuralNet& NeuralNet::operator=(const NeuralNet &A)  
+template <typename T>
+inline BasicNeuralNet<T>& BasicNeuralNet<T>::operator=(const BasicNeuralNet &A)  
 {
 	if(this == &A)  
 	{ 
@@ -284,25 +1110,27 @@ inline NeuralNet& NeuralNet::operator=(const NeuralNet &A)
 	} 
 	else  
 	{
-		Net = new NetworkArchitecture(A.Net->structure, 
-                                      A.Net->_sigmoid_function, 
-                                      A.Net->_sigmoid_derivative);
-		for (unsigned int l = 0; l < Net->Bundle.size(); ++l) 
-		{
-			for (int i = 0; i <= Net->Bundle.at(l)->ins; ++i) 
-			{
-				for (int j = 0; j < Net->Bundle.at(l)->outs; ++j) 
-				{
-					Net->Bundle.at(l)->Synapse.at(i).at(j) = 
-                              A.Net->Bundle.at(l)->Synapse.at(i).at(j);
-				}
-			}
-		}
+		delete_pointed_to(Net);
+		Net = new NetworkArchitecture(*A.Net);
+		structure = A.structure;
+		input_names = A.input_names;
+		output_names = A.output_names;
+		layout_names = A.layout_names;
+		layout_index = A.layout_index;
+		spec_text = A.spec_text;
+		pt_slot = A.pt_slot;
+		eta_slot = A.eta_slot;
+		mean = A.mean;
+		stddev = A.stddev;
+		setActivationFunctions(A._sigmoid, 
+		                       A._sigmoid_derivative, 
+		                       A._softmax_function);
 		return *this;
 	}
 }
 //----------------------------------------------------------------------------
-inline void NeuralNet::setActivationFunctions(
+template <typename T>
+inline void BasicNeuralNet<T>::setActivationFunctions(
 				std::vector<double> (*sigmoid_function) (std::vector<double>),
 				double (*sigmoid_derivative)(double), 
 				std::vector<double> (*softmax_function) (std::vector<double>))
@@ -312,34 +1140,228 @@ inline void NeuralNet::setActivationFunctions(
 	_sigmoid = sigmoid_function;
 }
 //----------------------------------------------------------------------------
-inline std::map<std::string, double> NeuralNet::predict(
-									std::map<std::string, double> Event) 
+template <typename T>
+inline std::map<std::string, double> BasicNeuralNet<T>::predict(
+							const std::map<std::string, double> &Event) 
+{
+	return predict(Event, default_context);
+}
+//----------------------------------------------------------------------------
+template <typename T>
+inline bool BasicNeuralNet<T>::predict(const T* jet, T* probabilities) 
 {
-	int ptr = 0;
-	set_physics_category(find_or_throw(Event,"pt"), 
-        find_or_throw(Event,"eta"), Event);
-	for (std::vector<std::string>::iterator entry = input_names.begin(); 
-        entry != input_names.end(); ++entry)
+	return predict(jet, probabilities, default_context);
+}
+//----------------------------------------------------------------------------
+template <typename T>
+inline std::vector<bool> BasicNeuralNet<T>::predict_batch(const T* jets, 
+                                                          int n_jets, 
+                                                          T* probabilities) 
+{
+	return predict_batch(jets, n_jets, probabilities, default_context);
+}
+//----------------------------------------------------------------------------
+template <typename T>
+inline std::map<std::string, double> BasicNeuralNet<T>::predict(
+							const std::map<std::string, double> &Event, 
+							InferenceContext &context) const
+{
+	prepare(context);
+	for (unsigned int i = 0; i < layout_names.size(); ++i)
 	{
-		input_vector.at(ptr) = find_or_throw(Event, *entry);
-		++ptr;
+		context.jet_vector[i] = find_or_throw(Event, layout_names[i]);
+	}
+	std::vector<T> predicted(output_names.size());
+	if (!predict(&context.jet_vector[0], &predicted[0], context)) 
+	{
+		std::map<std::string, double> categories;
+		set_physics_category(context.jet_vector[pt_slot], 
+		                     context.jet_vector[eta_slot], categories);
 	}
-	ptr = 0;
-
-	std::vector<double> predicted = _softmax_function(Net->test( transform(input_vector) ));
 
 	std::map<std::string, double> outputs;
 
-	for (std::vector<double>::iterator entry = predicted.begin();
-        entry != predicted.end(); ++entry)
+	for (unsigned int ptr = 0; ptr < predicted.size(); ++ptr)
 	{
-		outputs[output_names[ptr]] = *entry;
-		ptr++;
+		outputs[output_names[ptr]] = predicted[ptr];
 	}
 	return outputs;
 }
 //----------------------------------------------------------------------------
-inline std::vector<double> NeuralNet::transform(std::vector<double> Event) // work
+template <typename T>
+inline bool BasicNeuralNet<T>::predict(const T* jet, T* probabilities, 
+                                       InferenceContext &context) const
+{
+	int n_outputs = output_names.size();
+	int cat_pT = 0, cat_eta = 0;
+	if (!find_physics_category(jet[pt_slot], jet[eta_slot], cat_pT, cat_eta)) 
+	{
+		std::fill(probabilities, probabilities + n_outputs, T(0));
+		return false;
+	}
+	prepare(context);
+	T* input_vector = &context.input_vector[0];
+	prepare_input(jet, cat_pT, cat_eta, input_vector);
+	const T* scores = Net->test(input_vector, context);
+	std::copy(scores, scores + n_outputs, probabilities);
+	softmax_inplace(probabilities, n_outputs);
+	return true;
+}
+//----------------------------------------------------------------------------
+template <typename T>
+inline std::vector<bool> BasicNeuralNet<T>::predict_batch(const T* jets, 
+                                                          int n_jets, 
+                                                          T* probabilities, 
+                                                          InferenceContext &context) const
+{
+	std::vector<bool> valid(n_jets, false);
+	int n_layout = layout_names.size();
+	int n_inputs = input_names.size();
+	int n_outputs = output_names.size();
+	prepare(context);
+
+	for (int first = 0; first < n_jets; first += batch_size) 
+	{
+		int n_block = std::min(batch_size, n_jets - first);
+		for (int n = 0; n < n_block; ++n) 
+		{
+			const T* jet = jets + (first + n) * n_layout;
+			T* row = &context.batch_input[n * n_inputs];
+			int cat_pT = 0, cat_eta = 0;
+			valid[first + n] = find_physics_category(jet[pt_slot], 
+			                                         jet[eta_slot], 
+			                                         cat_pT, cat_eta);
+			prepare_input(jet, cat_pT, cat_eta, row);
+		}
+
+		const T* scores = Net->test_batch(&context.batch_input[0], 
+		                                       n_block, context);
+
+		for (int n = 0; n < n_block; ++n) 
+		{
+			T* out = probabilities + (first + n) * n_outputs;
+			if (!valid[first + n]) 
+			{
+				std::fill(out, out + n_outputs, T(0));
+				continue;
+			}
+			std::copy(scores + n * n_outputs, scores + (n + 1) * n_outputs, out);
+			softmax_inplace(out, n_outputs);
+		}
+	}
+	return valid;
+}
+//----------------------------------------------------------------------------
+template <typename T>
+inline void BasicNeuralNet<T>::optimize(bool enable)
+{
+	if (enable) 
+	{
+		Net->fold_normalization(mean, stddev);
+	}
+	else 
+	{
+		Net->unfold();
+	}
+}
+//----------------------------------------------------------------------------
+// The first layer input of one jet, normalized unless the net has the 
+// normalization folded in.
+template <typename T>
+inline void BasicNeuralNet<T>::prepare_input(const T* jet, int cat_pT, int cat_eta, 
+                                             T* input) const
+{
+	if (Net->is_folded()) 
+	{
+		gather_jet(jet, cat_pT, cat_eta, layout_index, input);
+	}
+	else 
+	{
+		normalize_jet(jet, cat_pT, cat_eta, layout_index, mean, stddev, input);
+	}
+}
+//----------------------------------------------------------------------------
+template <typename T>
+inline void BasicNeuralNet<T>::prepare(InferenceContext &context) const
+{
+	if (context.jet_vector.size() != layout_names.size()) 
+	{
+		context.input_vector.assign(input_names.size(), T(0));
+		context.batch_input.assign(batch_size * input_names.size(), T(0));
+		context.jet_vector.assign(layout_names.size(), T(0));
+	}
+}
+//----------------------------------------------------------------------------
+template <typename T>
+inline const std::vector<std::string>& BasicNeuralNet<T>::get_input_layout() const
+{
+	return layout_names;
+}
+//----------------------------------------------------------------------------
+template <typename T>
+inline const std::vector<std::string>& BasicNeuralNet<T>::get_output_names() const
+{
+	return output_names;
+}
+//----------------------------------------------------------------------------
+// Position of a variable in get_input_layout(), or -1 if the net does not 
+// use it. Meant to be resolved once when binding a caller's jet struct.
+template <typename T>
+inline int BasicNeuralNet<T>::input_index(const std::string &name) const
+{
+	std::vector<std::string>::const_iterator entry = 
+		std::find(layout_names.begin(), layout_names.end(), name);
+	return (entry == layout_names.end()) ? -1 : entry - layout_names.begin();
+}
+//----------------------------------------------------------------------------
+template <typename T>
+inline int BasicNeuralNet<T>::output_index(const std::string &name) const
+{
+	std::vector<std::string>::const_iterator entry = 
+		std::find(output_names.begin(), output_names.end(), name);
+	return (entry == output_names.end()) ? -1 : entry - output_names.begin();
+}
+//----------------------------------------------------------------------------
+// The batch layout is every input except the physics categories, followed 
+// by pt and eta (unless they are already inputs), from which the categories 
+// are computed per jet. layout_index maps each network input to its column, 
+// with -1 and -2 standing for cat_pT and cat_eta.
+template <typename T>
+inline void BasicNeuralNet<T>::compile_schema()
+{
+	layout_names.clear();
+	layout_index.clear();
+	for (std::vector<std::string>::iterator entry = input_names.begin(); 
+        entry != input_names.end(); ++entry)
+	{
+		if (*entry == "cat_pT") 
+		{
+			layout_index.push_back(-1);
+		}
+		else if (*entry == "cat_eta") 
+		{
+			layout_index.push_back(-2);
+		}
+		else 
+		{
+			layout_index.push_back(layout_names.size());
+			layout_names.push_back(*entry);
+		}
+	}
+	pt_slot = std::find(layout_names.begin(), layout_names.end(), "pt") - layout_names.begin();
+	if (pt_slot == static_cast<int>(layout_names.size())) 
+	{
+		layout_names.push_back("pt");
+	}
+	eta_slot = std::find(layout_names.begin(), layout_names.end(), "eta") - layout_names.begin();
+	if (eta_slot == static_cast<int>(layout_names.size())) 
+	{
+		layout_names.push_back("eta");
+	}
+}
+//----------------------------------------------------------------------------
+template <typename T>
+inline std::vector<double> BasicNeuralNet<T>::transform(std::vector<double> Event) // work
 {
 	for (unsigned int i = 0; i < mean.size(); ++i) 
 	{
@@ -349,237 +1371,53 @@ inline std::vector<double> NeuralNet::transform(std::vector<double> Event) // wo
 	return (Event);
 }
 //----------------------------------------------------------------------------
-inline bool NeuralNet::load_net(const std::string &filename) 
+template <typename T>
+inline bool BasicNeuralNet<T>::load_net(const std::string &filename) 
 {
-    std::string s;
-    std::ifstream net_file( filename.c_str() );
+    std::ifstream net_file( filename.c_str(), std::ios::binary );
     if (!net_file.is_open()) 
     {
         std::cout << "\nError: File name " << filename << " not found." << std::endl;
         return 0;
     }
-    std::getline( net_file, s );
-    if ((s != "#->NNET")) 
-    {
-    	std::cout << "\nError: file type not recognised." << std::endl;
-    	return 0;
-    }
-    std::getline( net_file, s );
-    std::istringstream iss( s );
-    std::vector<unsigned int> params;
-    while (std::getline(iss, s, ',')) 
-    {
-        unsigned int fieldvalue = 0u;
-        std::istringstream( s ) >> fieldvalue;
-        params.push_back( fieldvalue );
-    }
-    std::vector<int> layer_struct;
-    for (unsigned int i = 1; i < params.size(); ++i) 
-    {
-    	layer_struct.push_back(params.at(i));
-    }
-
-    Net = new NetworkArchitecture(layer_struct, sigmoid, dsig);
-    setActivationFunctions(sigmoid, dsig, softmax);
-
-    std::getline( net_file, s );
-    std::istringstream n_iss( s );
-    params.clear();
-    while (std::getline(n_iss, s, '?')) 
-    {
-        unsigned int fieldvalue = 0.00;
-        std::istringstream( s ) >> fieldvalue;
-        params.push_back( fieldvalue );
-    }
-    bool synapse_phase = 0;
-    int row_count = -1;
-    int layer_count = -1;
-    int trans_count = 0;
-    while (std::getline( net_file, s )) 
-    {
-    	if (s == "BUNDLE") 
-    	{
-    		synapse_phase = 1;
-    		layer_count++;
-    		row_count = -1;
-    	}
-    	else if (s == "TRANS") 
-    	{
-    		synapse_phase = 0;
-    	}
-    	else if (synapse_phase) 
-    	{
-    		row_count++;
-    		std::vector<double> record;
-	        std::istringstream iss( s );
-	        while (std::getline( iss, s, ',' )) 
-	        {
-	            double fieldvalue = 0.0;
-	            std::istringstream( s ) >> fieldvalue;
-	            record.push_back( fieldvalue );
-	        }
-	        for (unsigned int i = 0; i < record.size(); ++i) 
-	        {
-	        	(Net->Bundle.at(layer_count))->Synapse.at(row_count).at(i) = record.at(i);
-	        }
-    	}
-		
-
-    	else if ((!synapse_phase) & (trans_count == 0)) 
-    	{
-    		trans_count++;
-    		std::vector<double> record;
-	        std::istringstream iss( s );
-	        while (std::getline( iss, s, ',' )) 
-	        {
-	            double fieldvalue = 0.0;
-	            std::istringstream( s ) >> fieldvalue;
-	            record.push_back( fieldvalue );
-	        }
-	        mean.resize(record.size());
-	        for (unsigned int i = 0; i < record.size(); ++i) 
-	        {
-	        	mean.at(i) = record.at(i);
-	        }
-    	}
-    	else if ((!synapse_phase) & (trans_count == 1)) 
-    	{
-    		trans_count++;
-    		std::vector<double> record;
-	        std::istringstream iss( s );
-	        while (std::getline( iss, s, ',' )) 
-	        {
-	            double fieldvalue = 0.0;
-	            std::istringstream( s ) >> fieldvalue;
-
-	            record.push_back( fieldvalue );
-	        }
-	        stddev.resize(record.size());
-			
-
-	        for (unsigned int i = 0; i < record.size(); ++i) 
-	        {
-	        	stddev.at(i) = record.at(i);
-	        }
-
-    	}
-    }
-    return net_file.good();
+    std::stringstream text;
+    text << net_file.rdbuf();
+    return load_net_text(text.str());
 }
-
-inline bool NeuralNet::load_net(std::stringstream& net_file) 
+//----------------------------------------------------------------------------
+template <typename T>
+inline bool BasicNeuralNet<T>::load_net(std::stringstream& net_file) 
 {
-    std::string s;
-    std::getline( net_file, s );
-    if ((s != "#->NNET")) 
-    {
-    	std::cout << "\nError: file type not recognised." << std::endl;
-    	return 0;
-    }
-    std::getline( net_file, s );
-    std::istringstream iss( s );
-    std::vector<unsigned int> params;
-    while (std::getline(iss, s, ',')) 
-    {
-        unsigned int fieldvalue = 0u;
-        std::istringstream( s ) >> fieldvalue;
-        params.push_back( fieldvalue );
-    }
-    std::vector<int> layer_struct;
-    for (unsigned int i = 1; i < params.size(); ++i) 
+    std::streamoff start = net_file.tellg();
+    return load_net_text(net_file.str().substr(std::max<std::streamoff>(start, 0)));
+}
+//----------------------------------------------------------------------------
+template <typename T>
+inline bool BasicNeuralNet<T>::load_net_text(const std::string &text) 
+{
+    NetText parsed;
+    if (!parse_net_text(text, parsed)) 
     {
-    	layer_struct.push_back(params.at(i));
+    	return false;
     }
-
-    Net = new NetworkArchitecture(layer_struct, sigmoid, dsig);
+    delete_pointed_to(Net);
+    Net = new NetworkArchitecture(parsed.structure, sigmoid, dsig);
     setActivationFunctions(sigmoid, dsig, softmax);
-
-    std::getline( net_file, s );
-    std::istringstream n_iss( s );
-    params.clear();
-    while (std::getline(n_iss, s, '?')) 
-    {
-        unsigned int fieldvalue = 0.00;
-        std::istringstream( s ) >> fieldvalue;
-        params.push_back( fieldvalue );
-    }
-    bool synapse_phase = 0;
-    int row_count = -1;
-    int layer_count = -1;
-    int trans_count = 0;
-    while (std::getline( net_file, s )) 
+    const double* weights = &parsed.weights[0];
+    for (unsigned int l = 0; l < Net->Bundle.size(); ++l) 
     {
-    	if (s == "BUNDLE") 
-    	{
-    		synapse_phase = 1;
-    		layer_count++;
-    		row_count = -1;
-    	}
-    	else if (s == "TRANS") 
-    	{
-    		synapse_phase = 0;
-    	}
-    	else if (synapse_phase) 
-    	{
-    		row_count++;
-    		std::vector<double> record;
-	        std::istringstream iss( s );
-	        while (std::getline( iss, s, ',' )) 
-	        {
-	            double fieldvalue = 0.0;
-	            std::istringstream( s ) >> fieldvalue;
-	            record.push_back( fieldvalue );
-	        }
-	        for (unsigned int i = 0; i < record.size(); ++i) 
-	        {
-	        	(Net->Bundle.at(layer_count))->Synapse.at(row_count).at(i) = record.at(i);
-	        }
-    	}
-		
-
-    	else if ((!synapse_phase) & (trans_count == 0)) 
-    	{
-    		trans_count++;
-    		std::vector<double> record;
-	        std::istringstream iss( s );
-	        while (std::getline( iss, s, ',' )) 
-	        {
-	            double fieldvalue = 0.0;
-	            std::istringstream( s ) >> fieldvalue;
-	            record.push_back( fieldvalue );
-	        }
-	        mean.resize(record.size());
-	        for (unsigned int i = 0; i < record.size(); ++i) 
-	        {
-	        	mean.at(i) = record.at(i);
-	        }
-    	}
-    	else if ((!synapse_phase) & (trans_count == 1)) 
-    	{
-    		trans_count++;
-    		std::vector<double> record;
-	        std::istringstream iss( s );
-	        while (std::getline( iss, s, ',' )) 
-	        {
-	            double fieldvalue = 0.0;
-	            std::istringstream( s ) >> fieldvalue;
-
-	            record.push_back( fieldvalue );
-	        }
-	        stddev.resize(record.size());
-			
-
-	        for (unsigned int i = 0; i < record.size(); ++i) 
-	        {
-	        	stddev.at(i) = record.at(i);
-	        }
-
-    	}
+    	Layer &layer = *Net->Bundle[l];
+    	std::copy(weights, weights + (layer.ins + 1) * layer.outs, layer.Synapse);
+    	weights += (layer.ins + 1) * layer.outs;
     }
-    return !net_file.bad();
+    mean.swap(parsed.mean);
+    stddev.swap(parsed.stddev);
+    optimize();
+    return true;
 }
 
-inline bool NeuralNet::load_specifications(const std::string &filename)
+template <typename T>
+inline bool BasicNeuralNet<T>::load_specifications(const std::string &filename)
 {
 	std::string line;
     std::ifstream FILE( filename.c_str() );
@@ -591,6 +1429,7 @@ inline bool NeuralNet::load_specifications(const std::string &filename)
     }
     while(std::getline( FILE, line ))
     {
+    	spec_text += line + "\n";
     	line = trim(line);
     	if (line == "input:")
     	{
@@ -610,6 +1449,12 @@ inline bool NeuralNet::load_specifications(const std::string &filename)
     		input_phase = false;
     		output_phase = false;
     	}
+    	if (line == "selection:") // the training selection, not needed to score
+    	{
+    		control_phase = true;
+    		input_phase = false;
+    		output_phase = false;
+    	}
     	if (line[0] != '#')
     	{
     		if (input_phase)
@@ -641,16 +1486,18 @@ inline bool NeuralNet::load_specifications(const std::string &filename)
     		return false;
     	}
     }
-    input_vector.resize(input_names.size(), 0.0);
-    return FILE.good();
+    compile_schema();
+    return !FILE.bad();
 }
 //----------------------------------------------------------------------------
-inline bool NeuralNet::load_specifications(std::stringstream& spec_file)
+template <typename T>
+inline bool BasicNeuralNet<T>::load_specifications(std::stringstream& spec_file)
 {
 	std::string line;
     bool input_phase = false, output_phase = false, control_phase = false;
     while(std::getline( spec_file, line ))
     {
+    	spec_text += line + "\n";
     	line = trim(line);
     	if (line == "input:")
     	{
@@ -670,6 +1517,12 @@ inline bool NeuralNet::load_specifications(std::stringstream& spec_file)
     		input_phase = false;
     		output_phase = false;
     	}
+    	if (line == "selection:") // the training selection, not needed to score
+    	{
+    		control_phase = true;
+    		input_phase = false;
+    		output_phase = false;
+    	}
     	if (line[0] != '#')
     	{
     		if (input_phase)
@@ -701,57 +1554,1690 @@ inline bool NeuralNet::load_specifications(std::stringstream& spec_file)
     		return false;
     	}
     }
-    input_vector.resize(input_names.size(), 0.0);
+    compile_schema();
     return !spec_file.bad();
 }
+//----------------------------------------------------------------------------
+template <typename T>
+inline bool BasicNeuralNet<T>::load_binary(const std::string &filename)
+{
+	MappedFile *file = new MappedFile;
+	BinaryModelHeader header;
+	if (!file->open(filename) || file->size() < sizeof(header)) 
+	{
+		std::cout << "\nError: Binary model " << filename << " not found or empty." << std::endl;
+		delete file;
+		return false;
+	}
+	std::memcpy(&header, file->begin(), sizeof(header));
+	std::size_t size = file->size();
+	const char* failure = 0;
+	if (std::memcmp(header.magic, binary_magic, sizeof(binary_magic)) != 0) 
+	{
+		failure = "file type not recognised";
+	}
+	else if (header.byte_order != binary_byte_order) 
+	{
+		failure = "written with a different byte order";
+	}
+	else if (header.version != binary_version) 
+	{
+		failure = "format version not supported";
+	}
+	else if ((header.scalar_bytes != sizeof(double) && header.scalar_bytes != sizeof(float)) || 
+	         header.activation != binary_sigmoid_softmax || header.n_layers < 2 || 
+	         header.n_layers > binary_max_layers) 
+	{
+		failure = "model not supported";
+	}
+	else if (header.file_bytes != size || 
+	         !binary_section_fits(header.structure_offset, 4 * uint64_t(header.n_layers), size) || 
+	         !binary_section_fits(header.schema_offset, header.schema_bytes, size) || 
+	         !binary_section_fits(header.weights_offset, header.weights_bytes, size) || 
+	         header.weights_offset % AlignedAllocator<T>::alignment) 
+	{
+		failure = "file truncated or corrupt";
+	}
+	std::vector<int> layer_struct;
+	if (!failure) 
+	{
+		layer_struct.resize(header.n_layers);
+		for (unsigned int l = 0; l < header.n_layers; ++l) 
+		{
+			uint32_t n;
+			std::memcpy(&n, file->begin() + header.structure_offset + 4 * l, 4);
+			if (n == 0 || n > binary_max_layer_size) 
+			{
+				failure = "layer size not supported";
+				break;
+			}
+			layer_struct[l] = n;
+		}
+	}
+	if (!failure) 
+	{
+		uint64_t expected = (header.scalar_bytes == sizeof(float)) ? 
+			uint64_t(arena_size<float>(layer_struct)) * sizeof(float) : 
+			uint64_t(arena_size<double>(layer_struct)) * sizeof(double);
+		if (header.weights_bytes != expected || 
+		    !binary_section_fits(header.transform_offset, 
+		                         2 * sizeof(double) * uint64_t(layer_struct[0]), size)) 
+		{
+			failure = "file truncated or corrupt";
+		}
+	}
+	if (failure) 
+	{
+		std::cout << "\nError: Binary model " << filename << ": " << failure << "." << std::endl;
+		delete file;
+		return false;
+	}
+
+	mean.resize(layer_struct[0]);
+	stddev.resize(layer_struct[0]);
+	const char* transform = file->begin() + header.transform_offset;
+	std::memcpy(&mean[0], transform, sizeof(double) * mean.size());
+	std::memcpy(&stddev[0], transform + sizeof(double) * mean.size(), 
+	            sizeof(double) * stddev.size());
+
+	std::stringstream schema(std::string(file->begin() + header.schema_offset, 
+	                                     header.schema_bytes));
+	input_names.clear();
+	output_names.clear();
+	spec_text.clear();
+	if (!load_specifications(schema)) 
+	{
+		delete file;
+		return false;
+	}
+
+	delete_pointed_to(Net);
+	const char* weights = file->begin() + header.weights_offset;
+	if (header.scalar_bytes == sizeof(T)) 
+	{
+		Net = new NetworkArchitecture(layer_struct, sigmoid, dsig, file, 
+		                              reinterpret_cast<const T*>(weights));
+	}
+	else 
+	{
+		Net = new NetworkArchitecture(layer_struct, sigmoid, dsig);
+		if (header.scalar_bytes == sizeof(float)) 
+		{
+			convert_arena(reinterpret_cast<const float*>(weights), layer_struct, &Net->arena[0]);
+		}
+		else 
+		{
+			convert_arena(reinterpret_cast<const double*>(weights), layer_struct, &Net->arena[0]);
+		}
+		delete file;
+	}
+	structure = layer_struct;
+	setActivationFunctions(sigmoid, dsig, softmax);
+	optimize();
+	return true;
+}
+//----------------------------------------------------------------------------
+template <typename T>
+inline bool BasicNeuralNet<T>::save_binary(const std::string &filename, 
+                                           int scalar_bytes) const
+{
+	if (!Net || (scalar_bytes != sizeof(double) && scalar_bytes != sizeof(float))) 
+	{
+		std::cout << "\nError: nothing to save, or unsupported precision." << std::endl;
+		return false;
+	}
+	const std::vector<int> &layer_struct = Net->structure;
+	if (mean.size() != static_cast<unsigned int>(layer_struct[0]) || 
+	    stddev.size() != mean.size()) 
+	{
+		std::cout << "\nError: normalization does not match the input layer." << std::endl;
+		return false;
+	}
+	BinaryModelHeader header;
+	std::memset(&header, 0, sizeof(header));
+	std::memcpy(header.magic, binary_magic, sizeof(binary_magic));
+	header.version = binary_version;
+	header.byte_order = binary_byte_order;
+	header.scalar_bytes = scalar_bytes;
+	header.activation = binary_sigmoid_softmax;
+	header.n_layers = layer_struct.size();
+	header.structure_offset = sizeof(header);
+	header.transform_offset = (header.structure_offset + 4 * header.n_layers + 7) & ~uint64_t(7);
+	header.schema_offset = header.transform_offset + 2 * sizeof(double) * mean.size();
+	header.schema_bytes = spec_text.size();
+	header.weights_offset = (header.schema_offset + header.schema_bytes + 63) & ~uint64_t(63);
+
+	std::vector<char> weights;
+	if (scalar_bytes == sizeof(float)) 
+	{
+		std::vector<float> arena(arena_size<float>(layer_struct));
+		convert_arena(Net->Bundle[0]->Synapse, layer_struct, &arena[0]);
+		weights.assign(reinterpret_cast<const char*>(&arena[0]), 
+		               reinterpret_cast<const char*>(&arena[0] + arena.size()));
+	}
+	else 
+	{
+		std::vector<double> arena(arena_size<double>(layer_struct));
+		convert_arena(Net->Bundle[0]->Synapse, layer_struct, &arena[0]);
+		weights.assign(reinterpret_cast<const char*>(&arena[0]), 
+		               reinterpret_cast<const char*>(&arena[0] + arena.size()));
+	}
+	header.weights_bytes = weights.size();
+	header.file_bytes = header.weights_offset + header.weights_bytes;
+
+	std::vector<char> image(header.file_bytes, 0);
+	std::memcpy(&image[0], &header, sizeof(header));
+	for (unsigned int l = 0; l < header.n_layers; ++l) 
+	{
+		uint32_t n = layer_struct[l];
+		std::memcpy(&image[header.structure_offset + 4 * l], &n, 4);
+	}
+	std::memcpy(&image[header.transform_offset], &mean[0], sizeof(double) * mean.size());
+	std::memcpy(&image[header.transform_offset + sizeof(double) * mean.size()], 
+	            &stddev[0], sizeof(double) * stddev.size());
+	std::copy(spec_text.begin(), spec_text.end(), image.begin() + header.schema_offset);
+	std::copy(weights.begin(), weights.end(), image.begin() + header.weights_offset);
+
+	std::ofstream file(filename.c_str(), std::ios::binary);
+	if (!file.is_open()) 
+	{
+		std::cout << "\nError: File name " << filename << " invalid." << std::endl;
+		return false;
+	}
+	file.write(&image[0], image.size());
+	return file.good();
+}
+//----------------------------------------------------------------------------
+// Writes the .nnet text the trainer saves, at full precision. The header 
+// does not keep the learning rate and momentum, which are written as 0.
+template <typename T>
+inline bool BasicNeuralNet<T>::save_net(const std::string &filename) const
+{
+	std::ofstream net_file( filename.c_str() );
+	if (!Net || !net_file.is_open()) 
+	{
+		std::cout << "\nError: File name " << filename << " invalid." << std::endl;
+		return false;
+	}
+	net_file << std::setprecision(17);
+	net_file << "#->NNET\n";
+	net_file << 0;
+	for (unsigned int i = 0; i < Net->structure.size(); ++i) 
+	{
+		net_file << ", " << Net->structure[i];
+	}
+	net_file << "\n" << 0 << "?" << 0 << "\n";
+	for (unsigned int l = 0; l < Net->Bundle.size(); ++l) 
+	{
+		net_file << "BUNDLE\n";
+		const Layer &layer = *Net->Bundle[l];
+		for (int i = 0; i <= layer.ins; ++i) 
+		{
+			const T* row = layer.Synapse + i * layer.outs;
+			for (int j = 0; j < (layer.outs - 1); ++j) 
+			{
+				net_file << row[j] << ", ";
+			}
+			net_file << row[layer.outs - 1] << "\n";
+		}
+	}
+	net_file << "TRANS\n";
+	for (unsigned int j = 0; j < mean.size(); ++j) 
+	{
+		net_file << mean[j] << ((j + 1 < mean.size()) ? ", " : "\n");
+	}
+	for (unsigned int j = 0; j < stddev.size(); ++j) 
+	{
+		net_file << stddev[j] << ((j + 1 < stddev.size()) ? ", " : "\n");
+	}
+	return net_file.good();
+}
+//----------------------------------------------------------------------------
+template <typename T>
+inline bool BasicNeuralNet<T>::save_specifications(const std::string &filename) const
+{
+	std::ofstream spec_file( filename.c_str() );
+	if (!spec_file.is_open()) 
+	{
+		std::cout << "\nError: Specification file name " << filename << " invalid." << std::endl;
+		return false;
+	}
+	spec_file << spec_text;
+	return spec_file.good();
+}
+
+//-----------------------------------------------------------------------------
+//	CLASS: QUANTIZEDNEURALNET for int8 scoring
+//-----------------------------------------------------------------------------
+// Weights are quantized to int8 with one scale per output channel, and the 
+// activations entering each layer with one scale per layer, chosen from 
+// the range the double model reaches on a sample of calibration jets 
+// (unsigned levels for layers fed by a sigmoid, signed otherwise). The 
+// products are summed exactly in 32 bit integers and rescaled to float, 
+// where the bias, sigmoid and softmax are applied. The int8 weights are 
+// held widened to 16 bits with pairs of input rows interleaved, the layout 
+// the SSE2/AVX2 multiply-add instructions consume; even so a typical 
+// tagger fits in a few kilobytes, well inside L1.
+const double calibration_percentile = 0.9999; // of |activation|, clips outliers
+const int quantized_lanes = 8; // outputs are padded to a multiple of this
+
+struct QuantizedLayer
+{
+	int ins, outs, padded_outs;
+	bool last;
+	float input_scale;
+	int lowest_level; // 0 for unsigned activations, -127 for signed
+	std::vector<float> weight_scales, output_scales, bias;
+	// ((ins + 1) / 2) x padded_outs pairs {row 2p, row 2p + 1}
+	std::vector<short> weights;
+};
+
+class QuantizedContext
+{
+private:
+	friend class QuantizedNeuralNet;
+	std::vector<float> input, activations;
+	std::vector<short> quantized;
+	std::vector<int> accumulators;
+};
+
+class QuantizedNeuralNet
+{
+public:
+//----------------------------------------------------------------------------
+	QuantizedNeuralNet();
+	// Quantizes the weights of reference, with the activation ranges taken 
+	// from scoring n_jets calibration jets, laid out as get_input_layout(), 
+	// through it. Jets outside the pt/eta range are ignored.
+	QuantizedNeuralNet(const NeuralNet &reference, const double* jets, int n_jets);
+
+	// Quantized weights are kept in their own file next to the .nnet; the 
+	// schema and input normalization are taken from the reference net, 
+	// which must have the same structure.
+	bool save(const std::string &filename) const;
+	bool load(const NeuralNet &reference, const std::string &filename);
+	bool load(const NeuralNet &reference, std::stringstream &quantized_file);
+
+	bool predict(const float* jet, float* probabilities);
+	std::vector<bool> predict_batch(const float* jets, int n_jets, 
+	                                float* probabilities);
+	bool predict(const float* jet, float* probabilities, 
+	             QuantizedContext &context) const;
+	std::vector<bool> predict_batch(const float* jets, int n_jets, 
+	                                float* probabilities, 
+	                                QuantizedContext &context) const;
+	const std::vector<std::string>& get_input_layout() const;
+	const std::vector<std::string>& get_output_names() const;
+	// Bytes of weights, scales and biases touched per jet.
+	std::size_t weight_bytes() const;
+private:
+//----------------------------------------------------------------------------
+	void copy_schema(const NeuralNet &reference);
+	void prepare(QuantizedContext &context) const;
+	const float* feed_batch(QuantizedContext &context, int n_events) const;
+	static void quantize_layer(const Layer &layer, float input_scale, int lowest_level, 
+	                           const std::vector<signed char> &quantized, 
+	                           const std::vector<float> &weight_scales, 
+	                           QuantizedLayer &target);
+	std::vector<QuantizedLayer> layers;
+	std::vector<int> structure;
+	std::vector<std::string> input_names, output_names, layout_names;
+	std::vector<int> layout_index;
+	int pt_slot, eta_slot;
+	std::vector<double> mean, stddev;
+	QuantizedContext default_context;
+};
+
+//-----------------------------------------------------------------------------
+//	Implementation of CLASS: QUANTIZEDNEURALNET
+//-----------------------------------------------------------------------------
+inline QuantizedNeuralNet::QuantizedNeuralNet(): pt_slot(0), eta_slot(0)
+{
+}
+//----------------------------------------------------------------------------
+inline QuantizedNeuralNet::QuantizedNeuralNet(const NeuralNet &reference, 
+                                              const double* jets, int n_jets)
+{
+	copy_schema(reference);
+	const NetworkArchitecture &net = *reference.Net;
+	int n_layers = net.Bundle.size();
+	int n_layout = layout_names.size();
+
+	// |activation| entering each layer, over all calibration jets
+	std::vector<std::vector<float> > magnitudes(n_layers);
+	std::vector<bool> is_signed(n_layers, false);
+	std::vector<double> input(input_names.size()), fed(input_names.size());
+	InferenceContext context;
+	for (int n = 0; n < n_jets; ++n) 
+	{
+		const double* jet = jets + n * n_layout;
+		int cat_pT = 0, cat_eta = 0;
+		if (!find_physics_category(jet[pt_slot], jet[eta_slot], cat_pT, cat_eta)) 
+		{
+			continue;
+		}
+		normalize_jet(jet, cat_pT, cat_eta, layout_index, mean, stddev, &input[0]);
+		reference.prepare_input(jet, cat_pT, cat_eta, &fed[0]);
+		net.test(&fed[0], context);
+		for (int l = 0; l < n_layers; ++l) 
+		{
+			const std::vector<double> &x = (l == 0) ? input : context.outs[l - 1];
+			for (unsigned int i = 0; i < x.size(); ++i) 
+			{
+				magnitudes[l].push_back(fabs(x[i]));
+				is_signed[l] = is_signed[l] || (x[i] < 0);
+			}
+		}
+	}
+
+	layers.resize(n_layers);
+	for (int l = 0; l < n_layers; ++l) 
+	{
+		const Layer &layer = *net.Bundle[l];
+		float range = 0;
+		if (!magnitudes[l].empty()) 
+		{
+			std::vector<float>::iterator cut = magnitudes[l].begin() + 
+				static_cast<std::size_t>(calibration_percentile * (magnitudes[l].size() - 1));
+			std::nth_element(magnitudes[l].begin(), cut, magnitudes[l].end());
+			range = *cut;
+		}
+		int lowest_level = is_signed[l] ? -127 : 0;
+		float input_scale = (range > 0) ? range / (is_signed[l] ? 127 : 255) : 1.0f;
+
+		std::vector<float> weight_scales(layer.outs);
+		std::vector<signed char> quantized(layer.ins * layer.outs);
+		for (int i = 0; i < layer.outs; ++i) 
+		{
+			double largest = 0;
+			for (int j = 0; j < layer.ins; ++j) 
+			{
+				largest = std::max(largest, fabs(layer.Synapse[j * layer.outs + i]));
+			}
+			weight_scales[i] = (largest > 0) ? largest / 127 : 1.0f;
+			for (int j = 0; j < layer.ins; ++j) 
+			{
+				double q = floor(layer.Synapse[j * layer.outs + i] / weight_scales[i] + 0.5);
+				q = std::min(127.0, std::max(-127.0, q));
+				quantized[j * layer.outs + i] = static_cast<signed char>(q);
+			}
+		}
+		quantize_layer(layer, input_scale, lowest_level, quantized, weight_scales, layers[l]);
+	}
+}
+//----------------------------------------------------------------------------
+// Fills a QuantizedLayer from its int8 weights and scales, copying the 
+// float bias from the reference layer.
+inline void QuantizedNeuralNet::quantize_layer(const Layer &layer, float input_scale, 
+                                               int lowest_level, 
+                                               const std::vector<signed char> &quantized, 
+                                               const std::vector<float> &weight_scales, 
+                                               QuantizedLayer &target)
+{
+	target.ins = layer.ins;
+	target.outs = layer.outs;
+	target.padded_outs = (layer.outs + quantized_lanes - 1) / quantized_lanes * quantized_lanes;
+	target.last = layer.last;
+	target.input_scale = input_scale;
+	target.lowest_level = lowest_level;
+	target.weight_scales = weight_scales;
+	target.output_scales.assign(target.padded_outs, 0.0f);
+	target.bias.assign(target.padded_outs, 0.0f);
+	for (int i = 0; i < layer.outs; ++i) 
+	{
+		target.output_scales[i] = input_scale * weight_scales[i];
+		target.bias[i] = static_cast<float>(layer.Synapse[layer.ins * layer.outs + i]);
+	}
+	int n_pairs = (layer.ins + 1) / 2;
+	target.weights.assign(n_pairs * target.padded_outs * 2, 0);
+	for (int j = 0; j < layer.ins; ++j) 
+	{
+		short* pair = &target.weights[(j / 2) * target.padded_outs * 2 + j % 2];
+		for (int i = 0; i < layer.outs; ++i) 
+		{
+			pair[2 * i] = quantized[j * layer.outs + i];
+		}
+	}
+}
+//----------------------------------------------------------------------------
+inline void QuantizedNeuralNet::copy_schema(const NeuralNet &reference)
+{
+	structure = reference.Net->structure;
+	input_names = reference.input_names;
+	output_names = reference.output_names;
+	layout_names = reference.layout_names;
+	layout_index = reference.layout_index;
+	pt_slot = reference.pt_slot;
+	eta_slot = reference.eta_slot;
+	mean = reference.mean;
+	stddev = reference.stddev;
+}
+//----------------------------------------------------------------------------
+inline bool QuantizedNeuralNet::save(const std::string &filename) const
+{
+	std::ofstream file( filename.c_str() );
+	if (!file.is_open()) 
+	{
+		std::cout << "\nError: could not open " << filename << " for writing." << std::endl;
+		return false;
+	}
+	file << "#->QNET\n";
+	file << structure.size();
+	for (unsigned int l = 0; l < structure.size(); ++l) 
+	{
+		file << "," << structure[l];
+	}
+	file << "\n" << std::setprecision(9);
+	for (unsigned int l = 0; l < layers.size(); ++l) 
+	{
+		const QuantizedLayer &layer = layers[l];
+		file << "LAYER\n" << layer.input_scale << "," << layer.lowest_level << "\n";
+		for (int i = 0; i < layer.outs; ++i) 
+		{
+			file << ((i == 0) ? "" : ",") << layer.weight_scales[i];
+		}
+		file << "\n";
+		for (int i = 0; i < layer.outs; ++i) 
+		{
+			file << ((i == 0) ? "" : ",") << layer.bias[i];
+		}
+		file << "\n";
+		for (int j = 0; j < layer.ins; ++j) 
+		{
+			const short* pair = &layer.weights[(j / 2) * layer.padded_outs * 2 + j % 2];
+			for (int i = 0; i < layer.outs; ++i) 
+			{
+				file << ((i == 0) ? "" : ",") << pair[2 * i];
+			}
+			file << "\n";
+		}
+	}
+	return file.good();
+}
+//----------------------------------------------------------------------------
+inline bool QuantizedNeuralNet::load(const NeuralNet &reference, 
+                                     const std::string &filename)
+{
+	std::ifstream file( filename.c_str() );
+	if (!file.is_open()) 
+	{
+		std::cout << "\nError: File name " << filename << " not found." << std::endl;
+		return false;
+	}
+	std::stringstream quantized_file;
+	quantized_file << file.rdbuf();
+	return load(reference, quantized_file);
+}
+//----------------------------------------------------------------------------
+inline bool QuantizedNeuralNet::load(const NeuralNet &reference, 
+                                     std::stringstream &quantized_file)
+{
+	std::string text((std::istreambuf_iterator<char>(quantized_file)), 
+	                 std::istreambuf_iterator<char>());
+	const char* at = text.c_str();
+	std::vector<double> params;
+	if (!read_keyword(at, "#->QNET")) 
+	{
+		std::cout << "\nError: file type not recognised." << std::endl;
+		return false;
+	}
+	copy_schema(reference);
+	read_fields(at, ',', params);
+	if (params.size() < 1 || 
+	    std::vector<int>(params.begin() + 1, params.end()) != structure) 
+	{
+		std::cout << "\nError: quantized net does not match the reference structure." << std::endl;
+		return false;
+	}
+	const NetworkArchitecture &net = *reference.Net;
+	layers.resize(net.Bundle.size());
+	for (unsigned int l = 0; l < layers.size(); ++l) 
+	{
+		const Layer &layer = *net.Bundle[l];
+		// input_scale,lowest_level / weight scales / bias / ins rows of int8
+		std::vector<double> record;
+		bool complete = read_keyword(at, "LAYER") && read_fields(at, ',', record) && 
+		                record.size() == 2;
+		for (int row = 0; complete && row < layer.ins + 2; ++row) 
+		{
+			complete = read_fields(at, ',', record) && 
+			           record.size() == 2u + (row + 1) * layer.outs;
+		}
+		if (!complete) 
+		{
+			std::cout << "\nError: quantized net is truncated." << std::endl;
+			return false;
+		}
+		std::vector<float> weight_scales(record.begin() + 2, record.begin() + 2 + layer.outs);
+		std::vector<signed char> quantized(record.begin() + 2 + 2 * layer.outs, record.end());
+		quantize_layer(layer, record[0], static_cast<int>(record[1]), 
+		               quantized, weight_scales, layers[l]);
+		for (int i = 0; i < layer.outs; ++i) 
+		{
+			layers[l].bias[i] = record[2 + layer.outs + i];
+		}
+	}
+	return true;
+}
+//----------------------------------------------------------------------------
+inline bool QuantizedNeuralNet::predict(const float* jet, float* probabilities) 
+{
+	return predict(jet, probabilities, default_context);
+}
+//----------------------------------------------------------------------------
+inline std::vector<bool> QuantizedNeuralNet::predict_batch(const float* jets, 
+                                                           int n_jets, 
+                                                           float* probabilities) 
+{
+	return predict_batch(jets, n_jets, probabilities, default_context);
+}
+//----------------------------------------------------------------------------
+inline bool QuantizedNeuralNet::predict(const float* jet, float* probabilities, 
+                                        QuantizedContext &context) const
+{
+	int n_outputs = output_names.size();
+	int cat_pT = 0, cat_eta = 0;
+	if (!find_physics_category(jet[pt_slot], jet[eta_slot], cat_pT, cat_eta)) 
+	{
+		std::fill(probabilities, probabilities + n_outputs, 0.0f);
+		return false;
+	}
+	prepare(context);
+	normalize_jet(jet, cat_pT, cat_eta, layout_index, mean, stddev, &context.input[0]);
+	const float* scores = feed_batch(context, 1);
+	std::copy(scores, scores + n_outputs, probabilities);
+	softmax_inplace(probabilities, n_outputs);
+	return true;
+}
+//----------------------------------------------------------------------------
+inline std::vector<bool> QuantizedNeuralNet::predict_batch(const float* jets, 
+                                                           int n_jets, 
+                                                           float* probabilities, 
+                                                           QuantizedContext &context) const
+{
+	std::vector<bool> valid(n_jets, false);
+	int n_layout = layout_names.size();
+	int n_inputs = input_names.size();
+	int n_outputs = output_names.size();
+	prepare(context);
+
+	for (int first = 0; first < n_jets; first += batch_size) 
+	{
+		int n_block = std::min(batch_size, n_jets - first);
+		for (int n = 0; n < n_block; ++n) 
+		{
+			const float* jet = jets + (first + n) * n_layout;
+			int cat_pT = 0, cat_eta = 0;
+			valid[first + n] = find_physics_category(jet[pt_slot], jet[eta_slot], 
+			                                         cat_pT, cat_eta);
+			normalize_jet(jet, cat_pT, cat_eta, layout_index, mean, stddev, 
+			              &context.input[n * n_inputs]);
+		}
+
+		const float* scores = feed_batch(context, n_block);
+
+		for (int n = 0; n < n_block; ++n) 
+		{
+			float* out = probabilities + (first + n) * n_outputs;
+			if (!valid[first + n]) 
+			{
+				std::fill(out, out + n_outputs, 0.0f);
+				continue;
+			}
+			std::copy(scores + n * n_outputs, scores + (n + 1) * n_outputs, out);
+			softmax_inplace(out, n_outputs);
+		}
+	}
+	return valid;
+}
+//----------------------------------------------------------------------------
+// Runs the normalized inputs of n_events jets held in the context through 
+// the layers, returning a row-major (n_events x outputs) view of the last 
+// layer's scores, valid until the context is next used.
+inline const float* QuantizedNeuralNet::feed_batch(QuantizedContext &context, 
+                                                   int n_events) const
+{
+	const float* x = &context.input[0];
+	float* out = &context.activations[0];
+	for (unsigned int l = 0; l < layers.size(); ++l) 
+	{
+		const QuantizedLayer &layer = layers[l];
+		const int n_pairs = (layer.ins + 1) / 2;
+		const float inverse_scale = 1.0f / layer.input_scale;
+		const float lowest = static_cast<float>(layer.lowest_level);
+		const float highest = (layer.lowest_level < 0) ? 127.0f : 255.0f;
+		if (layer.ins % 2 == 0) 
+		{
+			quantize_inplace(x, n_events * layer.ins, inverse_scale, lowest, highest, 
+			                 &context.quantized[0]);
+		}
+		else 
+		{
+			// rows are padded to a whole number of input pairs
+			for (int n = 0; n < n_events; ++n) 
+			{
+				short* row = &context.quantized[n * n_pairs * 2];
+				quantize_inplace(x + n * layer.ins, layer.ins, inverse_scale, 
+				                 lowest, highest, row);
+				row[layer.ins] = 0;
+			}
+		}
+		int16_dot_inplace(&context.quantized[0], n_events, n_pairs, 
+		                  &layer.weights[0], layer.padded_outs, 
+		                  &context.accumulators[0]);
+		for (int n = 0; n < n_events; ++n) 
+		{
+			const int* accumulators = &context.accumulators[n * layer.padded_outs];
+			for (int i = 0; i < layer.outs; ++i) 
+			{
+				out[n * layer.outs + i] = accumulators[i] * layer.output_scales[i] + layer.bias[i];
+			}
+		}
+		if (!layer.last) 
+		{
+			sigmoid_inplace(out, n_events * layer.outs);
+		}
+		// x has been consumed into context.quantized, so out can be reused
+		x = out;
+	}
+	return x;
+}
+//----------------------------------------------------------------------------
+inline void QuantizedNeuralNet::prepare(QuantizedContext &context) const
+{
+	if (context.input.size() != batch_size * input_names.size()) 
+	{
+		int widest = 0;
+		for (unsigned int l = 0; l < layers.size(); ++l) 
+		{
+			widest = std::max(widest, std::max(layers[l].ins + 1, layers[l].padded_outs));
+		}
+		context.input.assign(batch_size * input_names.size(), 0.0f);
+		context.activations.assign(batch_size * widest, 0.0f);
+		context.quantized.assign(batch_size * widest, 0);
+		context.accumulators.assign(batch_size * widest, 0);
+	}
+}
+//----------------------------------------------------------------------------
+inline const std::vector<std::string>& QuantizedNeuralNet::get_input_layout() const
+{
+	return layout_names;
+}
+//----------------------------------------------------------------------------
+inline const std::vector<std::string>& QuantizedNeuralNet::get_output_names() const
+{
+	return output_names;
+}
+//----------------------------------------------------------------------------
+inline std::size_t QuantizedNeuralNet::weight_bytes() const
+{
+	std::size_t bytes = 0;
+	for (unsigned int l = 0; l < layers.size(); ++l) 
+	{
+		bytes += layers[l].weights.size() * sizeof(short) + 
+		         (layers[l].output_scales.size() + layers[l].bias.size()) * sizeof(float);
+	}
+	return bytes;
+}
 
 //-----------------------------------------------------------------------------
 //	Implementation of Forward-Declared functions
 //-----------------------------------------------------------------------------
 
 //----------------------------------------------------------------------------
-inline double sig(double x) 
+inline double sig(double x) 
+{
+	return 1 / (1 + exp(-x));
+}
+//----------------------------------------------------------------------------
+inline double dsig(double x) 
+{
+	return x * (1 - x);
+}
+
+//----------------------------------------------------------------------------
+inline std::vector<double> sigmoid(std::vector<double> A) 
+{
+	for (std::vector<double>::iterator element = A.begin(); element != A.end(); ++element)
+	{
+		*element = sig(*element);
+	}
+	return (A);
+}
+//----------------------------------------------------------------------------
+inline std::vector<double> dsigmoid(std::vector<double> A) 
+{
+	for(std::vector<double>::iterator element = A.begin(); element != A.end(); ++element) 
+	{
+		*element = dsig(*element);
+	}
+	return (A);
+}
+//----------------------------------------------------------------------------
+inline std::vector<double> softmax(std::vector<double> A) 
+{
+	double sum = 0;
+	for(std::vector<double>::iterator element = A.begin(); element != A.end(); ++element) 
+	{
+		*element = exp(*element);
+		sum += *element;
+	}
+	for(std::vector<double>::iterator element = A.begin(); element != A.end(); ++element) 
+	{
+		*element /= sum;
+	}
+	return (A);
+}
+//----------------------------------------------------------------------------
+// Vectorized in-place kernels. With x = t ln2 + r, t = round(x / ln2) and 
+// |r| <= ln2 / 2, exp(r) is the degree 11 Taylor polynomial scaled by 2^t, 
+// giving a relative error below 1e-14 against std::exp for x in [-708, 709] 
+// (inputs are clamped to that range). The float kernels use a degree 7 
+// polynomial on [-87, 88], within a few ulp of float. The widest of 
+// AVX-512F, AVX2+FMA and SSE2 supported by the CPU is chosen on first use; 
+// define JETTAGGER_NO_SIMD to keep only the scalar code.
+const double exp_lo = -708.0, exp_hi = 709.0;
+const double log2e = 1.4426950408889634074;
+const double ln2_hi = 6.93147180369123816490e-01;
+const double ln2_lo = 1.90821492927058770002e-10;
+const double round_magic = 6755399441055744.0; // rounds |x| < 2^51 to an integer
+const double exp_coeff[12] = {1.0, 1.0, 1.0 / 2, 1.0 / 6, 1.0 / 24, 1.0 / 120, 
+                              1.0 / 720, 1.0 / 5040, 1.0 / 40320, 
+                              1.0 / 362880, 1.0 / 3628800, 1.0 / 39916800};
+const float expf_lo = -87.0f, expf_hi = 88.0f;
+const float log2ef = 1.44269504f;
+const float ln2f_hi = 0.693359375f;
+const float ln2f_lo = -2.12194440e-4f;
+const float roundf_magic = 12582912.0f; // rounds |x| < 2^22 to an integer
+const float sigmoidf_lo = -80.0f; // keeps float sigmoid outputs clear of denormals
+const float expf_coeff[8] = {1.0f, 1.0f, 1.0f / 2, 1.0f / 6, 1.0f / 24, 
+                             1.0f / 120, 1.0f / 720, 1.0f / 5040};
+
+inline double fast_exp(double x)
+{
+	x = (x > exp_lo) ? x : exp_lo;
+	x = (x < exp_hi) ? x : exp_hi;
+	double t = (x * log2e + round_magic) - round_magic;
+	double r = (x - t * ln2_hi) - t * ln2_lo;
+	double p = exp_coeff[11];
+	for (int k = 10; k >= 0; --k)
+	{
+		p = p * r + exp_coeff[k];
+	}
+	return ldexp(p, static_cast<int>(t));
+}
+inline void exp_scalar(double* A, int n)
+{
+	for (int i = 0; i < n; ++i)
+	{
+		A[i] = fast_exp(A[i]);
+	}
+}
+inline void sigmoid_scalar(double* A, int n)
+{
+	for (int i = 0; i < n; ++i)
+	{
+		A[i] = 1.0 / (1.0 + fast_exp(-A[i]));
+	}
+}
+inline float fast_exp(float x)
+{
+	x = (x > expf_lo) ? x : expf_lo;
+	x = (x < expf_hi) ? x : expf_hi;
+	float t = (x * log2ef + roundf_magic) - roundf_magic;
+	float r = (x - t * ln2f_hi) - t * ln2f_lo;
+	float p = expf_coeff[7];
+	for (int k = 6; k >= 0; --k)
+	{
+		p = p * r + expf_coeff[k];
+	}
+	return std::ldexp(p, static_cast<int>(t));
+}
+inline void exp_scalar(float* A, int n)
+{
+	for (int i = 0; i < n; ++i)
+	{
+		A[i] = fast_exp(A[i]);
+	}
+}
+inline void sigmoid_scalar(float* A, int n)
+{
+	for (int i = 0; i < n; ++i)
+	{
+		A[i] = 1.0f / (1.0f + fast_exp(-std::max(A[i], sigmoidf_lo)));
+	}
+}
+#if defined(__clang__)
+#pragma float_control(push)
+#pragma clang fp contract(off)
+#elif defined(__GNUC__)
+#pragma GCC push_options
+#pragma GCC optimize("fp-contract=off")
+#endif
+// Affine map of the layers: out = [events, 1] x weights for a row-major 
+// (n_events x ins) block, weights being (ins + 1) x outs with the bias 
+// last. Sums run over the inputs in order with the bias added last and 
+// are never fused, so every kernel set rounds exactly as this loop does: 
+// contraction into FMAs, which GCC does by default where the target has 
+// them, is turned off from here to the end of the vector kernels. 
+// Computes output columns [first_column, outs), which also serves the 
+// vector kernels for their leftover columns.
+template <typename T>
+inline void affine_scalar(const T* events, int n_events, int ins, 
+                          const T* weights, int outs, T* out, int first_column)
+{
+	for (int n = 0; n < n_events; ++n)
+	{
+		const T* x = events + n * ins;
+		for (int i = first_column; i < outs; ++i)
+		{
+			T sum = 0;
+			for (int j = 0; j < ins; ++j)
+			{
+				sum += x[j] * weights[j * outs + i];
+			}
+			out[n * outs + i] = sum + weights[ins * outs + i];
+		}
+	}
+}
+template <typename T>
+inline void affine_scalar(const T* events, int n_events, int ins, 
+                          const T* weights, int outs, T* out)
+{
+	affine_scalar(events, n_events, ins, weights, outs, out, 0);
+}
+// Scales, clamps to [lowest, highest] and rounds (to nearest even, as the 
+// vector conversions do) the activations entering a quantized layer.
+inline void quantize_scalar(const float* x, int n, float inverse_scale, 
+                            float lowest, float highest, short* out)
+{
+	for (int i = 0; i < n; ++i)
+	{
+		float q = std::min(highest, std::max(lowest, x[i] * inverse_scale));
+		out[i] = static_cast<short>((q + roundf_magic) - roundf_magic);
+	}
+}
+// Integer products of the quantized net for a row-major block of n_events 
+// jets with 2 n_pairs inputs each: out[n][i] is the sum over input pairs p 
+// of x[n][2p] w[p][i][0] + x[n][2p + 1] w[p][i][1], the weights stored as 
+// n_pairs x outs pairs. Exact, so all kernel sets agree.
+inline void int16_dot_scalar(const short* x, int n_events, int n_pairs, 
+                             const short* weights, int outs, int* out)
+{
+	std::fill(out, out + n_events * outs, 0);
+	for (int n = 0; n < n_events; ++n)
+	{
+		const short* row = x + n * n_pairs * 2;
+		for (int p = 0; p < n_pairs; ++p)
+		{
+			const short* pair = weights + p * outs * 2;
+			for (int i = 0; i < outs; ++i)
+			{
+				out[n * outs + i] += row[2 * p] * pair[2 * i] + row[2 * p + 1] * pair[2 * i + 1];
+			}
+		}
+	}
+}
+
+#ifdef JETTAGGER_SIMD
+//----------------------------------------------------------------------------
+__attribute__((target("sse2"))) inline __m128d exp_sse2(__m128d x)
+{
+	const __m128d magic = _mm_set1_pd(round_magic);
+	x = _mm_min_pd(_mm_max_pd(x, _mm_set1_pd(exp_lo)), _mm_set1_pd(exp_hi));
+	__m128d shifted = _mm_add_pd(_mm_mul_pd(x, _mm_set1_pd(log2e)), magic);
+	__m128d t = _mm_sub_pd(shifted, magic);
+	__m128d r = _mm_sub_pd(x, _mm_mul_pd(t, _mm_set1_pd(ln2_hi)));
+	r = _mm_sub_pd(r, _mm_mul_pd(t, _mm_set1_pd(ln2_lo)));
+	__m128d p = _mm_set1_pd(exp_coeff[11]);
+	for (int k = 10; k >= 0; --k)
+	{
+		p = _mm_add_pd(_mm_mul_pd(p, r), _mm_set1_pd(exp_coeff[k]));
+	}
+	__m128i e = _mm_add_epi64(_mm_castpd_si128(shifted), _mm_set1_epi64x(1023));
+	return _mm_mul_pd(p, _mm_castsi128_pd(_mm_slli_epi64(e, 52)));
+}
+__attribute__((target("sse2"))) inline void exp_sse2(double* A, int n)
+{
+	int i = 0;
+	for (; i + 2 <= n; i += 2)
+	{
+		_mm_storeu_pd(A + i, exp_sse2(_mm_loadu_pd(A + i)));
+	}
+	exp_scalar(A + i, n - i);
+}
+__attribute__((target("sse2"))) inline void sigmoid_sse2(double* A, int n)
+{
+	const __m128d one = _mm_set1_pd(1.0);
+	int i = 0;
+	for (; i + 2 <= n; i += 2)
+	{
+		__m128d e = exp_sse2(_mm_sub_pd(_mm_setzero_pd(), _mm_loadu_pd(A + i)));
+		_mm_storeu_pd(A + i, _mm_div_pd(one, _mm_add_pd(one, e)));
+	}
+	sigmoid_scalar(A + i, n - i);
+}
+__attribute__((target("sse2"))) inline __m128 exp_sse2(__m128 x)
+{
+	const __m128 magic = _mm_set1_ps(roundf_magic);
+	x = _mm_min_ps(_mm_max_ps(x, _mm_set1_ps(expf_lo)), _mm_set1_ps(expf_hi));
+	__m128 shifted = _mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(log2ef)), magic);
+	__m128 t = _mm_sub_ps(shifted, magic);
+	__m128 r = _mm_sub_ps(x, _mm_mul_ps(t, _mm_set1_ps(ln2f_hi)));
+	r = _mm_sub_ps(r, _mm_mul_ps(t, _mm_set1_ps(ln2f_lo)));
+	__m128 p = _mm_set1_ps(expf_coeff[7]);
+	for (int k = 6; k >= 0; --k)
+	{
+		p = _mm_add_ps(_mm_mul_ps(p, r), _mm_set1_ps(expf_coeff[k]));
+	}
+	__m128i e = _mm_add_epi32(_mm_castps_si128(shifted), _mm_set1_epi32(127));
+	return _mm_mul_ps(p, _mm_castsi128_ps(_mm_slli_epi32(e, 23)));
+}
+__attribute__((target("sse2"))) inline void exp_sse2(float* A, int n)
+{
+	int i = 0;
+	for (; i + 4 <= n; i += 4)
+	{
+		_mm_storeu_ps(A + i, exp_sse2(_mm_loadu_ps(A + i)));
+	}
+	exp_scalar(A + i, n - i);
+}
+__attribute__((target("sse2"))) inline void sigmoid_sse2(float* A, int n)
+{
+	const __m128 one = _mm_set1_ps(1.0f);
+	int i = 0;
+	for (; i + 4 <= n; i += 4)
+	{
+		__m128 x = _mm_max_ps(_mm_loadu_ps(A + i), _mm_set1_ps(sigmoidf_lo));
+		__m128 e = exp_sse2(_mm_sub_ps(_mm_setzero_ps(), x));
+		_mm_storeu_ps(A + i, _mm_div_ps(one, _mm_add_ps(one, e)));
+	}
+	sigmoid_scalar(A + i, n - i);
+}
+__attribute__((target("sse2"))) inline void affine_sse2(const double* events, int n_events, 
+                                                        int ins, const double* weights, 
+                                                        int outs, double* out)
+{
+	int vector_columns = outs - outs % 2;
+	for (int n = 0; n < n_events; n += 4)
+	{
+		int rows = std::min(4, n_events - n);
+		const double* x0 = events + n * ins;
+		const double* x1 = events + (n + std::min(1, rows - 1)) * ins;
+		const double* x2 = events + (n + std::min(2, rows - 1)) * ins;
+		const double* x3 = events + (n + std::min(3, rows - 1)) * ins;
+		for (int i = 0; i < vector_columns; i += 2)
+		{
+			__m128d s0 = _mm_setzero_pd(), s1 = s0, s2 = s0, s3 = s0;
+			for (int j = 0; j < ins; ++j)
+			{
+				__m128d row = _mm_loadu_pd(weights + j * outs + i);
+				s0 = _mm_add_pd(s0, _mm_mul_pd(_mm_set1_pd(x0[j]), row));
+				s1 = _mm_add_pd(s1, _mm_mul_pd(_mm_set1_pd(x1[j]), row));
+				s2 = _mm_add_pd(s2, _mm_mul_pd(_mm_set1_pd(x2[j]), row));
+				s3 = _mm_add_pd(s3, _mm_mul_pd(_mm_set1_pd(x3[j]), row));
+			}
+			__m128d bias = _mm_loadu_pd(weights + ins * outs + i);
+			double* o = out + n * outs + i;
+			_mm_storeu_pd(o, _mm_add_pd(s0, bias));
+			if (rows > 1)
+			{
+				_mm_storeu_pd(o + 1 * outs, _mm_add_pd(s1, bias));
+			}
+			if (rows > 2)
+			{
+				_mm_storeu_pd(o + 2 * outs, _mm_add_pd(s2, bias));
+			}
+			if (rows > 3)
+			{
+				_mm_storeu_pd(o + 3 * outs, _mm_add_pd(s3, bias));
+			}
+		}
+	}
+	affine_scalar(events, n_events, ins, weights, outs, out, vector_columns);
+}
+__attribute__((target("sse2"))) inline void affine_sse2(const float* events, int n_events, 
+                                                        int ins, const float* weights, 
+                                                        int outs, float* out)
+{
+	int vector_columns = outs - outs % 4;
+	for (int n = 0; n < n_events; n += 4)
+	{
+		int rows = std::min(4, n_events - n);
+		const float* x0 = events + n * ins;
+		const float* x1 = events + (n + std::min(1, rows - 1)) * ins;
+		const float* x2 = events + (n + std::min(2, rows - 1)) * ins;
+		const float* x3 = events + (n + std::min(3, rows - 1)) * ins;
+		for (int i = 0; i < vector_columns; i += 4)
+		{
+			__m128 s0 = _mm_setzero_ps(), s1 = s0, s2 = s0, s3 = s0;
+			for (int j = 0; j < ins; ++j)
+			{
+				__m128 row = _mm_loadu_ps(weights + j * outs + i);
+				s0 = _mm_add_ps(s0, _mm_mul_ps(_mm_set1_ps(x0[j]), row));
+				s1 = _mm_add_ps(s1, _mm_mul_ps(_mm_set1_ps(x1[j]), row));
+				s2 = _mm_add_ps(s2, _mm_mul_ps(_mm_set1_ps(x2[j]), row));
+				s3 = _mm_add_ps(s3, _mm_mul_ps(_mm_set1_ps(x3[j]), row));
+			}
+			__m128 bias = _mm_loadu_ps(weights + ins * outs + i);
+			float* o = out + n * outs + i;
+			_mm_storeu_ps(o, _mm_add_ps(s0, bias));
+			if (rows > 1)
+			{
+				_mm_storeu_ps(o + 1 * outs, _mm_add_ps(s1, bias));
+			}
+			if (rows > 2)
+			{
+				_mm_storeu_ps(o + 2 * outs, _mm_add_ps(s2, bias));
+			}
+			if (rows > 3)
+			{
+				_mm_storeu_ps(o + 3 * outs, _mm_add_ps(s3, bias));
+			}
+		}
+	}
+	affine_scalar(events, n_events, ins, weights, outs, out, vector_columns);
+}
+__attribute__((target("sse2"))) inline void quantize_sse2(const float* x, int n, 
+                                                          float inverse_scale, float lowest, 
+                                                          float highest, short* out)
+{
+	const __m128 scale = _mm_set1_ps(inverse_scale);
+	const __m128 low = _mm_set1_ps(lowest), high = _mm_set1_ps(highest);
+	int i = 0;
+	for (; i + 8 <= n; i += 8)
+	{
+		__m128 a = _mm_min_ps(high, _mm_max_ps(low, _mm_mul_ps(_mm_loadu_ps(x + i), scale)));
+		__m128 b = _mm_min_ps(high, _mm_max_ps(low, _mm_mul_ps(_mm_loadu_ps(x + i + 4), scale)));
+		__m128i packed = _mm_packs_epi32(_mm_cvtps_epi32(a), _mm_cvtps_epi32(b));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), packed);
+	}
+	quantize_scalar(x + i, n - i, inverse_scale, lowest, highest, out + i);
+}
+// Two int16 values as one int32 lane, low half first.
+inline int int16_pair(const short* x)
+{
+	return static_cast<int>((static_cast<unsigned int>(static_cast<unsigned short>(x[1])) << 16) | 
+	                        static_cast<unsigned short>(x[0]));
+}
+// Four jets at a time; requires outs to be a multiple of 4.
+__attribute__((target("sse2"))) inline void int16_dot_sse2(const short* x, int n_events, int n_pairs, 
+                                                           const short* weights, int outs, int* out)
+{
+	for (int n = 0; n < n_events; n += 4)
+	{
+		int rows = std::min(4, n_events - n);
+		const short* x0 = x + n * n_pairs * 2;
+		const short* x1 = x + (n + std::min(1, rows - 1)) * n_pairs * 2;
+		const short* x2 = x + (n + std::min(2, rows - 1)) * n_pairs * 2;
+		const short* x3 = x + (n + std::min(3, rows - 1)) * n_pairs * 2;
+		for (int i = 0; i < outs; i += 4)
+		{
+			__m128i s0 = _mm_setzero_si128(), s1 = s0, s2 = s0, s3 = s0;
+			for (int p = 0; p < n_pairs; ++p)
+			{
+				__m128i row = _mm_loadu_si128(reinterpret_cast<const __m128i*>(weights + (p * outs + i) * 2));
+				s0 = _mm_add_epi32(s0, _mm_madd_epi16(_mm_set1_epi32(int16_pair(x0 + 2 * p)), row));
+				s1 = _mm_add_epi32(s1, _mm_madd_epi16(_mm_set1_epi32(int16_pair(x1 + 2 * p)), row));
+				s2 = _mm_add_epi32(s2, _mm_madd_epi16(_mm_set1_epi32(int16_pair(x2 + 2 * p)), row));
+				s3 = _mm_add_epi32(s3, _mm_madd_epi16(_mm_set1_epi32(int16_pair(x3 + 2 * p)), row));
+			}
+			int* o = out + n * outs + i;
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(o), s0);
+			if (rows > 1)
+			{
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(o + 1 * outs), s1);
+			}
+			if (rows > 2)
+			{
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(o + 2 * outs), s2);
+			}
+			if (rows > 3)
+			{
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(o + 3 * outs), s3);
+			}
+		}
+	}
+}
+//----------------------------------------------------------------------------
+__attribute__((target("avx2,fma"))) inline __m256d exp_avx2(__m256d x)
 {
-	return 1 / (1 + exp(-x));
+	const __m256d magic = _mm256_set1_pd(round_magic);
+	x = _mm256_min_pd(_mm256_max_pd(x, _mm256_set1_pd(exp_lo)), _mm256_set1_pd(exp_hi));
+	__m256d shifted = _mm256_fmadd_pd(x, _mm256_set1_pd(log2e), magic);
+	__m256d t = _mm256_sub_pd(shifted, magic);
+	__m256d r = _mm256_fnmadd_pd(t, _mm256_set1_pd(ln2_hi), x);
+	r = _mm256_fnmadd_pd(t, _mm256_set1_pd(ln2_lo), r);
+	__m256d p = _mm256_set1_pd(exp_coeff[11]);
+	for (int k = 10; k >= 0; --k)
+	{
+		p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(exp_coeff[k]));
+	}
+	__m256i e = _mm256_add_epi64(_mm256_castpd_si256(shifted), _mm256_set1_epi64x(1023));
+	return _mm256_mul_pd(p, _mm256_castsi256_pd(_mm256_slli_epi64(e, 52)));
+}
+__attribute__((target("avx2,fma"))) inline void exp_avx2(double* A, int n)
+{
+	int i = 0;
+	for (; i + 4 <= n; i += 4)
+	{
+		_mm256_storeu_pd(A + i, exp_avx2(_mm256_loadu_pd(A + i)));
+	}
+	exp_scalar(A + i, n - i);
+}
+__attribute__((target("avx2,fma"))) inline void sigmoid_avx2(double* A, int n)
+{
+	const __m256d one = _mm256_set1_pd(1.0);
+	int i = 0;
+	for (; i + 4 <= n; i += 4)
+	{
+		__m256d e = exp_avx2(_mm256_sub_pd(_mm256_setzero_pd(), _mm256_loadu_pd(A + i)));
+		_mm256_storeu_pd(A + i, _mm256_div_pd(one, _mm256_add_pd(one, e)));
+	}
+	sigmoid_scalar(A + i, n - i);
+}
+__attribute__((target("avx2,fma"))) inline __m256 exp_avx2(__m256 x)
+{
+	const __m256 magic = _mm256_set1_ps(roundf_magic);
+	x = _mm256_min_ps(_mm256_max_ps(x, _mm256_set1_ps(expf_lo)), _mm256_set1_ps(expf_hi));
+	__m256 shifted = _mm256_fmadd_ps(x, _mm256_set1_ps(log2ef), magic);
+	__m256 t = _mm256_sub_ps(shifted, magic);
+	__m256 r = _mm256_fnmadd_ps(t, _mm256_set1_ps(ln2f_hi), x);
+	r = _mm256_fnmadd_ps(t, _mm256_set1_ps(ln2f_lo), r);
+	__m256 p = _mm256_set1_ps(expf_coeff[7]);
+	for (int k = 6; k >= 0; --k)
+	{
+		p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(expf_coeff[k]));
+	}
+	__m256i e = _mm256_add_epi32(_mm256_castps_si256(shifted), _mm256_set1_epi32(127));
+	return _mm256_mul_ps(p, _mm256_castsi256_ps(_mm256_slli_epi32(e, 23)));
+}
+__attribute__((target("avx2,fma"))) inline void exp_avx2(float* A, int n)
+{
+	int i = 0;
+	for (; i + 8 <= n; i += 8)
+	{
+		_mm256_storeu_ps(A + i, exp_avx2(_mm256_loadu_ps(A + i)));
+	}
+	exp_scalar(A + i, n - i);
+}
+__attribute__((target("avx2,fma"))) inline void sigmoid_avx2(float* A, int n)
+{
+	const __m256 one = _mm256_set1_ps(1.0f);
+	int i = 0;
+	for (; i + 8 <= n; i += 8)
+	{
+		__m256 x = _mm256_max_ps(_mm256_loadu_ps(A + i), _mm256_set1_ps(sigmoidf_lo));
+		__m256 e = exp_avx2(_mm256_sub_ps(_mm256_setzero_ps(), x));
+		_mm256_storeu_ps(A + i, _mm256_div_ps(one, _mm256_add_ps(one, e)));
+	}
+	sigmoid_scalar(A + i, n - i);
+}
+__attribute__((target("avx2,fma"))) inline void affine_avx2(const double* events, int n_events, 
+                                                            int ins, const double* weights, 
+                                                            int outs, double* out)
+{
+	int vector_columns = outs - outs % 4;
+	for (int n = 0; n < n_events; n += 4)
+	{
+		int rows = std::min(4, n_events - n);
+		const double* x0 = events + n * ins;
+		const double* x1 = events + (n + std::min(1, rows - 1)) * ins;
+		const double* x2 = events + (n + std::min(2, rows - 1)) * ins;
+		const double* x3 = events + (n + std::min(3, rows - 1)) * ins;
+		for (int i = 0; i < vector_columns; i += 4)
+		{
+			__m256d s0 = _mm256_setzero_pd(), s1 = s0, s2 = s0, s3 = s0;
+			for (int j = 0; j < ins; ++j)
+			{
+				__m256d row = _mm256_loadu_pd(weights + j * outs + i);
+				s0 = _mm256_add_pd(s0, _mm256_mul_pd(_mm256_set1_pd(x0[j]), row));
+				s1 = _mm256_add_pd(s1, _mm256_mul_pd(_mm256_set1_pd(x1[j]), row));
+				s2 = _mm256_add_pd(s2, _mm256_mul_pd(_mm256_set1_pd(x2[j]), row));
+				s3 = _mm256_add_pd(s3, _mm256_mul_pd(_mm256_set1_pd(x3[j]), row));
+			}
+			__m256d bias = _mm256_loadu_pd(weights + ins * outs + i);
+			double* o = out + n * outs + i;
+			_mm256_storeu_pd(o, _mm256_add_pd(s0, bias));
+			if (rows > 1)
+			{
+				_mm256_storeu_pd(o + 1 * outs, _mm256_add_pd(s1, bias));
+			}
+			if (rows > 2)
+			{
+				_mm256_storeu_pd(o + 2 * outs, _mm256_add_pd(s2, bias));
+			}
+			if (rows > 3)
+			{
+				_mm256_storeu_pd(o + 3 * outs, _mm256_add_pd(s3, bias));
+			}
+		}
+	}
+	affine_scalar(events, n_events, ins, weights, outs, out, vector_columns);
+}
+__attribute__((target("avx2,fma"))) inline void affine_avx2(const float* events, int n_events, 
+                                                            int ins, const float* weights, 
+                                                            int outs, float* out)
+{
+	int vector_columns = outs - outs % 8;
+	for (int n = 0; n < n_events; n += 4)
+	{
+		int rows = std::min(4, n_events - n);
+		const float* x0 = events + n * ins;
+		const float* x1 = events + (n + std::min(1, rows - 1)) * ins;
+		const float* x2 = events + (n + std::min(2, rows - 1)) * ins;
+		const float* x3 = events + (n + std::min(3, rows - 1)) * ins;
+		for (int i = 0; i < vector_columns; i += 8)
+		{
+			__m256 s0 = _mm256_setzero_ps(), s1 = s0, s2 = s0, s3 = s0;
+			for (int j = 0; j < ins; ++j)
+			{
+				__m256 row = _mm256_loadu_ps(weights + j * outs + i);
+				s0 = _mm256_add_ps(s0, _mm256_mul_ps(_mm256_set1_ps(x0[j]), row));
+				s1 = _mm256_add_ps(s1, _mm256_mul_ps(_mm256_set1_ps(x1[j]), row));
+				s2 = _mm256_add_ps(s2, _mm256_mul_ps(_mm256_set1_ps(x2[j]), row));
+				s3 = _mm256_add_ps(s3, _mm256_mul_ps(_mm256_set1_ps(x3[j]), row));
+			}
+			__m256 bias = _mm256_loadu_ps(weights + ins * outs + i);
+			float* o = out + n * outs + i;
+			_mm256_storeu_ps(o, _mm256_add_ps(s0, bias));
+			if (rows > 1)
+			{
+				_mm256_storeu_ps(o + 1 * outs, _mm256_add_ps(s1, bias));
+			}
+			if (rows > 2)
+			{
+				_mm256_storeu_ps(o + 2 * outs, _mm256_add_ps(s2, bias));
+			}
+			if (rows > 3)
+			{
+				_mm256_storeu_ps(o + 3 * outs, _mm256_add_ps(s3, bias));
+			}
+		}
+	}
+	affine_scalar(events, n_events, ins, weights, outs, out, vector_columns);
+}
+// Four jets at a time; requires outs to be a multiple of 8.
+__attribute__((target("avx2,fma"))) inline void int16_dot_avx2(const short* x, int n_events, int n_pairs, 
+                                                               const short* weights, int outs, int* out)
+{
+	for (int n = 0; n < n_events; n += 4)
+	{
+		int rows = std::min(4, n_events - n);
+		const short* x0 = x + n * n_pairs * 2;
+		const short* x1 = x + (n + std::min(1, rows - 1)) * n_pairs * 2;
+		const short* x2 = x + (n + std::min(2, rows - 1)) * n_pairs * 2;
+		const short* x3 = x + (n + std::min(3, rows - 1)) * n_pairs * 2;
+		for (int i = 0; i < outs; i += 8)
+		{
+			__m256i s0 = _mm256_setzero_si256(), s1 = s0, s2 = s0, s3 = s0;
+			for (int p = 0; p < n_pairs; ++p)
+			{
+				__m256i row = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(weights + (p * outs + i) * 2));
+				s0 = _mm256_add_epi32(s0, _mm256_madd_epi16(_mm256_set1_epi32(int16_pair(x0 + 2 * p)), row));
+				s1 = _mm256_add_epi32(s1, _mm256_madd_epi16(_mm256_set1_epi32(int16_pair(x1 + 2 * p)), row));
+				s2 = _mm256_add_epi32(s2, _mm256_madd_epi16(_mm256_set1_epi32(int16_pair(x2 + 2 * p)), row));
+				s3 = _mm256_add_epi32(s3, _mm256_madd_epi16(_mm256_set1_epi32(int16_pair(x3 + 2 * p)), row));
+			}
+			int* o = out + n * outs + i;
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(o), s0);
+			if (rows > 1)
+			{
+				_mm256_storeu_si256(reinterpret_cast<__m256i*>(o + 1 * outs), s1);
+			}
+			if (rows > 2)
+			{
+				_mm256_storeu_si256(reinterpret_cast<__m256i*>(o + 2 * outs), s2);
+			}
+			if (rows > 3)
+			{
+				_mm256_storeu_si256(reinterpret_cast<__m256i*>(o + 3 * outs), s3);
+			}
+		}
+	}
 }
 //----------------------------------------------------------------------------
-inline double dsig(double x) 
+// GCC's unmasked min, max, roundscale, scalef and cvtps_epi32 pass an 
+// uninitialized vector through, which -Wmaybe-uninitialized flags once 
+// inlined; their masked forms over all lanes, with an explicit source, are 
+// the same instructions.
+const __mmask8 all_pd = 0xff;
+const __mmask16 all_ps = 0xffff;
+__attribute__((target("avx512f"))) inline __m512d exp_avx512(__m512d x)
 {
-	return x * (1 - x);
+	x = _mm512_mask_max_pd(x, all_pd, x, _mm512_set1_pd(exp_lo));
+	x = _mm512_mask_min_pd(x, all_pd, x, _mm512_set1_pd(exp_hi));
+	__m512d t = _mm512_mask_roundscale_pd(x, all_pd, _mm512_mul_pd(x, _mm512_set1_pd(log2e)), 
+	                                      _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+	__m512d r = _mm512_fnmadd_pd(t, _mm512_set1_pd(ln2_hi), x);
+	r = _mm512_fnmadd_pd(t, _mm512_set1_pd(ln2_lo), r);
+	__m512d p = _mm512_set1_pd(exp_coeff[11]);
+	for (int k = 10; k >= 0; --k)
+	{
+		p = _mm512_fmadd_pd(p, r, _mm512_set1_pd(exp_coeff[k]));
+	}
+	return _mm512_mask_scalef_pd(p, all_pd, p, t);
 }
-
+__attribute__((target("avx512f"))) inline void exp_avx512(double* A, int n)
+{
+	for (int i = 0; i < n; i += 8)
+	{
+		__mmask8 lanes = static_cast<__mmask8>((n - i >= 8) ? 0xff : ((1u << (n - i)) - 1));
+		_mm512_mask_storeu_pd(A + i, lanes, exp_avx512(_mm512_maskz_loadu_pd(lanes, A + i)));
+	}
+}
+__attribute__((target("avx512f"))) inline void sigmoid_avx512(double* A, int n)
+{
+	const __m512d one = _mm512_set1_pd(1.0);
+	for (int i = 0; i < n; i += 8)
+	{
+		__mmask8 lanes = static_cast<__mmask8>((n - i >= 8) ? 0xff : ((1u << (n - i)) - 1));
+		__m512d e = exp_avx512(_mm512_sub_pd(_mm512_setzero_pd(), _mm512_maskz_loadu_pd(lanes, A + i)));
+		_mm512_mask_storeu_pd(A + i, lanes, _mm512_div_pd(one, _mm512_add_pd(one, e)));
+	}
+}
+__attribute__((target("avx512f"))) inline __m512 exp_avx512(__m512 x)
+{
+	x = _mm512_mask_max_ps(x, all_ps, x, _mm512_set1_ps(expf_lo));
+	x = _mm512_mask_min_ps(x, all_ps, x, _mm512_set1_ps(expf_hi));
+	__m512 t = _mm512_mask_roundscale_ps(x, all_ps, _mm512_mul_ps(x, _mm512_set1_ps(log2ef)), 
+	                                     _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+	__m512 r = _mm512_fnmadd_ps(t, _mm512_set1_ps(ln2f_hi), x);
+	r = _mm512_fnmadd_ps(t, _mm512_set1_ps(ln2f_lo), r);
+	__m512 p = _mm512_set1_ps(expf_coeff[7]);
+	for (int k = 6; k >= 0; --k)
+	{
+		p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(expf_coeff[k]));
+	}
+	return _mm512_mask_scalef_ps(p, all_ps, p, t);
+}
+__attribute__((target("avx512f"))) inline void exp_avx512(float* A, int n)
+{
+	for (int i = 0; i < n; i += 16)
+	{
+		__mmask16 lanes = static_cast<__mmask16>((n - i >= 16) ? 0xffff : ((1u << (n - i)) - 1));
+		_mm512_mask_storeu_ps(A + i, lanes, exp_avx512(_mm512_maskz_loadu_ps(lanes, A + i)));
+	}
+}
+__attribute__((target("avx512f"))) inline void sigmoid_avx512(float* A, int n)
+{
+	const __m512 one = _mm512_set1_ps(1.0f);
+	for (int i = 0; i < n; i += 16)
+	{
+		__mmask16 lanes = static_cast<__mmask16>((n - i >= 16) ? 0xffff : ((1u << (n - i)) - 1));
+		__m512 x = _mm512_maskz_loadu_ps(lanes, A + i);
+		x = _mm512_mask_max_ps(x, all_ps, x, _mm512_set1_ps(sigmoidf_lo));
+		__m512 e = exp_avx512(_mm512_sub_ps(_mm512_setzero_ps(), x));
+		_mm512_mask_storeu_ps(A + i, lanes, _mm512_div_ps(one, _mm512_add_ps(one, e)));
+	}
+}
+__attribute__((target("avx512f"))) inline void quantize_avx512(const float* x, int n, 
+                                                               float inverse_scale, float lowest, 
+                                                               float highest, short* out)
+{
+	const __m512 scale = _mm512_set1_ps(inverse_scale);
+	const __m512 low = _mm512_set1_ps(lowest), high = _mm512_set1_ps(highest);
+	for (int i = 0; i < n; i += 16)
+	{
+		__mmask16 lanes = static_cast<__mmask16>((n - i >= 16) ? 0xffff : ((1u << (n - i)) - 1));
+		__m512 q = _mm512_mul_ps(_mm512_maskz_loadu_ps(lanes, x + i), scale);
+		q = _mm512_mask_min_ps(q, all_ps, high, _mm512_mask_max_ps(q, all_ps, low, q));
+		_mm512_mask_cvtsepi32_storeu_epi16(out + i, lanes, 
+		                                   _mm512_mask_cvtps_epi32(_mm512_setzero_si512(), all_ps, q));
+	}
+}
+__attribute__((target("avx512f"))) inline void affine_avx512(const double* events, int n_events, 
+                                                             int ins, const double* weights, 
+                                                             int outs, double* out)
+{
+	for (int n = 0; n < n_events; n += 4)
+	{
+		int rows = std::min(4, n_events - n);
+		const double* x0 = events + n * ins;
+		const double* x1 = events + (n + std::min(1, rows - 1)) * ins;
+		const double* x2 = events + (n + std::min(2, rows - 1)) * ins;
+		const double* x3 = events + (n + std::min(3, rows - 1)) * ins;
+		for (int i = 0; i < outs; i += 8)
+		{
+			__mmask8 lanes = static_cast<__mmask8>((outs - i >= 8) ? 0xff : ((1u << (outs - i)) - 1));
+			__m512d s0 = _mm512_setzero_pd(), s1 = s0, s2 = s0, s3 = s0;
+			for (int j = 0; j < ins; ++j)
+			{
+				__m512d row = _mm512_maskz_loadu_pd(lanes, weights + j * outs + i);
+				s0 = _mm512_add_pd(s0, _mm512_mul_pd(_mm512_set1_pd(x0[j]), row));
+				s1 = _mm512_add_pd(s1, _mm512_mul_pd(_mm512_set1_pd(x1[j]), row));
+				s2 = _mm512_add_pd(s2, _mm512_mul_pd(_mm512_set1_pd(x2[j]), row));
+				s3 = _mm512_add_pd(s3, _mm512_mul_pd(_mm512_set1_pd(x3[j]), row));
+			}
+			__m512d bias = _mm512_maskz_loadu_pd(lanes, weights + ins * outs + i);
+			double* o = out + n * outs + i;
+			_mm512_mask_storeu_pd(o, lanes, _mm512_add_pd(s0, bias));
+			if (rows > 1)
+			{
+				_mm512_mask_storeu_pd(o + 1 * outs, lanes, _mm512_add_pd(s1, bias));
+			}
+			if (rows > 2)
+			{
+				_mm512_mask_storeu_pd(o + 2 * outs, lanes, _mm512_add_pd(s2, bias));
+			}
+			if (rows > 3)
+			{
+				_mm512_mask_storeu_pd(o + 3 * outs, lanes, _mm512_add_pd(s3, bias));
+			}
+		}
+	}
+}
+__attribute__((target("avx512f"))) inline void affine_avx512(const float* events, int n_events, 
+                                                             int ins, const float* weights, 
+                                                             int outs, float* out)
+{
+	for (int n = 0; n < n_events; n += 4)
+	{
+		int rows = std::min(4, n_events - n);
+		const float* x0 = events + n * ins;
+		const float* x1 = events + (n + std::min(1, rows - 1)) * ins;
+		const float* x2 = events + (n + std::min(2, rows - 1)) * ins;
+		const float* x3 = events + (n + std::min(3, rows - 1)) * ins;
+		for (int i = 0; i < outs; i += 16)
+		{
+			__mmask16 lanes = static_cast<__mmask16>((outs - i >= 16) ? 0xffff : ((1u << (outs - i)) - 1));
+			__m512 s0 = _mm512_setzero_ps(), s1 = s0, s2 = s0, s3 = s0;
+			for (int j = 0; j < ins; ++j)
+			{
+				__m512 row = _mm512_maskz_loadu_ps(lanes, weights + j * outs + i);
+				s0 = _mm512_add_ps(s0, _mm512_mul_ps(_mm512_set1_ps(x0[j]), row));
+				s1 = _mm512_add_ps(s1, _mm512_mul_ps(_mm512_set1_ps(x1[j]), row));
+				s2 = _mm512_add_ps(s2, _mm512_mul_ps(_mm512_set1_ps(x2[j]), row));
+				s3 = _mm512_add_ps(s3, _mm512_mul_ps(_mm512_set1_ps(x3[j]), row));
+			}
+			__m512 bias = _mm512_maskz_loadu_ps(lanes, weights + ins * outs + i);
+			float* o = out + n * outs + i;
+			_mm512_mask_storeu_ps(o, lanes, _mm512_add_ps(s0, bias));
+			if (rows > 1)
+			{
+				_mm512_mask_storeu_ps(o + 1 * outs, lanes, _mm512_add_ps(s1, bias));
+			}
+			if (rows > 2)
+			{
+				_mm512_mask_storeu_ps(o + 2 * outs, lanes, _mm512_add_ps(s2, bias));
+			}
+			if (rows > 3)
+			{
+				_mm512_mask_storeu_ps(o + 3 * outs, lanes, _mm512_add_ps(s3, bias));
+			}
+		}
+	}
+}
+#endif
+#if defined(__clang__)
+#pragma float_control(pop)
+#elif defined(__GNUC__)
+#pragma GCC pop_options
+#endif
 //----------------------------------------------------------------------------
-inline std::vector<double> sigmoid(std::vector<double> A) 
+struct KernelTable
 {
-	for (std::vector<double>::iterator element = A.begin(); element != A.end(); ++element)
+	void (*exp)(double*, int);
+	void (*sigmoid)(double*, int);
+	void (*affine)(const double*, int, int, const double*, int, double*);
+	void (*exp_float)(float*, int);
+	void (*sigmoid_float)(float*, int);
+	void (*affine_float)(const float*, int, int, const float*, int, float*);
+	void (*int16_dot)(const short*, int, int, const short*, int, int*);
+	void (*quantize)(const float*, int, float, float, float, short*);
+	const char* name;
+};
+inline KernelTable select_kernels()
+{
+	KernelTable table = {exp_scalar, sigmoid_scalar, affine_scalar<double>, 
+	                     exp_scalar, sigmoid_scalar, affine_scalar<float>, 
+	                     int16_dot_scalar, quantize_scalar, "scalar"};
+#ifdef JETTAGGER_SIMD
+	__builtin_cpu_init();
+	// AVX-512F has no 16 bit multiply-add; every AVX-512F CPU has AVX2.
+	if (__builtin_cpu_supports("avx512f"))
 	{
-		*element = sig(*element);
+		KernelTable avx512 = {exp_avx512, sigmoid_avx512, affine_avx512, 
+		                      exp_avx512, sigmoid_avx512, affine_avx512, 
+		                      int16_dot_avx2, quantize_avx512, "avx512"};
+		table = avx512;
 	}
-	return (A);
+	else if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+	{
+		KernelTable avx2 = {exp_avx2, sigmoid_avx2, affine_avx2, 
+		                    exp_avx2, sigmoid_avx2, affine_avx2, 
+		                    int16_dot_avx2, quantize_sse2, "avx2"};
+		table = avx2;
+	}
+	else
+	{
+		KernelTable sse2 = {exp_sse2, sigmoid_sse2, affine_sse2, 
+		                    exp_sse2, sigmoid_sse2, affine_sse2, 
+		                    int16_dot_sse2, quantize_sse2, "sse2"};
+		table = sse2;
+	}
+#endif
+	return table;
+}
+inline const KernelTable& kernels()
+{
+	static const KernelTable table = select_kernels();
+	return table;
 }
 //----------------------------------------------------------------------------
-inline std::vector<double> dsigmoid(std::vector<double> A) 
+inline void sigmoid_inplace(double* A, int n) 
 {
-	for(std::vector<double>::iterator element = A.begin(); element != A.end(); ++element) 
+	kernels().sigmoid(A, n);
+}
+inline void sigmoid_inplace(float* A, int n) 
+{
+	kernels().sigmoid_float(A, n);
+}
+//----------------------------------------------------------------------------
+inline void affine_inplace(const double* events, int n_events, int ins, 
+                           const double* weights, int outs, double* out) 
+{
+	kernels().affine(events, n_events, ins, weights, outs, out);
+}
+inline void affine_inplace(const float* events, int n_events, int ins, 
+                           const float* weights, int outs, float* out) 
+{
+	kernels().affine_float(events, n_events, ins, weights, outs, out);
+}
+//----------------------------------------------------------------------------
+// Fused, numerically stable softmax: the maximum is subtracted before 
+// exponentiating, so the log-sum-exp never overflows.
+template <typename T>
+inline void softmax_kernel(T* A, int n, void (*exp_kernel)(T*, int)) 
+{
+	T max = A[0];
+	for (int i = 1; i < n; ++i) 
 	{
-		*element = dsig(*element);
+		max = (A[i] > max) ? A[i] : max;
 	}
-	return (A);
+	for (int i = 0; i < n; ++i) 
+	{
+		A[i] -= max;
+	}
+	exp_kernel(A, n);
+	T sum = 0;
+	for (int i = 0; i < n; ++i) 
+	{
+		sum += A[i];
+	}
+	const T norm = T(1) / sum;
+	for (int i = 0; i < n; ++i) 
+	{
+		A[i] *= norm;
+	}
+}
+inline void softmax_inplace(double* A, int n) 
+{
+	softmax_kernel(A, n, kernels().exp);
+}
+inline void softmax_inplace(float* A, int n) 
+{
+	softmax_kernel(A, n, kernels().exp_float);
 }
 //----------------------------------------------------------------------------
-inline std::vector<double> softmax(std::vector<double> A) 
+inline void int16_dot_inplace(const short* x, int n_events, int n_pairs, 
+                              const short* weights, int outs, int* out) 
 {
-	double sum = 0;
-	for(std::vector<double>::iterator element = A.begin(); element != A.end(); ++element) 
+	kernels().int16_dot(x, n_events, n_pairs, weights, outs, out);
+}
+inline void quantize_inplace(const float* x, int n, float inverse_scale, 
+                             float lowest, float highest, short* out) 
+{
+	kernels().quantize(x, n, inverse_scale, lowest, highest, out);
+}
+//----------------------------------------------------------------------------
+inline const char* activation_kernels()
+{
+	return kernels().name;
+}
+//----------------------------------------------------------------------------
+// Largest absolute difference in any class probability between two nets 
+// loaded from the same files, over n_jets laid out as get_input_layout(). 
+// Meant to validate a float instantiation against the double reference on 
+// a sample of jets; jets outside the pt/eta range are skipped.
+template <typename A, typename B>
+inline double max_probability_deviation(const BasicNeuralNet<A> &reference, 
+                                        const BasicNeuralNet<B> &candidate, 
+                                        const double* jets, int n_jets)
+{
+	if (reference.get_input_layout() != candidate.get_input_layout() || 
+	    reference.get_output_names() != candidate.get_output_names()) 
 	{
-		*element = exp(*element);
-		sum += *element;
+		throw std::invalid_argument("nets differ in inputs or outputs");
 	}
-	for(std::vector<double>::iterator element = A.begin(); element != A.end(); ++element) 
+	int n_layout = reference.get_input_layout().size();
+	int n_outputs = reference.get_output_names().size();
+	std::vector<A> reference_jets(jets, jets + n_jets * n_layout);
+	std::vector<B> candidate_jets(jets, jets + n_jets * n_layout);
+	std::vector<A> reference_probabilities(n_jets * n_outputs);
+	std::vector<B> candidate_probabilities(n_jets * n_outputs);
+	BasicInferenceContext<A> reference_context;
+	BasicInferenceContext<B> candidate_context;
+	std::vector<bool> valid = reference.predict_batch(&reference_jets[0], n_jets, 
+	                                                  &reference_probabilities[0], 
+	                                                  reference_context);
+	candidate.predict_batch(&candidate_jets[0], n_jets, 
+	                        &candidate_probabilities[0], candidate_context);
+	double deviation = 0;
+	for (int n = 0; n < n_jets; ++n) 
 	{
-		*element /= sum;
+		if (!valid[n]) 
+		{
+			continue;
+		}
+		for (int i = n * n_outputs; i < (n + 1) * n_outputs; ++i) 
+		{
+			double difference = fabs(static_cast<double>(reference_probabilities[i]) - 
+			                         static_cast<double>(candidate_probabilities[i]));
+			deviation = std::max(deviation, difference);
+		}
 	}
-	return (A);
+	return deviation;
 }
 //----------------------------------------------------------------------------
 inline std::string trim(const std::string& str, const std::string& whitespace)
@@ -798,6 +3284,76 @@ inline void set_physics_category(double pt, double eta, std::map<std::string, do
 		throw std::range_error("jet outside classifiable eta range"); 
 	}
 }	
+//----------------------------------------------------------------------------
+// Non-throwing counterpart of set_physics_category for the batch path. 
+// Returns false if the jet is outside the classifiable pt or eta range.
+inline bool find_physics_category(double pt, double eta, 
+                                  int &cat_pT, int &cat_eta)
+{
+	bool pt_found = false, eta_found = false;
+	for (int i = 0; i < 7; ++i)
+	{
+		if ((pt >= pt_bins[i]) && (pt < pt_bins[i + 1]))
+		{
+			cat_pT = i; pt_found = true; break;
+		}
+	}
+	for (int i = 0; i < 4; ++i)
+	{
+		if ((fabs(eta) >= eta_bins[i]) && (fabs(eta) < eta_bins[i + 1]))
+		{
+			cat_eta = i; eta_found = true; break;
+		}
+	}
+	return pt_found && eta_found;
+}
+
+//----------------------------------------------------------------------------
+// Writes the network inputs of one jet given in the batch layout: the 
+// layout columns and physics categories in input order, each shifted by 
+// its mean and scaled by its standard deviation. The arithmetic is done 
+// in double whatever the precision of the net.
+template <typename T>
+inline void normalize_jet(const T* jet, int cat_pT, int cat_eta, 
+                          const std::vector<int> &layout_index, 
+                          const std::vector<double> &mean, 
+                          const std::vector<double> &stddev, T* input)
+{
+	for (unsigned int i = 0; i < layout_index.size(); ++i) 
+	{
+		double value;
+		if (layout_index[i] >= 0) 
+		{
+			value = jet[layout_index[i]];
+		}
+		else 
+		{
+			value = (layout_index[i] == -1) ? cat_pT : cat_eta;
+		}
+		value -= mean[i];
+		value /= ((stddev[i] < 1e-7) ? 1e-4 : stddev[i]); // avoid dirac delta-like variances
+		input[i] = static_cast<T>(value);
+	}
+}
+//----------------------------------------------------------------------------
+// As normalize_jet, for nets whose first layer has the normalization 
+// folded into it: the inputs are only put in order.
+template <typename T>
+inline void gather_jet(const T* jet, int cat_pT, int cat_eta, 
+                       const std::vector<int> &layout_index, T* input)
+{
+	for (unsigned int i = 0; i < layout_index.size(); ++i) 
+	{
+		if (layout_index[i] >= 0) 
+		{
+			input[i] = jet[layout_index[i]];
+		}
+		else 
+		{
+			input[i] = static_cast<T>((layout_index[i] == -1) ? cat_pT : cat_eta);
+		}
+	}
+}
 
 // hack for c++03 backport (c++03 has no map::at())
 inline double find_or_throw(const std::map<std::string, double>& map, 
@@ -15,6 +15,7 @@ unique_ptr<T>, and std::move semantics.
 #ifndef LAYER_H
 #define LAYER_H 
 
+#include <atomic>
 #include <string>
 #include <random>
 #include <cmath>
@@ -23,23 +24,56 @@ unique_ptr<T>, and std::move semantics.
 #include <iostream>
 #include <iomanip>
 #include <memory>
+#include <vector>
+#include "Arena.h"
+#include "Optimizer.h"
+
+//----------------------------------------------------------------------------
+// Buffers for one mini-batch: per-layer (n_events x outs) outputs and 
+// deltas, each layer's (ins + 1) x outs gradient summed over the batch and 
+// the summed event weight. Threads training one Architecture own one each; 
+// pretraining uses one for a layer and its autoencoder. Outputs and deltas 
+// are in T, gradients are summed in double either way.
+//----------------------------------------------------------------------------
+template <typename T>
+struct BasicBatchWorkspace
+{
+	std::vector<std::vector<T>> outs, deltas;
+	std::vector<std::vector<double>> gradients;
+	double weight_sum = 0;
+};
+typedef BasicBatchWorkspace<double> BatchWorkspace;
+typedef BasicBatchWorkspace<float> FloatBatchWorkspace;
 
 class Layer
 {
 public:
 //----------------------------------------------------------------------------
-	Layer(int ins, int outs, bool last, std::vector<double> (*Activation_function)(std::vector<double>));
+	Layer(int ins, int outs, bool last, void (*Activation_function)(double*, int), double *storage = nullptr, 
+	      bool initialize = true);
 	Layer(std::vector<std::vector<double> > Synapse, bool last);
 	~Layer();
+	static std::size_t storage_size(int ins, int outs);
 	std::vector<double> fire();
-	void setDelta(std::vector<double> deltas);
+	void setDelta(const std::vector<double> &deltas);
 	void perturb(double epsilon);
 	void resetWeights(double bound);
 	void make_denoising();
-	void encode(std::vector<double> input, double learning, double weight);
-	void feed(std::vector<double> event);
-	void set(int i, int j, double val);
-	void drop();
+	void encode_gradient(const double *inputs, const double *weights, int n_events, 
+	                     BatchWorkspace &batch) const;
+	void encode_descend(const BatchWorkspace &batch, double learning);
+	void feed(const double *event);
+	void feed(const std::vector<double> &event);
+	template <typename T>
+	void feed_batch(const T *events, int n_events, T *out) const;
+	void descend(const double *gradient, double rate, double decay);
+	void setOptimizer(const Optimizer *optimizer);
+	void resetOptimizer();
+	template <typename T>
+	void accumulate_gradient(const T *inputs, const T *deltas, const double *weights, 
+	                         int n_events, double *gradient, bool bias = true) const;
+	template <typename T>
+	const T* weights() const;
 	void setMomentum(double x);
 	std::vector<double> getReconstructedInput(std::vector<double> jet);
 
@@ -47,20 +81,49 @@ private:
 //----------------------------------------------------------------------------
 	friend class Architecture;
 	friend class NeuralNet;
-	std::vector<std::vector<double> > Synapse, DeltaSynapse;
+	void bind(double *storage);
+	void activate(double *outs, int n) const;
+	void activate(float *outs, int n) const;
+	// Synapse, DeltaSynapse, Moment and Gradient are row-major 
+	// (ins + 1) x outs blocks, the last row holding the bias; DeltaSynapse 
+	// and Moment are the optimizer's state. All six arrays live in one 
+	// block, either carved out of the Architecture's arena or owned by the 
+	// layer itself.
+	double *Synapse, *DeltaSynapse, *Moment, *Gradient, *Delta, *Outs;
+	// A single-precision copy of Synapse for float training, kept by the 
+	// Architecture; null otherwise.
+	float *SynapseF;
+	Arena own_storage;
 	// Layer *Auto_Encoder;
 	std::unique_ptr<Layer> Auto_Encoder;
-	std::vector<double> Delta, Outs;
-	std::vector<double> (*_sigmoid)(std::vector<double>);
+	void (*_sigmoid)(double*, int);
 	int ins, outs;
 	bool last;
-	double gamma, onemingamma;
+	double gamma;
+	const Optimizer *optimizer;
+	// Updates so far. Hogwild threads descend on the same layer at once, 
+	// so each takes its own step number from it.
+	std::atomic<long> steps;
 };
 
+template <>
+inline const double* Layer::weights<double>() const
+{
+	return Synapse;
+}
+template <>
+inline const float* Layer::weights<float>() const
+{
+	return SynapseF;
+}
+
 //----------------------------------------------------------------------------
 //------------------ NON CLASS UTILITY-TYPE FUNCTIONS ------------------------
 //----------------------------------------------------------------------------
 
+// Draws every Layer's initial and perturbed weights.
+extern std::mt19937_64 generator;
+
 void progress_bar(int percent);
 void epoch_progress_bar(int percent, int epoch, int tot);
 
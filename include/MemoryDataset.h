@@ -0,0 +1,185 @@
+//------------------------------------------------------
+//				MemoryDataset.h
+//------------------------------------------------------
+
+#ifndef MEMORYDATASET_H
+#define MEMORYDATASET_H
+
+#include <cstddef>
+#include <vector>
+#include "Arena.h"
+
+//----------------------------------------------------------------------------
+// Events held in memory for training: one aligned, row-major
+// (size() x n_inputs()) feature matrix of type T, a class index and a
+// weight per event. Rows are added as read and normalized in place once,
+// after which row(n) points at n_events consecutive normalized events,
+// ready to be run as a batch without copying.
+//
+// Labels are kept as the index of the largest one of an event's outputs,
+// -1 if none is set, which holds the one-hot targets the softmax loss
+// trains on.
+//
+// A store can instead attach() to events held elsewhere, such as a mapped
+// preprocessed cache, and read them in place. It copies them in only if
+// they are changed.
+//----------------------------------------------------------------------------
+template <typename T>
+class MemoryDataset
+{
+public:
+	MemoryDataset() : n_cols(0), n_classes(0), normalized(false) { own(); }
+
+	// Empties the store for events of n_inputs inputs and n_outputs classes.
+	void reset(int n_inputs, int n_outputs)
+	{
+		features.clear();
+		labels.clear();
+		event_weights.clear();
+		mean.clear();
+		scale.clear();
+		n_cols = n_inputs;
+		n_classes = n_outputs;
+		normalized = false;
+		own();
+	}
+	// Makes room for n events, so that adding them does not reallocate.
+	void reserve(std::size_t n)
+	{
+		features.reserve(n * n_cols);
+		labels.reserve(n);
+		event_weights.reserve(n);
+	}
+	// Adds one event as read, before normalize().
+	void add(const std::vector<double> &input, const std::vector<double> &output, double weight)
+	{
+		features.insert(features.end(), input.begin(), input.end());
+		labels.push_back(label_of(output));
+		event_weights.push_back(weight);
+		own();
+	}
+	// Reads n events, normalized with Mean and Stddev, in place from 
+	// storage that outlives the store.
+	void attach(const T *Features, const signed char *Labels, const double *Weights, 
+	            std::size_t n, const std::vector<double> &Mean, const std::vector<double> &Stddev)
+	{
+		features.clear();
+		labels.clear();
+		event_weights.clear();
+		x = Features;
+		y = Labels;
+		w = Weights;
+		n_rows = n;
+		mean = Mean;
+		scale = safe_scale(Stddev);
+		normalized = true;
+	}
+	// Normalizes every value to (x - mean) / stddev, as
+	// NeuralNet::transform does. A store already normalized is moved over
+	// to the new values, or left alone if they are the same.
+	void normalize(const std::vector<double> &Mean, const std::vector<double> &Stddev)
+	{
+		std::vector<double> Scale = safe_scale(Stddev);
+		if (normalized && (Mean == mean) && (Scale == scale))
+		{
+			return;
+		}
+		copy_in();
+		normalize_rows(features.data(), size(), n_cols, Mean.data(), Scale.data(), 
+		               normalized ? mean.data() : 0, normalized ? scale.data() : 0);
+		mean = Mean;
+		scale = Scale;
+		normalized = true;
+	}
+	// Normalizes n rows of n_cols values in place to (x - Mean) / Scale, 
+	// each x being raw or, given From_mean and From_scale, normalized 
+	// with them.
+	static void normalize_rows(T *rows, std::size_t n, int n_cols, const double *Mean, 
+	                           const double *Scale, const double *From_mean = 0, 
+	                           const double *From_scale = 0)
+	{
+		for (std::size_t k = 0; k < n; ++k)
+		{
+			T *x = rows + k * n_cols;
+			for (int i = 0; i < n_cols; ++i)
+			{
+				const double raw = From_mean ? x[i] * From_scale[i] + From_mean[i] : x[i];
+				x[i] = (raw - Mean[i]) / Scale[i];
+			}
+		}
+	}
+	static std::vector<double> safe_scale(const std::vector<double> &Stddev)
+	{
+		std::vector<double> Scale(Stddev);
+		for (auto &s : Scale)
+		{
+			s = (s < 1e-7) ? 1e-4 : s; // avoid dirac delta-like variances
+		}
+		return Scale;
+	}
+	static int label_of(const std::vector<double> &output)
+	{
+		int label = -1;
+		for (int i = 0; i < (int)output.size(); ++i)
+		{
+			if ((output[i] > 0) && ((label < 0) || (output[i] > output[label])))
+			{
+				label = i;
+			}
+		}
+		return label;
+	}
+
+	std::size_t size() const { return n_rows; }
+	bool empty() const { return n_rows == 0; }
+	int n_inputs() const { return n_cols; }
+	int n_outputs() const { return n_classes; }
+	// The normalized inputs of event n, followed by those of the events after it.
+	const T* row(std::size_t n) const { return x + n * n_cols; }
+	int label(std::size_t n) const { return y[n]; }
+	// Writes the one-hot outputs of event n to out.
+	void outputs(std::size_t n, double *out) const
+	{
+		for (int i = 0; i < n_classes; ++i)
+		{
+			out[i] = (i == y[n]) ? 1 : 0;
+		}
+	}
+	double weight(std::size_t n) const { return w[n]; }
+	const double* weights() const { return w; }
+	const signed char* label_data() const { return y; }
+private:
+	// Points the views at the store's own vectors.
+	void own()
+	{
+		x = features.data();
+		y = labels.data();
+		w = event_weights.data();
+		n_rows = event_weights.size();
+	}
+	// Copies attached events into the store's own vectors.
+	void copy_in()
+	{
+		if (x != features.data())
+		{
+			features.assign(x, x + n_rows * n_cols);
+			labels.assign(y, y + n_rows);
+			event_weights.assign(w, w + n_rows);
+			own();
+		}
+	}
+	std::vector<T, AlignedAllocator<T> > features;
+	std::vector<signed char> labels;
+	std::vector<double> event_weights;
+	// the events read, the vectors' own or attached ones
+	const T *x;
+	const signed char *y;
+	const double *w;
+	std::size_t n_rows;
+	// the normalization applied, with the same guard against zero spreads
+	std::vector<double> mean, scale;
+	int n_cols, n_classes;
+	bool normalized;
+};
+
+#endif
@@ -15,14 +15,21 @@
 #include <fstream>
 #include <sstream>
 #include <vector>
+#include <thread>
+#include <functional>
 #include "Architecture.h"
 #include "Activation.h"
 #include "Dataset.h"
+#include "Pipeline.h"
+#include "MemoryDataset.h"
+#include "EventCache.h"
 #include <assert.h>
 
 
 typedef std::pair<std::string, double> DictElement;
 
+namespace JetTagger { class MappedFile; }
+
 class NeuralNet
 {
 public:
@@ -48,23 +55,33 @@ public:
 
 	void setLearning( double x );
 	void setMomentum( double x );
+	void setBatchSize( int n );
+	void setThreads( int n, bool hogwild = false );
+	bool setOptimizer( const std::string &name );
+	void setValidation( int n_holdout, int interval = 0, int patience = 0 );
+	void setCheckpoints( int interval );
+	void setShuffle( unsigned long seed, int buffer = 10000, int block = 64 );
+	void setSinglePrecision( bool single );
+	void setReadCache( long long bytes );
+	bool setSelection( const std::string &cuts );
+	void setPreprocessedCache( const std::string &filename );
 	void anneal( double x );
 
-	void encode(std::vector<std::vector<double>> input, std::vector<double> weight, bool verbose);
+	void encode(const std::vector<std::vector<double>> &input, const std::vector<double> &weight, bool verbose);
 	void encode(bool verbose = 1);
 
 	void train(int n_epochs, int n_train, std::string save_filename, 
 		       bool verbose = 0, std::string timestamp = "", bool memory = false);
 
-	void train(std::vector<double> Event, std::vector<double> Actual, double weight = 1);
+	void train(const std::vector<double> &Event, const std::vector<double> &Actual, double weight = 1);
 
-	void getTransform(bool verbose = false, bool into_memory = 0, int n_train = -1, bool cdf_weight = false, bool relative = true);
+	bool getTransform(bool verbose = false, bool into_memory = 0, int n_train = -1, bool cdf_weight = false, bool relative = true);
 	void setTransform( std::vector<double> Mean, std::vector<double> Stddev );
 
 
-	void setActivationFunctions(std::vector<double> (*sigmoid_function) (std::vector<double>),
+	void setActivationFunctions(void (*sigmoid_function) (double*, int),
                                 double (*sigmoid_derivative)(double), 
-                                std::vector<double> (*softmax_function) (std::vector<double>));
+                                void (*softmax_function) (double*, int));
 
 	std::vector<double> transform( std::vector<double> Event );
 	std::vector<std::vector<double>> transform(std::vector<std::vector<double>> Event);
@@ -75,19 +92,132 @@ public:
 	bool save( const std::string &filename );
 	bool load( const std::string &filename );
 	bool write_perf( const std::string &filename = "" , int start = 0, int end = 10000);
+	bool quantize( const std::string &spec_file, const std::string &net_file, 
+	               const std::string &quantized_file, int n_calibration, int n_test );
 	std::vector<std::string> get_ranking();
 private:
 //----------------------------------------------------------------------------
+	// alloc-test.cxx drives the training steps below directly.
+	friend struct TrainingSteps;
 	std::unique_ptr<Dataset> dataset;
-	std::vector<std::vector<double> > dataset_mem, labels_mem;
+	// Events loaded with -memory, normalized; single precision keeps them 
+	// in float_mem instead.
+	MemoryDataset<double> dataset_mem;
+	MemoryDataset<float> float_mem;
 	std::unique_ptr<Architecture> Net;
+	// A mini-batch being filled: normalized events with their labels and 
+	// weights, their errors, and the Architecture buffers to run it through. 
+	// Events and activations are of type T; labels, weights, errors and 
+	// summed gradients stay double. A batch of consecutive events held in 
+	// memory is run in place from run, rather than copied to events.
+	template <typename T>
+	struct BasicShard
+	{
+		std::vector<T> events;
+		const T *run = nullptr;
+		std::vector<double> labels, weights, errors;
+		BasicBatchWorkspace<T> workspace;
+	};
+	typedef BasicShard<double> BatchShard;
+	typedef BasicShard<float> FloatShard;
+	void normalize(const std::vector<double> &Event, double *out) const;
+	void add_to_batch(BatchShard &shard, const std::vector<double> &Event, 
+	                  const std::vector<double> &Actual, double weight) const;
+	template <typename T>
+	void add_memory_event(BasicShard<T> &shard, const MemoryDataset<T> &store, int event) const;
+	void train_normalized(const double *event, const double *Actual, double weight);
+	template <typename T>
+	void batch_gradient(BasicShard<T> &shard) const;
+	void train_batched(const std::vector<double> &Event, const std::vector<double> &Actual, double weight);
+	void train_batched(int event);
+	template <typename T>
+	void flush_batch(BasicShard<T> &shard);
+	void flush_batch();
+	template <typename T>
+	void train_threaded(std::vector<BasicShard<T> > &shards, const MemoryDataset<T> &store, 
+	                    int epoch, int n_epochs, bool verbose);
+	// One dataset entry as the loading pipeline hands it on: its inputs, 
+	// labels and weight, the named values selections cut on, and whether 
+	// it passed the training selection.
+	struct Row
+	{
+		long entry;
+		std::vector<double> input, output, values;
+		double weight;
+		bool selected;
+	};
+	void read_row(long entry, Row &row, const std::vector<int> &columns, bool reweight, 
+	              bool select = false);
+	std::vector<int> find_columns(const std::vector<std::string> &names) const;
+	std::mt19937_64 epoch_generator(int epoch) const;
+	void shuffle_order(int epoch, int n_events);
+	bool train_shuffled(int epoch, int n_epochs, int n_train, long skip, 
+	                    const std::function<bool(int, long)> &check, bool verbose);
+	bool load_optimizer_state(const char *text);
+	void checkpoint(const std::string &filename, int epoch, long entry);
+	bool write_checkpoint(const std::string &filename, const Architecture &net, int epoch, 
+	                      long entry, long trained, const std::string &rng) const;
+	bool load_checkpoint(std::istream &in);
+	void load_holdout(int first_entry);
+	double validation_loss(const Architecture &net) const;
+	bool validate(bool verbose);
+	bool collect_validation(bool verbose);
+	void finish_validation(bool verbose);
+	// Validation: the holdout events, the snapshot under evaluation on 
+	// validator, and the best net so far. Checked every validation_interval trained 
+	// events (0: every epoch); training stops after patience checks 
+	// without improvement (0: never).
+	MemoryDataset<double> holdout;
+	int n_holdout = 0, validation_interval = 0, patience = 0, since_best = 0;
+	std::unique_ptr<Architecture> pending, best_net;
+	double pending_loss = 0, best_loss = 0;
+	std::thread validator;
+	// Checkpoints, written on checkpointer, are taken at the start of every 
+	// epoch and every checkpoint_interval trained events (0: never). A 
+	// loaded one makes training start at entry start_entry of epoch 
+	// start_epoch, with trained events counted so far.
+	int checkpoint_interval = 0, start_epoch = 0;
+	long start_entry = 0, trained = 0;
+	std::thread checkpointer;
+	// batch trains on one thread, shards on n_threads; batch_size 1 trains 
+	// per event.
+	BatchShard batch;
+	std::vector<BatchShard> shards;
+	int batch_size = 1, n_threads = 1;
+	bool hogwild = false;
+	// Single precision: events in memory are held in float_mem and 
+	// always train in float batches.
+	bool single_precision = false;
+	FloatShard float_batch;
+	std::vector<FloatShard> float_shards;
+	// Shuffling: each epoch's order is drawn from shuffle_seed and the 
+	// epoch alone. In memory, epoch_order visits blocks of shuffle_block 
+	// adjacent events in random order, each block shuffled; streamed 
+	// events go through a buffer of shuffle_buffer events.
+	bool shuffle = false;
+	unsigned long shuffle_seed = 0;
+	int shuffle_buffer = 10000, shuffle_block = 64;
+	std::vector<int> epoch_order;
+	// Reads, selects and hands on dataset entries on threads of its own.
+	Pipeline<Row> loader;
+	long long cache_size = -1;
+	// The preprocessed cache events in memory are read from and written 
+	// to, if any, with what identifies the events it holds: the input 
+	// file, the spec's text and the selection.
+	std::string preprocessed_file;
+	std::shared_ptr<JetTagger::MappedFile> preprocessed;
+	std::string root_file, tree_name, spec_text, selection;
+	uint64_t preprocessed_key(int n_train, bool cdf_weight, bool relative) const;
+	bool map_preprocessed(uint64_t key);
 	double learning, momentum;
 	std::vector<int> structure;
 	int count;
-	std::vector<double> mean, stddev, weights_mem;
+	std::vector<double> mean, stddev;
+	// the outputs of a per-event step on dataset_mem
+	std::vector<double> memory_label;
 	double (*_sigmoid_derivative) (double);
-	std::vector<double> (*_softmax_function) (std::vector<double>);
-	std::vector<double> (*_sigmoid) (std::vector<double>);
+	void (*_softmax_function) (double*, int);
+	void (*_sigmoid) (double*, int);
 };
 
 
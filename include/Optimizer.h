@@ -0,0 +1,105 @@
+//------------------------------------------------------
+//				Optimizer.h
+//------------------------------------------------------
+
+#ifndef OPTIMIZER_H
+#define OPTIMIZER_H
+
+#include <string>
+#include <vector>
+#include <memory>
+
+//----------------------------------------------------------------------------
+// One layer's weights as an optimizer sees them. velocity and moment are 
+// per-weight state kept next to the weights in the arena; only the first 
+// n_decayed weights (all but the bias row) take weight decay.
+//----------------------------------------------------------------------------
+struct WeightBlock
+{
+	double *weights, *velocity, *moment;
+	int n_weights, n_decayed;
+	double momentum;  // the layer's momentum, as set by -m
+	long steps;       // updates so far, this one included
+};
+
+//----------------------------------------------------------------------------
+// Rule turning a gradient into a weight update. Optimizers hold only their 
+// hyperparameters, so threads may share one.
+//----------------------------------------------------------------------------
+class Optimizer
+{
+public:
+	virtual ~Optimizer() {}
+	virtual Optimizer* clone() const = 0;
+	virtual std::string name() const = 0;
+	// Moves the weights along -gradient at the given learning rate, also 
+	// subtracting decay times each decayed weight.
+	virtual void step(const WeightBlock &block, const double *gradient, 
+	                  double rate, double decay) const = 0;
+};
+
+//----------------------------------------------------------------------------
+// Exponentially smoothed momentum: velocity = (1 - momentum) * step + 
+// momentum * velocity, with step = -rate * gradient - decay * weight. 
+// This is the trainer's original update.
+//----------------------------------------------------------------------------
+class MomentumOptimizer : public Optimizer
+{
+public:
+	Optimizer* clone() const { return new MomentumOptimizer(*this); }
+	std::string name() const { return "momentum"; }
+	void step(const WeightBlock &block, const double *gradient, double rate, double decay) const;
+};
+
+//----------------------------------------------------------------------------
+// Nesterov momentum in the same smoothed form: the weights move by the 
+// updated velocity looked ahead one more step.
+//----------------------------------------------------------------------------
+class NesterovOptimizer : public Optimizer
+{
+public:
+	Optimizer* clone() const { return new NesterovOptimizer(*this); }
+	std::string name() const { return "nesterov"; }
+	void step(const WeightBlock &block, const double *gradient, double rate, double decay) const;
+};
+
+//----------------------------------------------------------------------------
+// RMSProp: the step is scaled by a running root mean square of the 
+// gradient, kept in moment.
+//----------------------------------------------------------------------------
+class RMSPropOptimizer : public Optimizer
+{
+public:
+	RMSPropOptimizer(double rho = 0.9, double epsilon = 1e-8) : rho(rho), epsilon(epsilon) {}
+	Optimizer* clone() const { return new RMSPropOptimizer(*this); }
+	std::string name() const { return "rmsprop"; }
+	void step(const WeightBlock &block, const double *gradient, double rate, double decay) const;
+private:
+	double rho, epsilon;
+};
+
+//----------------------------------------------------------------------------
+// Adam: bias-corrected running means of the gradient (in velocity) and of 
+// its square (in moment). Weight decay is applied to the weights directly.
+//----------------------------------------------------------------------------
+class AdamOptimizer : public Optimizer
+{
+public:
+	AdamOptimizer(double beta1 = 0.9, double beta2 = 0.999, double epsilon = 1e-8) : 
+	              beta1(beta1), beta2(beta2), epsilon(epsilon) {}
+	Optimizer* clone() const { return new AdamOptimizer(*this); }
+	std::string name() const { return "adam"; }
+	void step(const WeightBlock &block, const double *gradient, double rate, double decay) const;
+private:
+	double beta1, beta2, epsilon;
+};
+
+//----------------------------------------------------------------------------
+// Returns a new optimizer of the given name (momentum, nesterov, rmsprop or 
+// adam) with default hyperparameters, or nullptr if the name is unknown.
+std::unique_ptr<Optimizer> make_optimizer(const std::string &name);
+
+// The optimizer layers use until their Architecture is given one.
+const Optimizer& default_optimizer();
+
+#endif
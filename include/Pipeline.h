@@ -0,0 +1,133 @@
+//------------------------------------------------------
+//				Pipeline.h
+//------------------------------------------------------
+
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+//----------------------------------------------------------------------------
+// Bounded ring of values passed from one producer thread to one consumer
+// thread without locks: the producer only moves tail, the consumer only
+// moves head.
+//----------------------------------------------------------------------------
+template <typename T>
+class SpscQueue
+{
+public:
+	explicit SpscQueue(int capacity) : ring(capacity + 1), head(0), tail(0) {}
+	bool push(const T &value)
+	{
+		const std::size_t at = tail.load(std::memory_order_relaxed);
+		const std::size_t next = (at + 1 == ring.size()) ? 0 : at + 1;
+		if (next == head.load(std::memory_order_acquire))
+		{
+			return false;
+		}
+		ring[at] = value;
+		tail.store(next, std::memory_order_release);
+		return true;
+	}
+	bool pop(T &value)
+	{
+		const std::size_t at = head.load(std::memory_order_relaxed);
+		if (at == tail.load(std::memory_order_acquire))
+		{
+			return false;
+		}
+		value = ring[at];
+		head.store((at + 1 == ring.size()) ? 0 : at + 1, std::memory_order_release);
+		return true;
+	}
+	// Spin, yielding, while the queue is full or empty.
+	void wait_push(const T &value)
+	{
+		while (!push(value))
+		{
+			std::this_thread::yield();
+		}
+	}
+	T wait_pop()
+	{
+		T value;
+		while (!pop(value))
+		{
+			std::this_thread::yield();
+		}
+		return value;
+	}
+private:
+	std::vector<T> ring;
+	// apart, so that the two threads do not share a cache line
+	alignas(64) std::atomic<std::size_t> head;
+	alignas(64) std::atomic<std::size_t> tail;
+};
+
+//----------------------------------------------------------------------------
+// Streams entries through three concurrent stages: read(entry, record) on
+// a reader thread, filter(record) on a second thread, and consume(record)
+// on the calling thread for the records filter kept, in entry order.
+// Records are recycled through a pool of depth slots, so that once each
+// has been filled once the stages allocate nothing. consume returns false
+// to stop early. read must be the only user of its source while run() goes
+// on; filter and consume only see records.
+//----------------------------------------------------------------------------
+template <typename Record>
+class Pipeline
+{
+public:
+	explicit Pipeline(int depth = 1024) :
+	records(depth), free_slots(depth), read_slots(depth), kept_slots(depth), kept(depth) {}
+
+	template <typename Read, typename Filter, typename Consume>
+	void run(long first, long last, Read read, Filter filter, Consume consume)
+	{
+		const int end = -1;
+		std::atomic<bool> stopped(false);
+		int left;
+		while (free_slots.pop(left)) {} // left over from the last run
+		for (int slot = 0; slot < (int)records.size(); ++slot)
+		{
+			free_slots.push(slot);
+		}
+		std::thread reader([&]()
+		{
+			for (long entry = first; (entry < last) && !stopped.load(std::memory_order_relaxed); ++entry)
+			{
+				const int slot = free_slots.wait_pop();
+				read(entry, records[slot]);
+				read_slots.wait_push(slot);
+			}
+			read_slots.wait_push(end);
+		});
+		std::thread selector([&]()
+		{
+			for (int slot = read_slots.wait_pop(); slot != end; slot = read_slots.wait_pop())
+			{
+				kept[slot] = filter(records[slot]);
+				kept_slots.wait_push(slot);
+			}
+			kept_slots.wait_push(end);
+		});
+		// after an early stop, keep draining so that the other stages finish
+		for (int slot = kept_slots.wait_pop(); slot != end; slot = kept_slots.wait_pop())
+		{
+			if (kept[slot] && !stopped.load(std::memory_order_relaxed) && !consume(records[slot]))
+			{
+				stopped.store(true);
+			}
+			free_slots.wait_push(slot);
+		}
+		reader.join();
+		selector.join();
+	}
+private:
+	std::vector<Record> records;
+	SpscQueue<int> free_slots, read_slots, kept_slots;
+	std::vector<char> kept;
+};
+
+#endif
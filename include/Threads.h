@@ -0,0 +1,64 @@
+//------------------------------------------------------
+//				Threads.h
+//------------------------------------------------------
+
+#ifndef THREADS_H
+#define THREADS_H
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+//----------------------------------------------------------------------------
+// Holds each of n threads in wait() until all n have arrived. It spins 
+// rather than sleeping, as training steps are only microseconds apart.
+//----------------------------------------------------------------------------
+class Barrier
+{
+public:
+	explicit Barrier(int n) : n_threads(n), waiting(0), generation(0) {}
+	void wait()
+	{
+		int arrival = generation.load();
+		if (waiting.fetch_add(1) + 1 == n_threads) 
+		{
+			waiting.store(0);
+			generation.fetch_add(1);
+		}
+		else
+		{
+			while (generation.load() == arrival) 
+			{
+				std::this_thread::yield();
+			}
+		}
+	}
+private:
+	const int n_threads;
+	std::atomic<int> waiting, generation;
+};
+
+//----------------------------------------------------------------------------
+// Runs work(t) for t = 0 .. n_threads - 1, each on its own thread (or on the 
+// calling thread when there is only one), and returns once all are done.
+//----------------------------------------------------------------------------
+template <typename Work>
+inline void run_threads(int n_threads, Work work)
+{
+	if (n_threads <= 1)
+	{
+		work(0);
+		return;
+	}
+	std::vector<std::thread> threads;
+	for (int t = 0; t < n_threads; ++t) 
+	{
+		threads.emplace_back(work, t);
+	}
+	for (auto &thread : threads) 
+	{
+		thread.join();
+	}
+}
+
+#endif
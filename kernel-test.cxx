@@ -0,0 +1,212 @@
+#include <iostream>
+#include <cmath>
+#include <vector>
+#include "include/JetTagger.h"
+
+// Checks every exp, sigmoid and softmax kernel set this CPU can run against
+// std::exp and against the scalar kernels, over the range the kernels clamp
+// their inputs to, and their affine maps against the scalar one. Exits
+// non-zero if any of them is off by more than the stated bound: 1e-14
+// relative for double, 1e-6 relative (a few ulp) for float, and nothing at
+// all for the affine maps, which round exactly as the scalar loop does.
+
+struct KernelSet
+{
+    const char* name;
+    void (*exp)(double*, int);
+    void (*sigmoid)(double*, int);
+    void (*exp_float)(float*, int);
+    void (*sigmoid_float)(float*, int);
+    void (*affine)(const double*, int, int, const double*, int, double*);
+    void (*affine_float)(const float*, int, int, const float*, int, float*);
+};
+
+int failures = 0;
+
+void check(const char* set, const char* kernel, double value, double expected, double tolerance)
+{
+    double error = std::fabs(value - expected) / std::fabs(expected);
+    if (!(error <= tolerance))
+    {
+        if (failures < 20)
+        {
+            std::cout << set << " " << kernel << ": got " << value << ", expected "
+                      << expected << " (relative error " << error << ")" << std::endl;
+        }
+        ++failures;
+    }
+}
+
+template <typename T>
+void check_affine(const char* set, void (*affine)(const T*, int, int, const T*, int, T*))
+{
+    const int ins = 27;
+    for (int n_events = 1; n_events <= 9; ++n_events)
+    {
+        for (int outs = 1; outs <= 19; ++outs)
+        {
+            std::vector<T> events(n_events * ins), weights((ins + 1) * outs);
+            for (unsigned int i = 0; i < events.size(); ++i)
+            {
+                events[i] = std::sin(1.3 * i + outs);
+            }
+            for (unsigned int i = 0; i < weights.size(); ++i)
+            {
+                weights[i] = std::cos(0.7 * i + n_events);
+            }
+            std::vector<T> a(n_events * outs), b(n_events * outs);
+            affine(&events[0], n_events, ins, &weights[0], outs, &a[0]);
+            JetTagger::affine_scalar(&events[0], n_events, ins, &weights[0], outs, &b[0]);
+            for (unsigned int i = 0; i < a.size(); ++i)
+            {
+                if (a[i] != b[i])
+                {
+                    if (failures < 20)
+                    {
+                        std::cout << set << " affine: got " << a[i] << ", expected "
+                                  << b[i] << " exactly" << std::endl;
+                    }
+                    ++failures;
+                }
+            }
+        }
+    }
+}
+
+void test_set(const KernelSet &set)
+{
+    using namespace JetTagger;
+    // an odd count, so that every kernel also runs its leftover lanes
+    const int n = 100001;
+    std::vector<double> x(n), a(n), b(n);
+    for (int i = 0; i < n; ++i)
+    {
+        x[i] = exp_lo + (exp_hi - exp_lo) * i / (n - 1);
+    }
+
+    a = x;
+    b = x;
+    set.exp(&a[0], n);
+    exp_scalar(&b[0], n);
+    for (int i = 0; i < n; ++i)
+    {
+        check(set.name, "exp", a[i], std::exp(x[i]), 1e-14);
+        check(set.name, "exp vs scalar", a[i], b[i], 1e-14);
+    }
+
+    // sigmoid over the range it does not saturate in
+    for (int i = 0; i < n; ++i)
+    {
+        x[i] = -700 + 1400.0 * i / (n - 1);
+    }
+    a = x;
+    b = x;
+    set.sigmoid(&a[0], n);
+    sigmoid_scalar(&b[0], n);
+    for (int i = 0; i < n; ++i)
+    {
+        check(set.name, "sigmoid", a[i], 1 / (1 + std::exp(-x[i])), 1e-14);
+        check(set.name, "sigmoid vs scalar", a[i], b[i], 1e-14);
+    }
+
+    // inputs beyond the range are clamped to it
+    double clamped[4] = {-1000, -709, 710, 1000};
+    set.exp(clamped, 4);
+    check(set.name, "exp clamp", clamped[0], std::exp(exp_lo), 1e-14);
+    check(set.name, "exp clamp", clamped[1], std::exp(exp_lo), 1e-14);
+    check(set.name, "exp clamp", clamped[2], std::exp(exp_hi), 1e-14);
+    check(set.name, "exp clamp", clamped[3], std::exp(exp_hi), 1e-14);
+
+    const int m = 10001;
+    std::vector<float> y(m), c(m), d(m);
+    for (int i = 0; i < m; ++i)
+    {
+        y[i] = expf_lo + (expf_hi - expf_lo) * i / (m - 1);
+    }
+    c = y;
+    d = y;
+    set.exp_float(&c[0], m);
+    exp_scalar(&d[0], m);
+    for (int i = 0; i < m; ++i)
+    {
+        check(set.name, "float exp", c[i], std::exp((double)y[i]), 1e-6);
+        check(set.name, "float exp vs scalar", c[i], d[i], 1e-6);
+    }
+    for (int i = 0; i < m; ++i)
+    {
+        y[i] = -80 + 160.0f * i / (m - 1);
+    }
+    c = y;
+    d = y;
+    set.sigmoid_float(&c[0], m);
+    sigmoid_scalar(&d[0], m);
+    for (int i = 0; i < m; ++i)
+    {
+        check(set.name, "float sigmoid", c[i], 1 / (1 + std::exp(-(double)y[i])), 1e-6);
+        check(set.name, "float sigmoid vs scalar", c[i], d[i], 1e-6);
+    }
+
+    // softmax, including logits that would overflow a plain exp
+    for (int length = 1; length <= 19; ++length)
+    {
+        std::vector<double> logits(length), probabilities(length);
+        double max = -1e300;
+        for (int i = 0; i < length; ++i)
+        {
+            logits[i] = 40.0 * std::sin(7.0 * i + length) + ((length % 2) ? 1000 : 0);
+            max = std::max(max, logits[i]);
+        }
+        double sum = 0;
+        for (int i = 0; i < length; ++i)
+        {
+            sum += std::exp(logits[i] - max);
+        }
+        probabilities = logits;
+        softmax_kernel(&probabilities[0], length, set.exp);
+        for (int i = 0; i < length; ++i)
+        {
+            check(set.name, "softmax", probabilities[i], std::exp(logits[i] - max) / sum, 1e-13);
+        }
+    }
+
+    check_affine(set.name, set.affine);
+    check_affine(set.name, set.affine_float);
+}
+
+int main()
+{
+    std::vector<KernelSet> sets;
+    KernelSet scalar = {"scalar", JetTagger::exp_scalar, JetTagger::sigmoid_scalar,
+                        JetTagger::exp_scalar, JetTagger::sigmoid_scalar,
+                        JetTagger::affine_scalar, JetTagger::affine_scalar};
+    sets.push_back(scalar);
+#ifdef JETTAGGER_SIMD
+    __builtin_cpu_init();
+    KernelSet sse2 = {"sse2", JetTagger::exp_sse2, JetTagger::sigmoid_sse2,
+                      JetTagger::exp_sse2, JetTagger::sigmoid_sse2,
+                      JetTagger::affine_sse2, JetTagger::affine_sse2};
+    sets.push_back(sse2);
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+    {
+        KernelSet avx2 = {"avx2", JetTagger::exp_avx2, JetTagger::sigmoid_avx2,
+                          JetTagger::exp_avx2, JetTagger::sigmoid_avx2,
+                          JetTagger::affine_avx2, JetTagger::affine_avx2};
+        sets.push_back(avx2);
+    }
+    if (__builtin_cpu_supports("avx512f"))
+    {
+        KernelSet avx512 = {"avx512", JetTagger::exp_avx512, JetTagger::sigmoid_avx512,
+                            JetTagger::exp_avx512, JetTagger::sigmoid_avx512,
+                            JetTagger::affine_avx512, JetTagger::affine_avx512};
+        sets.push_back(avx512);
+    }
+#endif
+    for (unsigned int i = 0; i < sets.size(); ++i)
+    {
+        test_set(sets[i]);
+        std::cout << "checked " << sets[i].name << " kernels" << std::endl;
+    }
+    std::cout << "dispatched to " << JetTagger::activation_kernels() << ", "
+              << failures << " failures" << std::endl;
+    return (failures == 0) ? 0 : 1;
+}
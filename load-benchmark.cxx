@@ -0,0 +1,114 @@
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <sstream>
+#include <fstream>
+#include <cstdlib>
+#include <sys/time.h>
+#include "include/JetTagger.h" // won't need include/ if you copy JetTagger.h to your project directory
+
+// Times loading nets of increasing size from .nnet text and from the
+// binary form. The nets are random, written the way the trainer saves them.
+
+double now()
+{
+    timeval t;
+    gettimeofday(&t, 0);
+    return t.tv_sec + 1e-6 * t.tv_usec;
+}
+
+int write_net(const char* spec_name, const char* net_name, const int* sizes, int n_sizes)
+{
+    std::ofstream spec(spec_name), net(net_name);
+    spec << "input:\n";
+    for (int i = 0; i < sizes[0]; ++i)
+    {
+        spec << "var" << i << ", double\n";
+    }
+    spec << "output:\n";
+    for (int i = 0; i < sizes[n_sizes - 1]; ++i)
+    {
+        spec << "class" << i << ", int\n";
+    }
+
+    int n_weights = 0;
+    net << "#->NNET\n0";
+    for (int l = 0; l < n_sizes; ++l)
+    {
+        net << ", " << sizes[l];
+    }
+    net << "\n0.0002?0.9\n" << std::setprecision(11);
+    for (int l = 0; l + 1 < n_sizes; ++l)
+    {
+        net << "BUNDLE\n";
+        for (int i = 0; i <= sizes[l]; ++i)
+        {
+            for (int j = 0; j < sizes[l + 1]; ++j)
+            {
+                net << (rand() / (RAND_MAX + 1.0) - 0.5) << ((j + 1 < sizes[l + 1]) ? ", " : "\n");
+            }
+        }
+        n_weights += (sizes[l] + 1) * sizes[l + 1];
+    }
+    net << "TRANS\n";
+    for (int k = 0; k < 2; ++k)
+    {
+        for (int i = 0; i < sizes[0]; ++i)
+        {
+            net << (k + rand() / (RAND_MAX + 1.0)) << ((i + 1 < sizes[0]) ? ", " : "\n");
+        }
+    }
+    return n_weights;
+}
+
+int main()
+{
+    const int shapes[][5] = {{27, 30, 21, 11, 3}, {27, 100, 100, 50, 3},
+                             {27, 300, 300, 100, 3}, {27, 1000, 500, 100, 3}};
+    const char* spec_name = "benchmark.specs";
+    const char* net_name = "benchmark.nnet";
+    const char* binary_name = "benchmark.nnb";
+
+    std::cout << std::setw(10) << "weights" << std::setw(14) << "text (ms)"
+              << std::setw(14) << "ns/weight" << std::setw(14) << "binary (ms)" << std::endl;
+    for (unsigned int s = 0; s < sizeof(shapes) / sizeof(shapes[0]); ++s)
+    {
+        int n_weights = write_net(spec_name, net_name, shapes[s], 5);
+        int reps = std::max(3, 2000000 / n_weights);
+
+        double start = now();
+        for (int r = 0; r < reps; ++r)
+        {
+            JetTagger::NeuralNet net;
+            if (!net.load_specifications(spec_name) || !net.load_net(net_name))
+            {
+                return -1;
+            }
+            if (r == 0 && !net.save_binary(binary_name))
+            {
+                return -1;
+            }
+        }
+        double text = (now() - start) / reps;
+
+        start = now();
+        for (int r = 0; r < reps; ++r)
+        {
+            JetTagger::NeuralNet net;
+            if (!net.load_binary(binary_name))
+            {
+                return -1;
+            }
+        }
+        double binary = (now() - start) / reps;
+
+        std::cout << std::setw(10) << n_weights
+                  << std::setw(14) << std::setprecision(3) << text * 1e3
+                  << std::setw(14) << text * 1e9 / n_weights
+                  << std::setw(14) << binary * 1e3 << std::endl;
+    }
+    std::remove(spec_name);
+    std::remove(net_name);
+    std::remove(binary_name);
+    return 0;
+}
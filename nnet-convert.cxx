@@ -0,0 +1,58 @@
+#include <iostream>
+#include <string>
+#include <fstream>
+#include <cstring>
+#include "include/JetTagger.h" // won't need include/ if you copy JetTagger.h to your project directory
+
+// Converts between the text (.nnet + spec file) and binary (.nnb) forms of
+// a net:
+//
+//     nnet-convert <spec file> <in.nnet> <out.nnb> [-float]
+//     nnet-convert <in.nnb> <out.nnet> <out spec file>
+//
+// -float stores single-precision weights, which FloatNeuralNet then uses
+// in place. The direction is taken from the type of the first file.
+
+bool is_binary_model(const char* file_name)
+{
+    std::ifstream file(file_name, std::ios::binary);
+    char magic[sizeof(JetTagger::binary_magic)] = {0};
+    file.read(magic, sizeof(magic));
+    return std::memcmp(magic, JetTagger::binary_magic, sizeof(magic)) == 0;
+}
+
+int main(int argc, char const *argv[])
+{
+    if (argc < 4)
+    {
+        std::cout << "usage: nnet-convert <spec file> <in.nnet> <out.nnb> [-float]\n"
+                  << "       nnet-convert <in.nnb> <out.nnet> <out spec file>" << std::endl;
+        return -1;
+    }
+    JetTagger::NeuralNet net;
+
+    if (is_binary_model(argv[1]))
+    {
+        if (!net.load_binary(argv[1]) ||
+            !net.save_net(argv[2]) ||
+            !net.save_specifications(argv[3]))
+        {
+            return -1;
+        }
+        std::cout << argv[1] << " -> " << argv[2] << ", " << argv[3] << std::endl;
+        return 0;
+    }
+
+    if (!net.load_specifications(argv[1]) || !net.load_net(argv[2]))
+    {
+        return -1;
+    }
+    bool single = (argc > 4) && (std::string(argv[4]) == "-float");
+    if (!net.save_binary(argv[3], single ? sizeof(float) : sizeof(double)))
+    {
+        return -1;
+    }
+    std::cout << argv[1] << ", " << argv[2] << " -> " << argv[3]
+              << (single ? " (float)" : "") << std::endl;
+    return 0;
+}
@@ -4,6 +4,8 @@
 //------------------------------------------------------
 
 #include "Activation.h"
+#include "JetTagger.h"
+#include <algorithm>
 
 
 
@@ -61,6 +63,57 @@ std::vector<double> softmax(std::vector<double> A)
 	return std::move(A);
 }
 
+//----------------------------------------------------------------------------
+//------------------ VECTORIZED IN-PLACE KERNELS -----------------------------
+//----------------------------------------------------------------------------
+/*
+The in-place kernels are those of the thin client, JetTagger.h, so that the 
+trainer and the scoring code share one exp approximation and one dispatch: 
+relative error below 1e-14 against libm exp for x in [-708, 709], with 
+inputs clamped to that range, on the widest of AVX-512F, AVX2+FMA and SSE2 
+the CPU supports. Building with -DJETTAGGER_NO_SIMD leaves only the scalar 
+code, which uses the same approximation.
+*/
+//----------------------------------------------------------------------------
+void sigmoid_inplace(double* A, int n) 
+{
+	JetTagger::sigmoid_inplace(A, n);
+}
+//----------------------------------------------------------------------------
+// Single precision goes through the double kernels a chunk at a time; the 
+// conversions cost little next to the exp.
+void sigmoid_inplace(float* A, int n) 
+{
+	double chunk[256];
+	for (int first = 0; first < n; first += 256) 
+	{
+		const int m = std::min(256, n - first);
+		std::copy(A + first, A + first + m, chunk);
+		JetTagger::sigmoid_inplace(chunk, m);
+		std::copy(chunk, chunk + m, A + first);
+	}
+}
+//----------------------------------------------------------------------------
+void dsigmoid_inplace(double* A, int n) 
+{
+	for (int i = 0; i < n; ++i) 
+	{
+		A[i] = A[i] * (1 - A[i]);
+	}
+}
+//----------------------------------------------------------------------------
+// Fused, numerically stable softmax: the maximum is subtracted before 
+// exponentiating, so the log-sum-exp never overflows.
+void softmax_inplace(double* A, int n) 
+{
+	JetTagger::softmax_inplace(A, n);
+}
+//----------------------------------------------------------------------------
+const char* activation_kernels()
+{
+	return JetTagger::activation_kernels();
+}
+//----------------------------------------------------------------------------
 std::string trim(const std::string& str, const std::string& whitespace)
 {
     const auto strBegin = str.find_first_not_of(whitespace);
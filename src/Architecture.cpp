@@ -4,27 +4,67 @@
 //------------------------------------------------------
 
 #include "Architecture.h"
+#include "Threads.h"
 
 
 //----------------------------------------------------------------------------
 Architecture::Architecture(std::vector<int> structure, 
-	                       std::vector<double> (*sigmoid_function) (std::vector<double>), 
+	                       void (*sigmoid_function) (double*, int), 
 	                       double (*sigmoid_derivative) (double)) : 
                            structure( structure ),  
                            _sigmoid_derivative(sigmoid_derivative), 
                            _sigmoid_function(sigmoid_function), 
                            is_denoising( false )
+{
+	build(true);
+	lambda = 0;
+	setOptimizer(make_optimizer("momentum"));
+}
+//----------------------------------------------------------------------------
+// Clones the weights and training state of A with a single copy of its 
+// arena; the layers are laid out without drawing weights that would only 
+// be overwritten. Autoencoders used for pretraining are not carried over.
+Architecture::Architecture(const Architecture &A) : 
+                           structure( A.structure ), 
+                           _sigmoid_derivative(A._sigmoid_derivative), 
+                           _sigmoid_function(A._sigmoid_function), 
+                           is_denoising( false )
+{
+	build(false);
+	setOptimizer(std::unique_ptr<Optimizer>(A.optimizer->clone()));
+	std::copy(A.arena.begin(), A.arena.end(), arena.begin());
+	for (unsigned int l = 0; l < Bundle.size(); ++l) 
+	{
+		Bundle.at(l)->setMomentum(A.Bundle.at(l)->gamma);
+		Bundle.at(l)->steps = A.Bundle.at(l)->steps.load();
+	}
+	eta = A.eta;
+	lambda = A.lambda;
+}
+//----------------------------------------------------------------------------
+// Lays out the arena and a layer in it for every pair of adjacent sizes in 
+// structure, drawing their weights if initialize.
+void Architecture::build(bool initialize) 
 {
 	layers = structure.size();
 	int l;
 	bool final;
+	std::size_t total = 0;
+	for (l = 0; l < (layers - 1); ++l) 
+	{
+		total += Layer::storage_size(structure.at(l), structure.at(l + 1));
+	}
+	arena.assign(total + arena_padded(structure.front()), 0.0);
+	step_event = arena.data() + total;
+	double *block = arena.data();
 	for (l = 0; l < (layers - 1); ++l) 
 	{
 		final = ((l == (layers - 2)) ? true : false);
-		Bundle.push_back( std::move(std::unique_ptr<Layer>(new Layer(structure.at(l), structure.at(l + 1), final, _sigmoid_function))) );
+		Bundle.push_back( std::move(std::unique_ptr<Layer>(new Layer(structure.at(l), structure.at(l + 1), final, 
+		                                                             _sigmoid_function, block, initialize))) );
+		block += Layer::storage_size(structure.at(l), structure.at(l + 1));
 	}
 	layers = Bundle.size();
-	lambda = 0;
 }
 //----------------------------------------------------------------------------
 Architecture::~Architecture() 
@@ -33,16 +73,35 @@ Architecture::~Architecture()
 }
 
 //----------------------------------------------------------------------------
-std::vector<double> Architecture::test(std::vector<double> Event) 
+std::vector<double> Architecture::test(const std::vector<double> &Event) 
 {
-	Bundle.at(0)->feed((Event));
-	unsigned int l;
-
-	for (l = 1; l < (Bundle.size()); ++l)
+	test(Event.data());
+	return Bundle.back()->fire();
+}
+//----------------------------------------------------------------------------
+// Forward pass through the layers' own buffers; the returned outputs of the 
+// last layer stay valid until the next pass.
+const double* Architecture::test(const double *event) 
+{
+	Bundle.at(0)->feed(event);
+	for (unsigned int l = 1; l < (Bundle.size()); ++l)
 	{
-		Bundle.at(l)->feed((Bundle.at(l - 1)->Outs));
+		Bundle[l]->feed(Bundle[l - 1]->Outs);
 	}
-	return std::move(Bundle.at(l - 1)->fire());
+	return Bundle.back()->Outs;
+}
+//----------------------------------------------------------------------------
+// Buffers for a training step that needs no allocation: the event, 
+// normalized, goes in event_workspace() and its error in error_workspace(), 
+// which is the last layer's Delta, before calling test() and backpropagate().
+double* Architecture::event_workspace() 
+{
+	return step_event;
+}
+//----------------------------------------------------------------------------
+double* Architecture::error_workspace() 
+{
+	return Bundle.back()->Delta;
 }
 
 //----------------------------------------------------------------------------
@@ -60,6 +119,27 @@ void Architecture::setMomentum(double x)
 	}
 }
 
+//----------------------------------------------------------------------------
+// Hands every layer (and autoencoder) the new update rule. Switching to a 
+// different kind of optimizer clears the state left by the old one.
+void Architecture::setOptimizer(std::unique_ptr<Optimizer> optimizer) 
+{
+	bool same = this->optimizer && (this->optimizer->name() == optimizer->name());
+	this->optimizer = std::move(optimizer);
+	for (auto &layer : Bundle) 
+	{
+		layer->setOptimizer(this->optimizer.get());
+		if (!same) 
+		{
+			layer->resetOptimizer();
+		}
+	}
+}
+//----------------------------------------------------------------------------
+const Optimizer& Architecture::getOptimizer() const
+{
+	return *optimizer;
+}
 //----------------------------------------------------------------------------
 void Architecture::anneal(double x) 
 {
@@ -71,51 +151,203 @@ void Architecture::anneal(double x)
 
 //----------------------------------------------------------------------------
 void Architecture::backpropagate(
-	std::vector<double> error,  /* needs to be (estimated - actual) */
-	std::vector<double> Event,
+	const std::vector<double> &error,  /* needs to be (estimated - actual) */
+	const std::vector<double> &Event,
+	double weight ) 
+{
+	backpropagate(error.data(), Event.data(), weight);
+}
+//----------------------------------------------------------------------------
+void Architecture::backpropagate(
+	const double *error,  /* needs to be (estimated - actual) */
+	const double *event,
 	double weight ) 
 {
-	Bundle.at(layers - 1)->setDelta( error ); 
-	double val;
+	Layer &top = *Bundle.back();
+	if (error != top.Delta)
+	{
+		std::copy(error, error + top.outs, top.Delta);
+	}
 
 	for (int l = layers - 1; l > 0; l--) 
 	{ //for each layer in the neural net
-		for (int i = 0; i < structure.at(l); ++i) 
+		const Layer &layer = *Bundle[l];
+		Layer &below = *Bundle[l - 1];
+		for (int i = 0; i < layer.ins; ++i) 
 		{ // Delta = DSIG * Synapse * prev_Delta
-			val = 0;
-			for (int j = 0; j < structure.at(l + 1); ++j) 
+			const double *row = layer.Synapse + i * layer.outs;
+			double val = 0;
+			for (int j = 0; j < layer.outs; ++j) 
 			{
-				val += _sigmoid_derivative(Bundle.at(l - 1)->Outs.at(i)) * (Bundle.at(l)->Synapse.at(i).at(j)) * (Bundle.at(l)->Delta.at(j));
+				val += row[j] * layer.Delta[j];
 			}
-			Bundle.at(l - 1)->Delta.at(i) = val;
+			below.Delta[i] = _sigmoid_derivative(below.Outs[i]) * val;
 		}
 	}
 
-	for (int l = layers - 1; l > 0; l--) 
+	for (int l = layers - 1; l >= 0; l--) 
 	{ //for each layer in the neural net
-		for (int i = 0; i < structure.at(l + 1); ++i) 
+		Layer &layer = *Bundle[l];
+		const double *in = (l > 0) ? Bundle[l - 1]->Outs : event;
+		layer.accumulate_gradient(in, layer.Delta, &weight, 1, layer.Gradient);
+	}
+	for (auto &layer : Bundle) 
+	{
+		layer->descend(layer->Gradient, eta, lambda * weight);
+	}
+}
+//----------------------------------------------------------------------------
+// Sizes a workspace for batches of up to n_events; it only allocates when 
+// the batch is larger than any it has seen.
+template <typename T>
+void Architecture::reserve_batch(BasicBatchWorkspace<T> &batch, int n_events) const
+{
+	batch.outs.resize(Bundle.size());
+	batch.deltas.resize(Bundle.size());
+	batch.gradients.resize(Bundle.size());
+	for (unsigned int l = 0; l < Bundle.size(); ++l) 
+	{
+		const Layer &layer = *Bundle[l];
+		if (batch.outs[l].size() < (std::size_t)(n_events * layer.outs)) 
 		{
-	    	int j;
-	    	for (j = 0; j <  structure.at(l); j++) //not plus one because of bias 	
-	    	{
-	    		Bundle.at(l)->set(j, i, weight * (-eta * Bundle.at(l)->Delta.at(i) * Bundle.at(l - 1)->Outs.at(j) - lambda * Bundle.at(l)->Synapse.at(j).at(i)));
-	    	}
-	    	Bundle.at(l)->set(j, i, -eta * weight * Bundle.at(l)->Delta.at(i));
-	    }
-	}
-    for (int i = 0; i < Bundle.at(0)->outs; ++i) 
-    {
-    	int j;
-    	//not plus one because of bias 
-    	for (j = 0; j < Bundle.at(0)->ins; j++)
-    	{
-    		Bundle.at(0)->set(j, i, weight * (-eta * Bundle.at(0)->Delta.at(i) * Event.at(j) - lambda * Bundle.at(0)->Synapse.at(j).at(i)));
-    	}
-    	Bundle.at(0)->set(j, i, -eta * weight * (Bundle.at(0)->Delta.at(i)));
-    }
-    for (auto &layer : Bundle) 
-    {
-		layer->drop();
+			batch.outs[l].resize(n_events * layer.outs);
+			batch.deltas[l].resize(n_events * layer.outs);
+		}
+		batch.gradients[l].resize((layer.ins + 1) * layer.outs);
+	}
+}
+//----------------------------------------------------------------------------
+// Forward pass over a row-major (n_events x ins) block of normalized events. 
+// Returns the (n_events x outs) outputs of the last layer, before softmax, 
+// which live in the workspace until its next batch.
+template <typename T>
+const T* Architecture::test_batch(const T *events, int n_events, 
+                                  BasicBatchWorkspace<T> &batch) const
+{
+	reserve_batch(batch, n_events);
+	const T *in = events;
+	for (unsigned int l = 0; l < Bundle.size(); ++l) 
+	{
+		Bundle[l]->feed_batch(in, n_events, batch.outs[l].data());
+		in = batch.outs[l].data();
+	}
+	return in;
+}
+//----------------------------------------------------------------------------
+// Mini-batch counterpart of backpropagate(), following a test_batch() on 
+// the same events and workspace. errors holds (estimated - actual) per 
+// event; the weighted gradients of all events are summed into the 
+// workspace, leaving the weights untouched until descend().
+template <typename T>
+void Architecture::gradient_batch(const double *errors, const T *events, 
+                                  const double *weights, int n_events, 
+                                  BasicBatchWorkspace<T> &batch) const
+{
+	std::copy(errors, errors + n_events * Bundle.back()->outs, batch.deltas.back().begin());
+
+	for (int l = layers - 1; l > 0; l--) 
+	{ // Delta = DSIG * Synapse * prev_Delta, for every event
+		const Layer &layer = *Bundle[l];
+		const T *W = layer.weights<T>();
+		const T *outs = batch.outs[l - 1].data();
+		for (int n = 0; n < n_events; ++n) 
+		{
+			const T *delta = batch.deltas[l].data() + n * layer.outs;
+			T *below = batch.deltas[l - 1].data() + n * layer.ins;
+			for (int i = 0; i < layer.ins; ++i) 
+			{
+				const T *row = W + i * layer.outs;
+				T val = 0;
+				for (int j = 0; j < layer.outs; ++j) 
+				{
+					val += row[j] * delta[j];
+				}
+				below[i] = _sigmoid_derivative(outs[n * layer.ins + i]) * val;
+			}
+		}
+	}
+
+	batch.weight_sum = 0;
+	for (int n = 0; n < n_events; ++n) 
+	{
+		batch.weight_sum += weights[n];
+	}
+	for (int l = layers - 1; l >= 0; l--) 
+	{
+		const T *in = (l > 0) ? batch.outs[l - 1].data() : events;
+		Bundle[l]->accumulate_gradient(in, batch.deltas[l].data(), weights, n_events, 
+		                               batch.gradients[l].data());
+	}
+}
+//----------------------------------------------------------------------------
+// Adds the gradients of another workspace of the same shape into batch.
+template <typename T>
+void Architecture::reduce_batch(BasicBatchWorkspace<T> &batch, const BasicBatchWorkspace<T> &other) const
+{
+	for (unsigned int l = 0; l < batch.gradients.size(); ++l) 
+	{
+		double *gradient = batch.gradients[l].data();
+		const double *add = other.gradients[l].data();
+		for (std::size_t k = 0; k < batch.gradients[l].size(); ++k) 
+		{
+			gradient[k] += add[k];
+		}
+	}
+	batch.weight_sum += other.weight_sum;
+}
+//----------------------------------------------------------------------------
+// One momentum update per layer from a workspace's summed gradients, so 
+// the learning rate keeps its per-event meaning.
+template <typename T>
+void Architecture::descend(const BasicBatchWorkspace<T> &batch)
+{
+	for (unsigned int l = 0; l < Bundle.size(); ++l) 
+	{
+		Bundle[l]->descend(batch.gradients[l].data(), eta, lambda * batch.weight_sum);
+	}
+	if (!float_weights.empty()) 
+	{
+		sync_float();
+	}
+}
+template void Architecture::reserve_batch(BatchWorkspace&, int) const;
+template void Architecture::reserve_batch(FloatBatchWorkspace&, int) const;
+template const double* Architecture::test_batch(const double*, int, BatchWorkspace&) const;
+template const float* Architecture::test_batch(const float*, int, FloatBatchWorkspace&) const;
+template void Architecture::gradient_batch(const double*, const double*, const double*, 
+                                           int, BatchWorkspace&) const;
+template void Architecture::gradient_batch(const double*, const float*, const double*, 
+                                           int, FloatBatchWorkspace&) const;
+template void Architecture::reduce_batch(BatchWorkspace&, const BatchWorkspace&) const;
+template void Architecture::reduce_batch(FloatBatchWorkspace&, const FloatBatchWorkspace&) const;
+template void Architecture::descend(const BatchWorkspace&);
+template void Architecture::descend(const FloatBatchWorkspace&);
+//----------------------------------------------------------------------------
+// Gives every layer a single-precision copy of its weights, for float 
+// batches to run on. The double weights stay the master copy the optimizer 
+// updates; descend() rounds them into the copy after every step.
+void Architecture::use_float()
+{
+	std::size_t total = 0;
+	for (auto &layer : Bundle) 
+	{
+		total += arena_padded((layer->ins + 1) * layer->outs);
+	}
+	float_weights.assign(total, 0.0f);
+	float *block = float_weights.data();
+	for (auto &layer : Bundle) 
+	{
+		layer->SynapseF = block;
+		block += arena_padded((layer->ins + 1) * layer->outs);
+	}
+	sync_float();
+}
+//----------------------------------------------------------------------------
+void Architecture::sync_float()
+{
+	for (auto &layer : Bundle) 
+	{
+		std::copy(layer->Synapse, layer->Synapse + (layer->ins + 1) * layer->outs, layer->SynapseF);
 	}
 }
 //----------------------------------------------------------------------------
@@ -128,9 +360,16 @@ void Architecture::make_denoising()
 	is_denoising = true;
 }
 //----------------------------------------------------------------------------
-void Architecture::encode(std::vector<std::vector<double>> input, double learning, std::vector<double> weight, bool verbose, int epochs)
+// Greedy layer-wise pretraining over a row-major (n_events x ins) block of 
+// normalized events. Each layer trains its autoencoder for some epochs on 
+// the codes of the layer below, which are computed once per layer and kept, 
+// rather than re-fed from the events every epoch. Epochs run in mini-batches 
+// of batch_size per thread, and every step applies the summed gradient of 
+// all threads, in thread order.
+void Architecture::encode(const double *events, const double *weights, int n_events, 
+                          double learning, bool verbose, int epochs, 
+                          int batch_size, int n_threads)
 {
-
 	if (verbose)
 	{
 		std::cout << "\nTraining stacked Denoising auto-encoders:\n";
@@ -139,52 +378,65 @@ void Architecture::encode(std::vector<std::vector<double>> input, double learnin
 	{
 		make_denoising();
 	}
-	double pct;
-	unsigned int idx = 0, ctr = 0, total_passes = (input.size() * layers * epochs);
-	for(int epoch = 0; epoch < epochs; ++epoch)
-	{
-		idx = 0;
-		for (auto jet : input) // The first layer needs to be done by itself.
-		{	
-			Bundle.at(0)->encode(jet, learning, weight.at(idx)); 
-			++idx;
-			++ctr;	
-		}
-		if (verbose)
-        {
-            pct = (((double)(ctr)) / ((double) (total_passes))) * 100;
-            progress_bar(pct);
-
-        }
-	}
-	for (int l = 1; l < layers; ++l) // now, for each of the following layers...
+	const int share = (n_events + n_threads - 1) / n_threads;
+	const int steps = (share + batch_size - 1) / batch_size;
+	std::vector<BatchWorkspace> shards(n_threads);
+	std::vector<double> codes, next;
+	const double *in = events;
+	for (int l = 0; l < layers; ++l) 
 	{
-		for(int epoch = 0; epoch < epochs; ++epoch)
+		Layer &layer = *Bundle[l];
+		for (int epoch = 0; epoch < epochs; ++epoch) 
 		{
-			idx = 0;
-			for (auto jet : input) // ...we consider each jet
+			Barrier barrier(n_threads);
+			run_threads(n_threads, [&](int t)
 			{
-				Bundle.at(0)->feed(jet);
-				for (int k = 1; k < l; ++k) // feed the tuned input up....
+				const int begin = std::min(t * share, n_events), end = std::min((t + 1) * share, n_events);
+				for (int step = 0; step < steps; ++step) 
 				{
-					Bundle.at(k)->feed((Bundle.at(k - 1)->Outs));
+					const int first = std::min(begin + step * batch_size, end);
+					const int n = std::min(first + batch_size, end) - first;
+					layer.encode_gradient(in + first * layer.ins, weights + first, n, shards[t]);
+					barrier.wait();
+					if (t == 0) 
+					{
+						for (int u = 1; u < n_threads; ++u) 
+						{
+							reduce_batch(shards[0], shards[u]);
+						}
+						layer.encode_descend(shards[0], learning);
+					}
+					barrier.wait();
 				}
-				Bundle.at(l)->encode(Bundle.at(l - 1)->Outs, learning, weight.at(idx)); // and encode the layer in question.
-				++idx;
-				++ctr;
-				if (verbose)
-		        {
-		            pct = (((double)(ctr)) / ((double) (total_passes))) * 100;
-		            progress_bar(pct);
-		        }
+			});
+			if (verbose)
+			{
+				progress_bar((((double)(l * epochs + epoch + 1)) / ((double) (layers * epochs))) * 100);
 			}
 		}
+		if (l + 1 < layers) 
+		{ // the codes of this layer are the inputs of the next
+			next.resize((std::size_t)n_events * layer.outs);
+			run_threads(n_threads, [&](int t)
+			{
+				const int begin = std::min(t * share, n_events), end = std::min((t + 1) * share, n_events);
+				layer.feed_batch(in + begin * layer.ins, end - begin, next.data() + begin * layer.outs);
+			});
+			codes.swap(next);
+			in = codes.data();
+		}
 	}
 }
 //----------------------------------------------------------------------------
 std::vector<std::vector<double>> Architecture::get_first_layer()
 {
-	return Bundle.at(0)->Synapse;
+	const Layer &first = *Bundle.at(0);
+	std::vector<std::vector<double>> rows;
+	for (int i = 0; i <= first.ins; ++i)
+	{
+		rows.emplace_back(first.Synapse + i * first.outs, first.Synapse + (i + 1) * first.outs);
+	}
+	return rows;
 }
 
 
@@ -1,7 +1,9 @@
 #include "Dataset.h"
 #include "Activation.h"
+#include "Pipeline.h"
 #include <stdexcept>
 #include <cmath>
+#include <algorithm>
 
 struct Numeric;
 struct Reweighting;
@@ -27,6 +29,7 @@ Dataset::Dataset(std::string root_file, std::string tree_name) : fail( false )
 		m_input.reserve(0);
 		m_output.reserve(0);
 		n_entries = tree->GetEntries();
+		tree->SetBranchStatus("*", 0);
 		set_pT_bins();
 		set_eta_bins();
 	}
@@ -56,126 +59,133 @@ std::vector<std::string> Dataset::get_input_vars()
 	return input_vars;
 }
 //----------------------------------------------------------------------------
-//----------------------------------------------------------------------------
-bool Dataset::set_input_branch(std::string name, std::string type)
+// Registers a variable of the given type and gives it a column, binding it 
+// to its branch unless it is computed here (the categories). The columns 
+// the reweighting needs are looked up again, so everything per-entry reads 
+// is resolved by the time the spec is loaded.
+bool Dataset::add_variable(const std::string &name, const std::string &type, bool has_branch)
 {
-	variables.insert(std::pair<std::string, std::unique_ptr<Numeric>>(name, std::move(std::unique_ptr<Numeric>(new Numeric))));
+	Column column;
 	if (type == "double")
 	{
-		tree->SetBranchAddress(name.c_str(), &variables[name]->double_);
-		variables[name]->isDbl = true;
-		input_vars.push_back(name);
-		m_input.resize(input_vars.size());
-		return 1;
+		column.type = Column::Double;
 	}
 	else if (type == "float")
 	{
-		tree->SetBranchAddress(name.c_str(), &variables[name]->float_);
-		variables[name]->isFlt = true;
-		input_vars.push_back(name);
-		m_input.resize(input_vars.size());
-		return 1;
+		column.type = Column::Float;
 	}
 	else if (type == "int")
 	{
-		if ((name != "cat_eta") && (name != "cat_pT"))
-		{
-			tree->SetBranchAddress(name.c_str(), &variables[name]->int_);
-			variables[name]->isInt = true;
-			input_vars.push_back(name);
-			m_input.resize(input_vars.size());
-			return 1;
-		}
-		else
-		{
-			variables[name]->isInt = true;
-			input_vars.push_back(name);
-			m_input.resize(input_vars.size());
-			return 1;
-		}
+		column.type = Column::Int;
 	}
 	else
 	{
 		std::cout << "Error: type \"" << type << "\" not recognized." << std::endl;
-		variables.erase(name);
 		return 0;
 	}
-}
-//----------------------------------------------------------------------------
-bool Dataset::set_output_branch(std::string name, std::string type)
-{
-	variables.insert(std::pair<std::string, std::unique_ptr<Numeric>>(name, std::move(std::unique_ptr<Numeric>(new Numeric))));
-	if (type == "double")
+	auto inserted = variables.insert(std::pair<std::string, std::unique_ptr<Numeric>>(name, std::unique_ptr<Numeric>(new Numeric)));
+	Numeric &number = *inserted.first->second;
+	if (has_branch && inserted.second)
 	{
-		tree->SetBranchAddress(name.c_str(), &variables[name]->double_);
-		variables[name]->isDbl = true;
-		output_vars.push_back(name);
-		m_output.resize(output_vars.size());
-		return 1;
+		tree->SetBranchStatus(name.c_str(), 1);
+		active.push_back(name);
 	}
-	else if (type == "float")
+	switch (column.type)
 	{
-		tree->SetBranchAddress(name.c_str(), &variables[name]->float_);
-		variables[name]->isFlt = true;
-		output_vars.push_back(name);
-		m_output.resize(output_vars.size());
-		return 1;
+		case Column::Double:
+			number.isDbl = true;
+			column.value = &number.double_;
+			if (has_branch)
+			{
+				tree->SetBranchAddress(name.c_str(), &number.double_);
+			}
+			break;
+		case Column::Float:
+			number.isFlt = true;
+			column.value = &number.float_;
+			if (has_branch)
+			{
+				tree->SetBranchAddress(name.c_str(), &number.float_);
+			}
+			break;
+		case Column::Int:
+			number.isInt = true;
+			column.value = &number.int_;
+			if (has_branch)
+			{
+				tree->SetBranchAddress(name.c_str(), &number.int_);
+			}
+			break;
 	}
-	else if (type == "int")
+	if (inserted.second)
 	{
-		tree->SetBranchAddress(name.c_str(), &variables[name]->int_);
-		variables[name]->isInt = true;
-		output_vars.push_back(name);
-		m_output.resize(output_vars.size());
-		return 1;
+		column_index[name] = columns.size();
+		columns.push_back(column);
 	}
 	else
 	{
-		std::cout << "Error: type \"" << type << "\" not recognized." << std::endl;
-		return 0;
+		columns[column_index[name]] = column;
 	}
+	bind_columns();
+	return 1;
 }
-
 //----------------------------------------------------------------------------
-bool Dataset::set_control_branch(std::string name, std::string type)
+void Dataset::bind_columns()
 {
-	variables.insert(std::pair<std::string, std::unique_ptr<Numeric>>(name, std::move(std::unique_ptr<Numeric>(new Numeric))));
-	if (type == "double")
+	auto find = [this](const char *name) -> const Column*
+	{
+		int c = column(name);
+		return (c < 0) ? nullptr : &columns[c];
+	};
+	eta_column = find("eta");
+	pt_column = find("pt");
+	light_column = find("light");
+	charm_column = find("charm");
+	bottom_column = find("bottom");
+	flavor_column = find("flavor_truth_label");
+	cat_eta = variables.count("cat_eta") ? &variables["cat_eta"]->int_ : nullptr;
+	cat_pT = variables.count("cat_pT") ? &variables["cat_pT"]->int_ : nullptr;
+}
+//----------------------------------------------------------------------------
+int Dataset::column(const std::string &name) const
+{
+	auto found = column_index.find(name);
+	return (found == column_index.end()) ? -1 : found->second;
+}
+//----------------------------------------------------------------------------
+bool Dataset::set_input_branch(std::string name, std::string type)
+{
+	if (!add_variable(name, type, (name != "cat_eta") && (name != "cat_pT")))
 	{
-		tree->SetBranchAddress(name.c_str(), &variables[name]->double_);
-		variables[name]->isDbl = true;
-		control_vars.push_back(name);
-		return 1;
+		return 0;
 	}
-	else if (type == "float")
+	input_table.add(input_vars.size(), columns[column(name)]);
+	input_vars.push_back(name);
+	m_input.resize(input_vars.size());
+	return 1;
+}
+//----------------------------------------------------------------------------
+bool Dataset::set_output_branch(std::string name, std::string type)
+{
+	if (!add_variable(name, type, true))
 	{
-		tree->SetBranchAddress(name.c_str(), &variables[name]->float_);
-		variables[name]->isFlt = true;
-		control_vars.push_back(name);
-		return 1;
+		return 0;
 	}
-	else if (type == "int")
-	{
-		if ((name != "cat_eta") && (name != "cat_pT"))
-		{
-			tree->SetBranchAddress(name.c_str(), &variables[name]->int_);
-			variables[name]->isInt = true;
-			control_vars.push_back(name);
-			return 1;			
-		}
-		else
-		{
-			variables[name]->isInt = true;
-			control_vars.push_back(name);
-			return 1;
-		}
+	output_table.add(output_vars.size(), columns[column(name)]);
+	output_vars.push_back(name);
+	m_output.resize(output_vars.size());
+	return 1;
+}
 
-	}
-	else
+//----------------------------------------------------------------------------
+bool Dataset::set_control_branch(std::string name, std::string type)
+{
+	if (!add_variable(name, type, (name != "cat_eta") && (name != "cat_pT")))
 	{
-		std::cout << "Error: type \"" << type << "\" not recognized." << std::endl;
 		return 0;
 	}
+	control_vars.push_back(name);
+	return 1;
 }
 
 //----------------------------------------------------------------------------
@@ -185,7 +195,7 @@ std::map<std::string, double> Dataset::get_performance_map(std::vector<std::stri
 	std::map<std::string, double> temp;
 	for (auto &name : variable_names)
 	{
-		temp[name] = cast_as_double(*(variables[name]));
+		temp[name] = get_value(name);
 	}
 	return std::move(temp);
 }
@@ -195,85 +205,229 @@ std::map<std::string, double> Dataset::get_performance_map(std::vector<std::stri
 
 void Dataset::operator[]( const int index )
 {
-	tree->GetEntry(index);
-	try {
-		variables["cat_eta"]->int_ = get_cat_eta(variables["eta"]->double_);
-	}
-	catch (const std::out_of_range& oor) {}
-	try {
-		variables["cat_pT"]->int_ = get_cat_eta(variables["pT"]->double_);
-	}
-	catch (const std::out_of_range& oor) {}
+	at(index);
 }
 
 void Dataset::at( const int index )
 {
 	tree->GetEntry(index);
-	try 
+	++n_loaded;
+	set_categories();
+}
+//----------------------------------------------------------------------------
+void Dataset::set_categories()
+{
+	if (cat_eta && eta_column)
 	{
-		variables["cat_eta"]->int_ = get_cat_eta(variables["eta"]->double_);
+		*cat_eta = get_cat_eta(eta_column->get());
 	}
-	catch (const std::out_of_range& oor){}
-	try 
+	if (cat_pT && pt_column)
 	{
-		variables["cat_pT"]->int_ = get_cat_pt(variables["pt"]->double_);
+		*cat_pT = get_cat_pt(pt_column->get());
 	}
-	catch (const std::out_of_range& oor){}
 }
 //----------------------------------------------------------------------------
-
-double Dataset::get_value(std::string name)
+// Parses one cut, "[abs(]name[)] op number", against the columns set.
+static bool parse_cut(const std::string &text, const std::map<std::string, int> &column_index, Cut &cut)
 {
-	return cast_as_double(*(variables[name]));
+	static const char *ops[] = {"<=", ">=", "==", "!=", "<", ">"};
+	static const Cut::Op codes[] = {Cut::LessEqual, Cut::GreaterEqual, Cut::Equal, 
+	                                Cut::NotEqual, Cut::Less, Cut::Greater};
+	std::size_t at = std::string::npos, length = 0;
+	for (int k = 0; (k < 6) && (at == std::string::npos); ++k)
+	{
+		at = text.find(ops[k]);
+		length = std::string(ops[k]).size();
+		cut.op = codes[k];
+	}
+	if (at == std::string::npos)
+	{
+		std::cout << "Error: selection cut \"" << text << "\" has no comparison." << std::endl;
+		return 0;
+	}
+	std::string name = trim(text.substr(0, at)), number = trim(text.substr(at + length));
+	cut.absolute = false;
+	for (const std::string prefix : {"abs(", "fabs("})
+	{
+		if ((name.compare(0, prefix.size(), prefix) == 0) && (name.back() == ')'))
+		{
+			name = trim(name.substr(prefix.size(), name.size() - prefix.size() - 1));
+			cut.absolute = true;
+		}
+	}
+	auto found = column_index.find(name);
+	if (found == column_index.end())
+	{
+		std::cout << "Error: selection variable \"" << name << "\" is not in the specification." << std::endl;
+		return 0;
+	}
+	cut.column = found->second;
+	try
+	{
+		std::size_t used;
+		cut.value = std::stod(number, &used);
+		if (trim(number.substr(used)) != "")
+		{
+			throw std::invalid_argument(number);
+		}
+	}
+	catch (const std::exception &)
+	{
+		std::cout << "Error: selection cut \"" << text << "\" does not compare with a number." << std::endl;
+		return 0;
+	}
+	return 1;
 }
 //----------------------------------------------------------------------------
-std::vector<double> &Dataset::input()
+bool Dataset::set_selection(const std::string &text)
 {
-	unsigned int ptr = 0;
-
-	for (auto name : input_vars)
+	std::string list(text);
+	for (std::size_t at = list.find("&&"); at != std::string::npos; at = list.find("&&"))
 	{
-		m_input[ptr] = cast_as_double(*(variables[name]));
-		++ptr;
+		list.replace(at, 2, ",");
 	}
+	std::vector<Cut> parsed;
+	std::istringstream fields(list);
+	std::string field;
+	while (std::getline(fields, field, ','))
+	{
+		if (trim(field) == "")
+		{
+			continue;
+		}
+		Cut cut;
+		if (!parse_cut(trim(field), column_index, cut))
+		{
+			return 0;
+		}
+		parsed.push_back(cut);
+	}
+	cuts.swap(parsed);
 
-	return m_input;
+	// the categories are computed from eta and pt
+	std::vector<std::string> needed;
+	for (auto &cut : cuts)
+	{
+		for (auto &entry : column_index)
+		{
+			if (entry.second == cut.column)
+			{
+				needed.push_back((entry.first == "cat_eta") ? "eta" : 
+				                 (entry.first == "cat_pT") ? "pt" : entry.first);
+			}
+		}
+	}
+	selection_branches.clear();
+	other_branches.clear();
+	for (auto &name : active)
+	{
+		TBranch *branch = tree->GetBranch(name.c_str());
+		if (branch)
+		{
+			bool first = std::find(needed.begin(), needed.end(), name) != needed.end();
+			(first ? selection_branches : other_branches).push_back(branch);
+		}
+	}
+	return 1;
 }
 //----------------------------------------------------------------------------
-std::vector<double> &Dataset::output()
+bool Dataset::at_selected( const long index )
 {
-	unsigned int ptr = 0;
-	for (auto name : output_vars)
+	const long long local = tree->LoadTree(index);
+	++n_loaded;
+	for (auto branch : selection_branches)
+	{
+		branch->GetEntry(local);
+	}
+	set_categories();
+	for (auto &cut : cuts)
 	{
-		m_output[ptr] = cast_as_double(*(variables[name]));
-		++ptr;
+		if (!cut.passes(columns[cut.column].get()))
+		{
+			return false;
+		}
 	}
+	for (auto branch : other_branches)
+	{
+		branch->GetEntry(local);
+	}
+	set_categories();
+	return true;
+}
+//----------------------------------------------------------------------------
+// Throws std::out_of_range for a variable not set.
+double Dataset::get_value(std::string name)
+{
+	return columns.at(column(name)).get();
+}
+//----------------------------------------------------------------------------
+std::vector<double> &Dataset::input()
+{
+	input_table.read(m_input.data());
+	return m_input;
+}
+//----------------------------------------------------------------------------
+std::vector<double> &Dataset::output()
+{
+	output_table.read(m_output.data());
 	return m_output;
 }
 //----------------------------------------------------------------------------
 double Dataset::get_physics_reweighting()
 {
-	if (cast_as_int(*(variables["light"])) == 1)
+	if (light_column->get_int() == 1)
     {
         return 1.0;
     }
-    else if (cast_as_int(*(variables["bottom"])) == 1)
+    else if (bottom_column->get_int() == 1)
     {
-        return reweighting.bottom_correction[cast_as_int(*(variables["cat_pT"]))][cast_as_int(*(variables["cat_eta"]))];
+        return reweighting.bottom_correction[*cat_pT][*cat_eta];
     }
     else
     {
-        return reweighting.charm_correction[cast_as_int(*(variables["cat_pT"]))][cast_as_int(*(variables["cat_eta"]))];
+        return reweighting.charm_correction[*cat_pT][*cat_eta];
     }
 }
 //----------------------------------------------------------------------------
+void Dataset::prepare_cache(long long bytes)
+{
+	tree->SetCacheSize(bytes);
+	for (auto &name : active)
+	{
+		tree->AddBranchToCache(name.c_str(), true);
+	}
+	tree->StopCacheLearningPhase();
+}
+//----------------------------------------------------------------------------
+void Dataset::enable_parallel_unzip(int n_threads)
+{
+	ROOT::EnableImplicitMT(n_threads);
+}
+//----------------------------------------------------------------------------
+double Dataset::bytes_per_entry() const
+{
+	return (n_loaded > 0) ? (double)file->GetBytesRead() / n_loaded : 0;
+}
+//----------------------------------------------------------------------------
 unsigned int Dataset::num_entries()
 {
 	return n_entries;
 }
 //----------------------------------------------------------------------------
-void Dataset::determine_reweighting(bool cdf, bool relative) //this stuff is pretty specific for b/c/u training
+// Fills the corrections get_physics_reweighting() reads, from the flavour 
+// labels and the pT and eta categories of the spec.
+// \return Returns false, naming it, if the spec lacks one of those branches.
+bool Dataset::determine_reweighting(bool cdf, bool relative) //this stuff is pretty specific for b/c/u training
 {
+	const char *missing = !light_column ? "light" : !charm_column ? "charm" : 
+	                      !bottom_column ? "bottom" : !cat_pT ? "cat_pT" : 
+	                      !cat_eta ? "cat_eta" : nullptr;
+	if (missing)
+	{
+		std::cout << "Error: reweighting needs the branch \"" << missing 
+		          << "\", which is not in the specification." << std::endl;
+		return false;
+	}
 	int n_estimate = n_entries / 10;
 	std::vector<std::vector<double> > charm_correction, light_correction, bottom_correction, charm_hist, bottom_hist, light_hist;
 	charm_correction.resize(m_num_pt_bins);
@@ -302,26 +456,46 @@ void Dataset::determine_reweighting(bool cdf, bool relative) //this stuff is pre
 			bottom_hist[cat_pT][cat_eta] = 0;
 		}
 	}
-	for (int i = 0; i < n_estimate; ++i)
+	// what the histograms need of a jet, read ahead on the pipeline's threads
+	struct Jet
 	{
-		at(i);
-		if ((fabs(get_value("eta")) < 2.5) && (get_value("pt") > 20) && (get_value("flavor_truth_label") < 8) && (get_value("pt") < 1000))
+		bool selected;
+		int light, charm, bottom, cat_pT, cat_eta;
+	};
+	Pipeline<Jet> loader;
+	loader.run(0, n_estimate, 
+		[&](long i, Jet &jet) 
+	{
+		if (!(jet.selected = at_selected(i)))
 		{
-			if (cast_as_int(*variables["light"]) == 1)
-			{
-				light_hist[cast_as_int(*(variables["cat_pT"]))][cast_as_int(*(variables["cat_eta"]))] += 1;
-			}
-			else if (cast_as_int(*variables["charm"]) == 1)
-			{
-				charm_hist[cast_as_int(*(variables["cat_pT"]))][cast_as_int(*(variables["cat_eta"]))] += 1;
-			}
-			else if (cast_as_int(*variables["bottom"]) == 1)
-			{
-				bottom_hist[cast_as_int(*(variables["cat_pT"]))][cast_as_int(*(variables["cat_eta"]))] += 1;
-			}
+			return;
 		}
-
-	}
+		jet.light = light_column->get_int();
+		jet.charm = charm_column->get_int();
+		jet.bottom = bottom_column->get_int();
+		jet.cat_pT = *cat_pT;
+		jet.cat_eta = *cat_eta;
+	},
+		[&](Jet &jet) 
+	{
+		return jet.selected;
+	},
+		[&](Jet &jet) 
+	{
+		if (jet.light == 1)
+		{
+			light_hist[jet.cat_pT][jet.cat_eta] += 1;
+		}
+		else if (jet.charm == 1)
+		{
+			charm_hist[jet.cat_pT][jet.cat_eta] += 1;
+		}
+		else if (jet.bottom == 1)
+		{
+			bottom_hist[jet.cat_pT][jet.cat_eta] += 1;
+		}
+		return true;
+	});
 	if (cdf)
 	{
 		for (int cat_pT = 0; cat_pT < m_num_pt_bins; ++cat_pT)
@@ -399,6 +573,40 @@ void Dataset::determine_reweighting(bool cdf, bool relative) //this stuff is pre
 	
 	reweighting.charm_correction = charm_correction;
 	reweighting.bottom_correction = bottom_correction;
+	return true;
+}
+
+//----------------------------------------------------------------------------
+void ColumnTable::add(int position, const Column &column)
+{
+	switch (column.type)
+	{
+		case Column::Double:
+			doubles.push_back(std::make_pair(position, static_cast<const double*>(column.value)));
+			break;
+		case Column::Float:
+			floats.push_back(std::make_pair(position, static_cast<const float*>(column.value)));
+			break;
+		case Column::Int:
+			ints.push_back(std::make_pair(position, static_cast<const int*>(column.value)));
+			break;
+	}
+}
+//----------------------------------------------------------------------------
+void ColumnTable::read(double *row) const
+{
+	for (const auto &slot : doubles)
+	{
+		row[slot.first] = *slot.second;
+	}
+	for (const auto &slot : floats)
+	{
+		row[slot.first] = static_cast<double>(*slot.second);
+	}
+	for (const auto &slot : ints)
+	{
+		row[slot.first] = static_cast<double>(*slot.second);
+	}
 }
 
 //----------------------------------------------------------------------------
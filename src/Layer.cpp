@@ -4,34 +4,72 @@
 //------------------------------------------------------
 
 #include "Layer.h"
+#include <algorithm>
 
 std::mt19937_64 generator;
 
 //----------------------------------------------------------------------------
+// out = W^T [event, 1] for a row-major (n_in + 1) x n_out weight block. The 
+// product is accumulated one weight row at a time so that the inner loop 
+// runs with unit stride; the bias row is added last, as before.
+template <typename T>
+static void affine(const T *event, const T *W, int n_in, int n_out, 
+                   T *out, bool bias = true)
+{
+	std::fill(out, out + n_out, T(0));
+	for (int j = 0; j < n_in; ++j) 
+	{
+		const T x = event[j];
+		const T *row = W + j * n_out;
+		for (int i = 0; i < n_out; ++i) 
+		{
+			out[i] += x * row[i];
+		}
+	}
+	if (bias)
+	{
+		const T *row = W + n_in * n_out;
+		for (int i = 0; i < n_out; ++i) 
+		{
+			out[i] += row[i];
+		}
+	}
+}
+
+//----------------------------------------------------------------------------
+// Draws the initial weights from generator unless initialize is false, 
+// for a layer whose storage is about to be copied over.
 Layer::Layer(int ins, int outs, bool last, 
-	         std::vector<double> (*Activation_function)(std::vector<double>)): 
-			 ins(ins), outs(outs), last(last), Outs(outs, 0.00), 
-             Delta(outs, 0.00), _sigmoid(Activation_function)
+	         void (*Activation_function)(double*, int), double *storage, bool initialize): 
+			 SynapseF(nullptr), ins(ins), outs(outs), last(last), _sigmoid(Activation_function), 
+			 optimizer(&default_optimizer()), steps(0)
 
 {
-	std::vector<double> new_vec(outs, 0.00);
-	for (int i = 0; i < ins + 1; ++i) 
+	if (!storage)
 	{
-		Synapse.push_back(new_vec);
-		DeltaSynapse.push_back(new_vec);
+		own_storage.assign(storage_size(ins, outs), 0.0);
+		storage = own_storage.data();
+	}
+	bind(storage);
+	if (initialize)
+	{
+		resetWeights(0.1);
 	}
-	resetWeights(0.1);
 	setMomentum(0.9);
 }
 
 //----------------------------------------------------------------------------
-Layer::Layer(std::vector<std::vector<double> > Synapse, bool last) : Synapse ( Synapse ), Outs(outs, 0.00), Delta(outs, 0.00) 
+Layer::Layer(std::vector<std::vector<double> > Synapse, bool last) : 
+             SynapseF(nullptr), ins(Synapse.size() - 1), outs(Synapse.at(0).size()), last(last), 
+             _sigmoid(sigmoid_inplace), optimizer(&default_optimizer()), steps(0)
 {
-	std::vector<double> new_vec(outs, 0.00);
-	for (int i = 0; i < ins + 1; ++i) 
+	own_storage.assign(storage_size(ins, outs), 0.0);
+	bind(own_storage.data());
+	for (int i = 0; i <= ins; ++i) 
 	{
-		DeltaSynapse.push_back(new_vec);
+		std::copy(Synapse.at(i).begin(), Synapse.at(i).end(), this->Synapse + i * outs);
 	}
+	setMomentum(0.9);
 }
 
 //----------------------------------------------------------------------------
@@ -39,10 +77,27 @@ Layer::~Layer()
 {
 }
 
+//----------------------------------------------------------------------------
+std::size_t Layer::storage_size(int ins, int outs)
+{
+	return 4 * arena_padded((ins + 1) * outs) + 2 * arena_padded(outs);
+}
+
+//----------------------------------------------------------------------------
+void Layer::bind(double *storage)
+{
+	Synapse = storage;
+	DeltaSynapse = Synapse + arena_padded((ins + 1) * outs);
+	Moment = DeltaSynapse + arena_padded((ins + 1) * outs);
+	Gradient = Moment + arena_padded((ins + 1) * outs);
+	Delta = Gradient + arena_padded((ins + 1) * outs);
+	Outs = Delta + arena_padded(outs);
+}
+
 //----------------------------------------------------------------------------
 std::vector<double> Layer::fire() 
 {
-	return Outs;
+	return std::vector<double>(Outs, Outs + outs);
 }
 
 //----------------------------------------------------------------------------
@@ -50,12 +105,9 @@ void Layer::perturb(double epsilon)
 {
 	std::uniform_real_distribution < double > distribution(-epsilon, epsilon);
 
-	for(auto &i : Synapse) 
+	for (int k = 0; k < (ins + 1) * outs; ++k) 
 	{
-		for(auto &ij : i) 
-		{
-			ij += distribution(generator);
-		}
+		Synapse[k] += distribution(generator);
 	}
 }
 
@@ -63,20 +115,11 @@ void Layer::perturb(double epsilon)
 void Layer::resetWeights(double bound) 
 {
 	std::uniform_real_distribution < double > distribution(-bound, bound);
-	for(auto &i : Synapse) 
-	{
-		for(auto &ij : i) 
-		{
-			ij = distribution(generator);
-		}
-	}
-	for(auto &i : DeltaSynapse) 
+	for (int k = 0; k < (ins + 1) * outs; ++k) 
 	{
-		for(auto &ij : i) 
-		{
-			ij = 0;
-		}
+		Synapse[k] = distribution(generator);
 	}
+	resetOptimizer();
 	// if (Auto_Encoder)
 	// {
 	// 	Auto_Encoder->resetWeights(bound);
@@ -84,9 +127,9 @@ void Layer::resetWeights(double bound)
 }
 
 //----------------------------------------------------------------------------
-void Layer::setDelta(std::vector<double> deltas) 
+void Layer::setDelta(const std::vector<double> &deltas) 
 {
-	Delta = deltas;
+	std::copy(deltas.begin(), deltas.end(), Delta);
 }
 
 //----------------------------------------------------------------------------
@@ -94,185 +137,201 @@ void Layer::setDelta(std::vector<double> deltas)
 void Layer::make_denoising()
 {
 	Auto_Encoder = std::move(std::unique_ptr<Layer>(new Layer(outs, ins, last, _sigmoid)));
+	Auto_Encoder->setOptimizer(optimizer);
 }
 
 //----------------------------------------------------------------------------
-
-void Layer::encode(std::vector<double> input, double learning, double weight)
+// Pretraining gradient of the layer and its autoencoder over a row-major 
+// (n_events x ins) block of inputs. Here we use a denoising autoencoder to 
+// determine initial weights in the neural network: we essentially perform 
+// non-linear PCA at each layer by estimating the identity function through 
+// a sigmoidal encoding and a linear reconstruction. In batch, outs holds 
+// the codes and the reconstructions, deltas the matching errors, and 
+// gradients those of the layer and of the autoencoder.
+void Layer::encode_gradient(const double *inputs, const double *weights, int n_events, 
+                            BatchWorkspace &batch) const
 {
-	// std::cout << Auto_Encoder->gamma << ", " << Auto_Encoder->onemingamma << std::endl;
-	/* 
-	Here, we use a denoising autoencoder to determine initial weights in the 
-	neural network. We essentially perform  non-linear PCA at each layer by 
-	estimating the identity function through a series of sigmoidal transforms.
-	*/
-	std::vector<double> identity_estimate(input);
-
-	input.push_back(1); // Add the bias term to the vector.
-
-	double sum;
-	// Feed throight the first layer
-	for (int i = 0; i < outs; ++i) {
-		sum = 0;
-		for (int j = 0; j <= ins; ++j) {
-			// Computes the dot product.
-			sum += input.at(j) * (Synapse.at(j).at(i)); 
+	const Layer &decoder = *Auto_Encoder;
+	batch.outs.resize(2);
+	batch.deltas.resize(2);
+	batch.gradients.resize(2);
+	for (int k = 0; k < 2; ++k) 
+	{ // the same workspace serves every layer in turn
+		const std::size_t size = n_events * ((k == 0) ? outs : ins);
+		if (batch.outs[k].size() < size) 
+		{
+			batch.outs[k].resize(size);
+			batch.deltas[k].resize(size);
 		}
-		Outs.at(i) = sum;
 	}
+	batch.gradients[0].resize((ins + 1) * outs);
+	batch.gradients[1].resize((outs + 1) * ins);
+	double *hidden = batch.outs[0].data(), *reconstructed = batch.outs[1].data();
+	double *delta = batch.deltas[0].data(), *error = batch.deltas[1].data();
 
-	Outs = _sigmoid(Outs); // transform the output of the first synapse.
-
-	// Feed throight the second layer
-	for (int i = 0; i < ins; ++i) {
-		sum = 0;
-		for (int j = 0; j < outs; ++j) {
-			sum += Outs.at(j) * (Auto_Encoder->Synapse.at(j).at(i));
-		}
-		identity_estimate.at(i) = sum;
-		Auto_Encoder->Outs.at(i) = sum;
+	feed_batch(inputs, n_events, hidden);
+	if (last) 
+	{
+		_sigmoid(hidden, n_events * outs); // the code is always a sigmoid
 	}
-
-	std::vector<double> error(identity_estimate);  /* needs to be (estimated - actual) */
-
-	for (int i = 0; i < ins; ++i) // Make error into the partial derivative.
+	for (int n = 0; n < n_events; ++n) 
 	{
-		error.at(i) -= input.at(i);
+		affine(hidden + n * outs, decoder.Synapse, outs, ins, reconstructed + n * ins, false);
 	}
 
-	Auto_Encoder->setDelta( error );
-
-	for (int i = 0; i < outs; ++i) 
+	/* needs to be (estimated - actual) */
+	for (int k = 0; k < n_events * ins; ++k) 
+	{
+		error[k] = reconstructed[k] - inputs[k];
+	}
+	for (int n = 0; n < n_events; ++n) 
 	{ // Delta = DSIG * Synapse * prev_Delta
-		double val = 0;
-		for (int j = 0; j < ins; ++j) 
+		for (int i = 0; i < outs; ++i) 
 		{
-			val += dsig(Outs.at(i)) * (Auto_Encoder->Synapse.at(i).at(j)) * (Auto_Encoder->Delta.at(j));
+			const double *row = decoder.Synapse + i * ins;
+			double val = 0;
+			for (int j = 0; j < ins; ++j) 
+			{
+				val += row[j] * error[n * ins + j];
+			}
+			delta[n * outs + i] = dsig(hidden[n * outs + i]) * val;
 		}
-		Delta.at(i) = val;
 	}
-	for (int i = 0; i < ins; ++i) 
-	{
-    	int j;
-    	for (j = 0; j <  outs; ++j) //not plus one because of bias 	
-    	{
-    		Auto_Encoder->set(j, i, -learning * weight * Auto_Encoder->Delta.at(i) * Outs.at(j));
-    	}  	
-    	// Auto_Encoder->set(j, i, -learning * weight * Auto_Encoder->Delta.at(i));
-    }
-
-    for (int i = 0; i < outs; ++i) 
-    {
-    	int j;
-    	//not plus one because of bias 
-    	for (j = 0; j < ins; ++j)
-    	{
-    		set(j, i, -learning * weight * Delta.at(i) * input.at(j));
-    	}
-    	set(j, i, -learning * weight * Delta.at(i));
-    }
-    drop();
-    Auto_Encoder->drop();
-
-	// Feed throight the first layer
 
-	for (int i = 0; i < outs; ++i) {
-		sum = 0;
-		for (int j = 0; j <= ins; ++j) {
-			// Computes the dot product.
-			sum += input.at(j) * (Synapse.at(j).at(i)); 
-		}
-		Outs.at(i) = sum;
-	}
+	// the reconstruction has no bias, so neither has its gradient
+	decoder.accumulate_gradient(hidden, error, weights, n_events, batch.gradients[1].data(), false);
+	accumulate_gradient(inputs, delta, weights, n_events, batch.gradients[0].data());
+}
 
-	Outs = _sigmoid(Outs); // transform the output of the first synapse.
+//----------------------------------------------------------------------------
+void Layer::encode_descend(const BatchWorkspace &batch, double learning)
+{
+	descend(batch.gradients[0].data(), learning, 0);
+	Auto_Encoder->descend(batch.gradients[1].data(), learning, 0);
+}
 
-	auto Outs_copy = (Outs);
-	Outs_copy.push_back(1);
+//----------------------------------------------------------------------------
+std::vector<double> Layer::getReconstructedInput(std::vector<double> jet)
+{
+	affine(jet.data(), Synapse, ins, outs, Outs);
+	_sigmoid(Outs, outs); // transform the output of the first synapse.
 
 	// Feed throight the second layer
-	for (int i = 0; i < ins; ++i) {
-		sum = 0;
-		for (int j = 0; j <= outs; ++j) {
-			sum += Outs_copy.at(j) * (Auto_Encoder->Synapse.at(j).at(i));
-		}
-		Auto_Encoder->Outs.at(i) = sum;
-	}
-
+	affine(Outs, Auto_Encoder->Synapse, outs, ins, Auto_Encoder->Outs);
+	return Auto_Encoder->fire();
 }
+
 //----------------------------------------------------------------------------
-std::vector<double> Layer::getReconstructedInput(std::vector<double> jet)
+void Layer::feed(const double *event) 
 {
-	double sum;
-	jet.push_back(1.0);
-	for (int i = 0; i < outs; ++i) {
-		sum = 0;
-		for (int j = 0; j <= ins; ++j) {
-			// Computes the dot product.
-			sum += jet.at(j) * (Synapse.at(j).at(i)); 
-		}
-		Outs.at(i) = sum;
+	affine(event, Synapse, ins, outs, Outs);
+	if (!last) 
+	{
+		_sigmoid(Outs, outs);
 	}
+}
 
-	Outs = _sigmoid(Outs); // transform the output of the first synapse.
-
-	auto Outs_copy(Outs);
-	Outs_copy.push_back(1);
-
-	// Feed throight the second layer
-	for (int i = 0; i < ins; ++i) {
-		sum = 0;
-		for (int j = 0; j <= outs; ++j) {
-			sum += Outs_copy.at(j) * (Auto_Encoder->Synapse.at(j).at(i));
-		}
-		Auto_Encoder->Outs.at(i) = sum;
-	}
-	return Auto_Encoder->Outs;
+//----------------------------------------------------------------------------
+void Layer::feed(const std::vector<double> &event) 
+{
+	feed(event.data());
 }
 
 //----------------------------------------------------------------------------
-void Layer::feed(std::vector<double> event) 
+// Feeds a row-major (n_events x ins) block through the layer, writing the 
+// (n_events x outs) results to out. The weights stay in cache across rows.
+template <typename T>
+void Layer::feed_batch(const T *events, int n_events, T *out) const
 {
-	event.push_back(1);
-	double sum;
-	for (int i = 0; i < outs; ++i) 
+	const T *W = weights<T>();
+	for (int n = 0; n < n_events; ++n) 
 	{
-		sum = 0;
-		for (int j = 0; j <= ins; ++j) 
-		{
-			sum += event.at(j) * (Synapse.at(j).at(i));
-		}
-		Outs.at(i) = sum;
+		affine(events + n * ins, W, ins, outs, out + n * outs);
 	}
 	if (!last) 
 	{
-		Outs = _sigmoid(Outs);
+		activate(out, n_events * outs);
 	}
 }
+template void Layer::feed_batch(const double*, int, double*) const;
+template void Layer::feed_batch(const float*, int, float*) const;
 
 //----------------------------------------------------------------------------
-void Layer::drop() 
+// Single precision always uses the sigmoid, the only activation trained.
+void Layer::activate(double *outs, int n) const
 {
-	for (int i = 0; i <= ins; ++i) 
+	_sigmoid(outs, n);
+}
+void Layer::activate(float *outs, int n) const
+{
+	sigmoid_inplace(outs, n);
+}
+
+//----------------------------------------------------------------------------
+// One optimizer step from a gradient, of one event or summed over a 
+// mini-batch: the weights move against it at the given rate, less decay 
+// times themselves (the bias row is not decayed).
+void Layer::descend(const double *gradient, double rate, double decay) 
+{
+	const long step = steps.fetch_add(1, std::memory_order_relaxed) + 1;
+	WeightBlock block = {Synapse, DeltaSynapse, Moment, (ins + 1) * outs, ins * outs, gamma, step};
+	optimizer->step(block, gradient, rate, decay);
+}
+
+//----------------------------------------------------------------------------
+// Switches the layer, and its autoencoder, to another update rule. The 
+// optimizer is owned by the Architecture.
+void Layer::setOptimizer(const Optimizer *optimizer) 
+{
+	this->optimizer = optimizer;
+	if (Auto_Encoder) 
 	{
-		for (int j = 0; j < outs; ++j) 
-		{
-			Synapse.at(i).at(j) +=  DeltaSynapse.at(i).at(j);
-		}
+		Auto_Encoder->setOptimizer(optimizer);
 	}
 }
 
 //----------------------------------------------------------------------------
-void Layer::set(int i, int j, double val) 
+void Layer::resetOptimizer() 
+{
+	std::fill(DeltaSynapse, DeltaSynapse + (ins + 1) * outs, 0.0);
+	std::fill(Moment, Moment + (ins + 1) * outs, 0.0);
+	steps = 0;
+}
+
+//----------------------------------------------------------------------------
+// Sets gradient to the (ins + 1) x outs sum over events of 
+// weight * [input, 1] (x) delta, for row-major blocks of inputs and deltas. 
+// Without bias the last row is left at zero. The sums are in double 
+// whatever T is.
+template <typename T>
+void Layer::accumulate_gradient(const T *inputs, const T *deltas, const double *weights, 
+                                int n_events, double *gradient, bool bias) const
 {
-	DeltaSynapse.at(i).at(j) = (onemingamma * val) + gamma * DeltaSynapse.at(i).at(j);
+	std::fill(gradient, gradient + (ins + 1) * outs, 0.0);
+	const int rows = bias ? ins + 1 : ins;
+	for (int n = 0; n < n_events; ++n) 
+	{
+		const T *delta = deltas + n * outs;
+		for (int j = 0; j < rows; ++j) 
+		{
+			const double x = weights[n] * ((j < ins) ? inputs[n * ins + j] : 1.0);
+			double *row = gradient + j * outs;
+			for (int i = 0; i < outs; ++i) 
+			{
+				row[i] += x * delta[i];
+			}
+		}
+	}
 }
+template void Layer::accumulate_gradient(const double*, const double*, const double*, 
+                                         int, double*, bool) const;
+template void Layer::accumulate_gradient(const float*, const float*, const double*, 
+                                         int, double*, bool) const;
 
 //----------------------------------------------------------------------------
 void Layer::setMomentum(double x) 
 {
 	gamma = x;
-	onemingamma = 1.0 - x;
 }
 
 
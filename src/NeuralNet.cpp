@@ -5,7 +5,15 @@
 
 #include "NeuralNet.h"
 #include "Architecture.h"
+#include "JetTagger.h"
 #include <utility>
+#include <cstdio>
+#include <sys/stat.h>
+#include "Threads.h"
+
+//----------------------------------------------------------------------------
+// The training selection, unless the spec or setSelection gives another.
+static const char *default_selection = "pt > 20, abs(eta) < 2.5, flavor_truth_label < 8, pt < 1000";
 
 //----------------------------------------------------------------------------
 NeuralNet::NeuralNet(std::vector<int> structure): 
@@ -15,7 +23,7 @@ NeuralNet::NeuralNet(std::vector<int> structure):
 {
 	learning = 0.1;
 	momentum = 0.5;
-	setActivationFunctions(sigmoid, dsig, softmax);
+	setActivationFunctions(sigmoid_inplace, dsig, softmax_inplace);
 	Net = std::move(std::unique_ptr<Architecture>(new Architecture(structure, _sigmoid, _sigmoid_derivative)));	
 	Net->setLearning(0.1);
 	Net->setMomentum(0.5);
@@ -27,23 +35,20 @@ NeuralNet::NeuralNet()
 //----------------------------------------------------------------------------
 NeuralNet::~NeuralNet() 
 {
+	if (validator.joinable()) 
+	{
+		validator.join();
+	}
+	if (checkpointer.joinable()) 
+	{
+		checkpointer.join();
+	}
 }
 //----------------------------------------------------------------------------
 NeuralNet::NeuralNet(NeuralNet &A) : 
-Net(std::unique_ptr<Architecture>(new Architecture(A.Net->structure, A.Net->_sigmoid_function, A.Net->_sigmoid_derivative))) 
+Net(std::unique_ptr<Architecture>(new Architecture(*A.Net))) 
 {
 	setActivationFunctions(A._sigmoid, A._sigmoid_derivative, A._softmax_function);
-	for (unsigned int l = 0; l < Net->Bundle.size(); ++l) 
-	{
-		for (int i = 0; i <= Net->Bundle.at(l)->ins; ++i) 
-		{
-			for (int j = 0; j < Net->Bundle.at(l)->outs; ++j) 
-			{
-				Net->Bundle.at(l)->Synapse.at(i).at(j) = A.Net->Bundle.at(l)->Synapse.at(i).at(j);
-				Net->Bundle.at(l)->DeltaSynapse.at(i).at(j) = A.Net->Bundle.at(l)->DeltaSynapse.at(i).at(j);
-			}
-		}
-	}
 	Net->setLearning(A.learning);
 	Net->setMomentum(A.momentum);
 }
@@ -56,18 +61,7 @@ NeuralNet& NeuralNet::operator=(const NeuralNet &A)
 	} 
 	else  
 	{
-		Net = std::move(std::unique_ptr<Architecture>(new Architecture(A.Net->structure, A.Net->_sigmoid_function, A.Net->_sigmoid_derivative)));
-		for (unsigned int l = 0; l < Net->Bundle.size(); ++l) 
-		{
-			for (int i = 0; i <= Net->Bundle.at(l)->ins; ++i) 
-			{
-				for (int j = 0; j < Net->Bundle.at(l)->outs; ++j) 
-				{
-					Net->Bundle.at(l)->Synapse.at(i).at(j) = A.Net->Bundle.at(l)->Synapse.at(i).at(j);
-					Net->Bundle.at(l)->DeltaSynapse.at(i).at(j) = A.Net->Bundle.at(l)->DeltaSynapse.at(i).at(j);
-				}
-			}
-		}
+		Net = std::move(std::unique_ptr<Architecture>(new Architecture(*A.Net)));
 		Net->setLearning(A.learning);
 		Net->setMomentum(A.momentum);
 		return *this;
@@ -78,6 +72,8 @@ void NeuralNet::set_dataset(std::string root_file, std::string tree_name)
 
 {
 	dataset = std::move(std::unique_ptr<Dataset>(new Dataset(root_file, tree_name)));
+	this->root_file = root_file;
+	this->tree_name = tree_name;
 }
 //----------------------------------------------------------------------------
 bool NeuralNet::set_input_branch(std::string name, std::string type)
@@ -131,14 +127,110 @@ void NeuralNet::setMomentum(double x)
 	Net->setMomentum(x);
 }
 //----------------------------------------------------------------------------
+void NeuralNet::setBatchSize(int n) 
+{
+	batch_size = std::max(n, 1);
+}
+//----------------------------------------------------------------------------
+// Memory-mode training on n threads, each over its own share of the events. 
+// By default the threads' batch gradients are summed into one update per 
+// step; with hogwild every thread updates the shared weights itself, 
+// without locks.
+void NeuralNet::setThreads(int n, bool hogwild) 
+{
+	n_threads = std::max(n, 1);
+	this->hogwild = hogwild;
+}
+//----------------------------------------------------------------------------
+// Selects the update rule by name: momentum (the default), nesterov, 
+// rmsprop or adam.
+bool NeuralNet::setOptimizer(const std::string &name) 
+{
+	std::unique_ptr<Optimizer> optimizer = make_optimizer(name);
+	if (!optimizer) 
+	{
+		std::cout << "\nError: unknown optimizer " << name 
+		          << " (expected momentum, nesterov, rmsprop or adam)." << std::endl;
+		return 0;
+	}
+	Net->setOptimizer(std::move(optimizer));
+	return 1;
+}
+//----------------------------------------------------------------------------
+// Holds out the n_holdout dataset entries after the training range to 
+// validate on, every interval trained events (or every epoch if 0), and 
+// stops training after patience validations without improvement (never if 
+// 0). The best weights seen are kept and are what training ends with.
+void NeuralNet::setValidation(int n_holdout, int interval, int patience) 
+{
+	this->n_holdout = std::max(n_holdout, 0);
+	validation_interval = std::max(interval, 0);
+	this->patience = std::max(patience, 0);
+}
+//----------------------------------------------------------------------------
+// Checkpoints training every interval trained events, on top of the one 
+// taken at the start of every epoch (0: only those).
+void NeuralNet::setCheckpoints(int interval) 
+{
+	checkpoint_interval = std::max(interval, 0);
+}
+//----------------------------------------------------------------------------
+// Trains on every epoch's events in a different order, reproducible from 
+// seed: in memory, a permutation of blocks of block adjacent events, each 
+// shuffled in turn; streamed, through a buffer of buffer events that 
+// trains on a random one as each new one is read, so reads stay sequential.
+void NeuralNet::setShuffle(unsigned long seed, int buffer, int block) 
+{
+	shuffle = true;
+	shuffle_seed = seed;
+	shuffle_buffer = std::max(buffer, 1);
+	shuffle_block = std::max(block, 1);
+}
+//----------------------------------------------------------------------------
+// Trains events held in memory in single precision: they are stored as 
+// floats, and forward and backward passes run on a float copy of the 
+// weights, while gradients are summed and the weights updated in double.
+void NeuralNet::setSinglePrecision(bool single) 
+{
+	single_precision = single;
+}
+//----------------------------------------------------------------------------
+// Sizes the cache the dataset's branches are read through (-1: one cluster 
+// of entries).
+void NeuralNet::setReadCache(long long bytes) 
+{
+	cache_size = bytes;
+	dataset->prepare_cache(cache_size);
+}
+//----------------------------------------------------------------------------
+// Replaces the training selection, e.g. "pt > 20 && abs(eta) < 2.5", over 
+// variables set from the spec; see Dataset::set_selection.
+bool NeuralNet::setSelection(const std::string &cuts) 
+{
+	if (!dataset->set_selection(cuts))
+	{
+		return false;
+	}
+	selection = cuts;
+	return true;
+}
+//----------------------------------------------------------------------------
+// Trains on the events of a preprocessed cache in filename, mapped, rather 
+// than reading them from the dataset; the cache is written first if it is 
+// missing or holds other events.
+void NeuralNet::setPreprocessedCache(const std::string &filename) 
+{
+	preprocessed_file = filename;
+}
+//----------------------------------------------------------------------------
 void NeuralNet::anneal(double x) 
 {
 	Net->anneal(x);
 }
 //----------------------------------------------------------------------------
-void NeuralNet::setActivationFunctions(std::vector<double> (*sigmoid_function) (std::vector<double>),
+void NeuralNet::setActivationFunctions(void (*sigmoid_function) (double*, int),
                                        double (*sigmoid_derivative)(double), 
-                                       std::vector<double> (*softmax_function) (std::vector<double>))
+                                       void (*softmax_function) (double*, int))
 {
 	_sigmoid_derivative = sigmoid_derivative;
 	_softmax_function = softmax_function;
@@ -150,76 +242,658 @@ void NeuralNet::train(int n_epochs, int n_train,
                       std::string timestamp, bool memory)
 {
 	double pct;
+	bool stop = false;
+	long since_checkpoint = 0;
+	const int first_epoch = start_epoch;
+	const long first_entry = start_entry;
+	const std::string progress_file = ".temp_progress_" + save_filename + "_" + timestamp + ".ckpt";
+	start_epoch = 0;
+	start_entry = 0;
+	if ((n_holdout > 0) && holdout.empty())
+	{
+		load_holdout(n_train);
+	}
+	// after every trained event, entry being where to resume from: 
+	// validates every validation_interval trained events and checkpoints 
+	// every checkpoint_interval, at a batch boundary; false once training 
+	// should stop
+	auto check = [&](int epoch, long entry) 
+	{
+		++trained;
+		if ((checkpoint_interval > 0) && (++since_checkpoint >= checkpoint_interval) && 
+		    batch.weights.empty() && float_batch.weights.empty()) 
+		{
+			checkpoint(progress_file, epoch, entry);
+			since_checkpoint = 0;
+		}
+		return (n_holdout == 0) || (validation_interval == 0) || 
+		       (trained % validation_interval != 0) || validate(verbose);
+	};
 	if(!memory)
 	{
-		for (int i = 0; i < n_epochs; ++i) 
+		for (int i = first_epoch; (i < n_epochs) && !stop; ++i) 
 	    {
-	    	 //save a progress file in case we need to kill the process.
-	    	save(".temp_progress_" + save_filename + std::to_string(i) + "_"+ timestamp + ".nnet");
-	        for (int entry = 0; entry < n_train; entry++) 
+	    	long entry = (i == first_epoch) ? first_entry : 0;
+	    	if (entry == 0)
+	    	{
+	    		//checkpoint in case we need to kill the process.
+	    		checkpoint(progress_file, i, 0);
+	    	}
+	        if (shuffle)
 	        {
-	        	get_dataset_entry(entry);
-	            if ((get_value("pt") > 20) && 
-	            	(fabs(get_value("eta")) < 2.5) && 
-	            	(get_value("flavor_truth_label") < 8) && 
-	            	(get_value("pt") < 1000))
-	            {
-	        		train(input(), output(), get_physics_reweighting());
-	            }
-	            pct = (((double)(entry)) / ((double) (n_train))) * 100;
-	            if (verbose)
-	            {
-	                epoch_progress_bar(pct, i + 1, n_epochs);
-	            }
-	        }	        
+	        	stop = !train_shuffled(i, n_epochs, n_train, entry, check, verbose);
+	        }
+	        else
+	        {
+	        	// reading and selecting run ahead on the loader's threads
+	        	loader.run(entry, n_train, 
+	        		[&](long e, Row &row) { read_row(e, row, {}, true, true); },
+	        		[&](Row &row) { return row.selected; },
+	        		[&](Row &row) 
+	        	{
+	            	if (batch_size > 1)
+	            	{
+	            		train_batched(row.input, row.output, row.weight);
+	            	}
+	            	else
+	            	{
+	        			train(row.input, row.output, row.weight);
+	            	}
+	            	stop = !check(i, row.entry + 1);
+		            pct = (((double)(row.entry)) / ((double) (n_train))) * 100;
+		            if (verbose)
+		            {
+		                epoch_progress_bar(pct, i + 1, n_epochs);
+		            }
+		            return !stop;
+	        	});
+	        }
+	        flush_batch();
+	        if ((n_holdout > 0) && (validation_interval == 0) && !stop) 
+	        {
+	        	stop = !validate(verbose);
+	        }
 	    }
 	}
 	else
 	{
-		int n = weights_mem.size();
-		for (int i = 0; i < n_epochs; ++i) 
+		int n = single_precision ? float_mem.size() : dataset_mem.size();
+		memory_label.resize(structure.back());
+		if (single_precision)
+		{
+			Net->use_float();
+		}
+		for (int i = first_epoch; (i < n_epochs) && !stop; ++i) 
 	    {
-	    	//save a progress file in case we need to kill the process.
-	    	save(".temp_progress_" + save_filename + std::to_string(i) + "_"+ timestamp + ".nnet"); 
-	        for (int entry = 0; entry < n; entry++) 
+	    	long entry = (i == first_epoch) ? first_entry : 0;
+	    	if (entry == 0)
+	    	{
+	    		//checkpoint in case we need to kill the process.
+	    		checkpoint(progress_file, i, 0);
+	    	}
+	    	shuffle_order(i, n);
+	    	if (n_threads > 1)
+	    	{
+	    		// validated and checkpointed once per epoch
+	    		if (single_precision)
+	    		{
+	    			train_threaded(float_shards, float_mem, i, n_epochs, verbose);
+	    		}
+	    		else
+	    		{
+	    			train_threaded(shards, dataset_mem, i, n_epochs, verbose);
+	    		}
+	    		stop = (n_holdout > 0) && !validate(verbose);
+	    		continue;
+	    	}
+	        for (; entry < n; entry++) 
 	        {
-	        	train(dataset_mem.at(entry), labels_mem.at(entry), weights_mem.at(entry));
+	        	const int event = epoch_order[entry];
+	        	if ((batch_size > 1) || single_precision)
+	        	{
+	        		train_batched(event);
+	        	}
+	        	else
+	        	{
+	        		dataset_mem.outputs(event, memory_label.data());
+	        		train_normalized(dataset_mem.row(event), memory_label.data(), dataset_mem.weight(event));
+	        	}
+	        	if (!check(i, entry + 1))
+	        	{
+	        		stop = true;
+	        		break;
+	        	}
 	            pct = (((double)(entry)) / ((double) (n))) * 100;
 	            if (verbose)
 	            {
 	                epoch_progress_bar(pct, i + 1, n_epochs);
 	            }
 	        }
+	        flush_batch();
+	        if ((n_holdout > 0) && (validation_interval == 0) && !stop) 
+	        {
+	        	stop = !validate(verbose);
+	        }
 	    }
 	}
+	finish_validation(verbose);
+	if (checkpointer.joinable()) 
+	{
+		checkpointer.join();
+	}
     if (verbose)
     {
+    	std::cout << "\nRead " << dataset->bytes_per_entry() << " bytes per entry." << std::endl;
     	std::cout << "Saving parameters to " << save_filename << "." << std::endl; 
     }
     save(save_filename);
 }
 //----------------------------------------------------------------------------
-void NeuralNet::train(std::vector<double> Event, std::vector<double> Actual, double weight) 
+// One training step on one event. The event and its error are kept in the 
+// Architecture's workspace, so the step makes no allocations.
+void NeuralNet::train(const std::vector<double> &Event, const std::vector<double> &Actual, double weight) 
+{
+	double *event = Net->event_workspace();
+	assert((int)Actual.size() == structure.back());
+	normalize(Event, event);
+	train_normalized(event, Actual.data(), weight);
+}
+//----------------------------------------------------------------------------
+// The same for an event already normalized.
+void NeuralNet::train_normalized(const double *event, const double *Actual, double weight) 
+{
+	double *error = Net->error_workspace();
+	const int n_outs = structure.back();
+	const double *outs = Net->test(event);
+	std::copy(outs, outs + n_outs, error);
+	_softmax_function(error, n_outs);
+	for (int i = 0; i < n_outs; ++i) 
+	{
+		error[i] -= Actual[i];
+		error[i] /= log(2);
+	}
+	Net->backpropagate(error, event, weight);
+}
+//----------------------------------------------------------------------------
+// Writes the normalized form of Event, as transform() returns it, to out.
+void NeuralNet::normalize(const std::vector<double> &Event, double *out) const
+{
+	for (unsigned int i = 0; i < Event.size(); ++i) 
+	{
+		out[i] = (Event[i] - mean[i]) / ((stddev[i] < 1e-7) ? 1e-4 : stddev[i]); // avoid dirac delta-like variances
+	}
+}
+//----------------------------------------------------------------------------
+// Appends one event, normalized, to a mini-batch. Once the shard has held a 
+// full batch this no longer allocates.
+void NeuralNet::add_to_batch(BatchShard &shard, const std::vector<double> &Event, 
+                             const std::vector<double> &Actual, double weight) const
+{
+	shard.events.resize(shard.events.size() + Event.size());
+	normalize(Event, shard.events.data() + shard.events.size() - Event.size());
+	shard.labels.insert(shard.labels.end(), Actual.begin(), Actual.end());
+	shard.weights.push_back(weight);
+}
+//----------------------------------------------------------------------------
+// Appends an event of store to a mini-batch. While the batch is a run of 
+// consecutive events it stays in the store; once it is not, the events so 
+// far are gathered into the shard, and later ones copied after them.
+template <typename T>
+void NeuralNet::add_memory_event(BasicShard<T> &shard, const MemoryDataset<T> &store, int event) const
+{
+	const int n_ins = store.n_inputs(), n_outs = store.n_outputs();
+	const int n = shard.weights.size();
+	if (n == 0) 
+	{
+		shard.run = store.row(event);
+	}
+	else if (shard.run && (store.row(event) != shard.run + n * n_ins)) 
+	{
+		shard.events.assign(shard.run, shard.run + n * n_ins);
+		shard.run = nullptr;
+	}
+	if (!shard.run) 
+	{
+		shard.events.insert(shard.events.end(), store.row(event), store.row(event) + n_ins);
+	}
+	shard.labels.resize((n + 1) * n_outs);
+	store.outputs(event, shard.labels.data() + n * n_outs);
+	shard.weights.push_back(store.weight(event));
+}
+//----------------------------------------------------------------------------
+// Runs a mini-batch forward and leaves its summed gradient in the shard's 
+// workspace (zero for an empty batch), emptying the shard for the next one. 
+// Only reads the net, so threads may call it on their own shards at once.
+template <typename T>
+void NeuralNet::batch_gradient(BasicShard<T> &shard) const
+{
+	int n_events = shard.weights.size();
+	int n_outs = structure.back();
+	const T *events = shard.run ? shard.run : shard.events.data();
+	const T *outs = Net->test_batch(events, n_events, shard.workspace);
+	shard.errors.assign(outs, outs + n_events * n_outs);
+	for (int n = 0; n < n_events; ++n) 
+	{
+		double *error = shard.errors.data() + n * n_outs;
+		_softmax_function(error, n_outs);
+		for (int i = 0; i < n_outs; ++i) 
+		{
+			error[i] = (error[i] - shard.labels[n * n_outs + i]) / log(2);
+		}
+	}
+	Net->gradient_batch(shard.errors.data(), events, shard.weights.data(), 
+	                    n_events, shard.workspace);
+	shard.events.clear();
+	shard.run = nullptr;
+	shard.labels.clear();
+	shard.weights.clear();
+}
+//----------------------------------------------------------------------------
+// Loads entry into row: inputs, labels, the values of columns (NaN for a 
+// variable not in the spec) and, if reweight, the physics reweighting. With 
+// select, only the branches of the training selection are read first, and 
+// the rest only if the entry passes; row.selected says whether it did. 
+// Runs on the loader's reader thread, which alone uses the dataset 
+// meanwhile; row keeps its buffers from entry to entry.
+void NeuralNet::read_row(long entry, Row &row, const std::vector<int> &columns, bool reweight, 
+                         bool select) 
+{
+	row.entry = entry;
+	row.selected = true;
+	if (!select)
+	{
+		dataset->at(entry);
+	}
+	else if (!(row.selected = dataset->at_selected(entry)))
+	{
+		return;
+	}
+	row.input.assign(dataset->input().begin(), dataset->input().end());
+	row.output.assign(dataset->output().begin(), dataset->output().end());
+	row.values.resize(columns.size());
+	for (unsigned int i = 0; i < columns.size(); ++i) 
+	{
+		row.values[i] = (columns[i] < 0) ? NAN : dataset->get_value(columns[i]);
+	}
+	row.weight = reweight ? dataset->get_physics_reweighting() : 1;
+}
+//----------------------------------------------------------------------------
+// The dataset columns of names, -1 for those not in the spec.
+std::vector<int> NeuralNet::find_columns(const std::vector<std::string> &names) const
+{
+	std::vector<int> columns;
+	for (auto &name : names) 
+	{
+		columns.push_back(dataset->column(name));
+	}
+	return columns;
+}
+//----------------------------------------------------------------------------
+// The generator an epoch shuffles with, so that an epoch's order only 
+// depends on the seed and on the epoch, and a checkpoint needs no state.
+std::mt19937_64 NeuralNet::epoch_generator(int epoch) const
+{
+	std::seed_seq seed{(unsigned long)shuffle_seed, (unsigned long)epoch};
+	return std::mt19937_64(seed);
+}
+//----------------------------------------------------------------------------
+// Fills epoch_order with the order to visit dataset_mem in: in index order, 
+// or, shuffling, blocks of shuffle_block adjacent events in random order, 
+// each shuffled, so that a block's events stay close in memory.
+void NeuralNet::shuffle_order(int epoch, int n_events) 
+{
+	epoch_order.resize(n_events);
+	for (int k = 0; k < n_events; ++k) 
+	{
+		epoch_order[k] = k;
+	}
+	if (!shuffle) 
+	{
+		return;
+	}
+	std::mt19937_64 rng = epoch_generator(epoch);
+	std::vector<int> blocks((n_events + shuffle_block - 1) / shuffle_block);
+	for (unsigned int b = 0; b < blocks.size(); ++b) 
+	{
+		blocks[b] = b;
+	}
+	std::shuffle(blocks.begin(), blocks.end(), rng);
+	int k = 0;
+	for (int b : blocks) 
+	{
+		const int first = k;
+		for (int event = b * shuffle_block; event < std::min((b + 1) * shuffle_block, n_events); ++event) 
+		{
+			epoch_order[k++] = event;
+		}
+		std::shuffle(epoch_order.begin() + first, epoch_order.begin() + k, rng);
+	}
+}
+//----------------------------------------------------------------------------
+// One streamed epoch in shuffled order. Entries are read in sequence into a 
+// buffer of shuffle_buffer selected events; once it is full, each new event 
+// takes the place of a random buffered one, which is trained on, and the 
+// rest are trained on in random order at the end. Positions count events 
+// trained on this epoch, so resuming at skip replays the epoch's reads and 
+// only trains from there. Returns false if check stopped training.
+bool NeuralNet::train_shuffled(int epoch, int n_epochs, int n_train, long skip, 
+                               const std::function<bool(int, long)> &check, bool verbose) 
+{
+	std::mt19937_64 rng = epoch_generator(epoch);
+	std::vector<std::vector<double> > events, labels;
+	std::vector<double> weights;
+	long position = 0;
+	auto emit = [&](int k) 
+	{
+		if (++position <= skip) 
+		{
+			return true;
+		}
+		if (batch_size > 1)
+		{
+			train_batched(events[k], labels[k], weights[k]);
+		}
+		else
+		{
+			train(events[k], labels[k], weights[k]);
+		}
+		return check(epoch, position);
+	};
+	bool going = true;
+	loader.run(0, n_train, 
+		[&](long entry, Row &row) { read_row(entry, row, {}, true, true); },
+		[&](Row &row) { return row.selected; },
+		[&](Row &row) 
+	{
+		if ((int)weights.size() < shuffle_buffer) 
+		{
+			events.push_back(row.input);
+			labels.push_back(row.output);
+			weights.push_back(row.weight);
+			return true;
+		}
+		const int k = std::uniform_int_distribution<int>(0, shuffle_buffer - 1)(rng);
+		going = emit(k);
+		// the row takes the trained event's buffers, to be read into again
+		std::swap(events[k], row.input);
+		std::swap(labels[k], row.output);
+		weights[k] = row.weight;
+		if (verbose)
+		{
+			epoch_progress_bar((((double)(row.entry)) / ((double) (n_train))) * 100, epoch + 1, n_epochs);
+		}
+		return going;
+	});
+	if (!going) 
+	{
+		return false;
+	}
+	std::vector<int> rest(weights.size());
+	for (unsigned int k = 0; k < rest.size(); ++k) 
+	{
+		rest[k] = k;
+	}
+	std::shuffle(rest.begin(), rest.end(), rng);
+	for (int k : rest) 
+	{
+		if (!emit(k)) 
+		{
+			return false;
+		}
+	}
+	return true;
+}
+//----------------------------------------------------------------------------
+// Reads the n_holdout entries from first_entry on that pass the training 
+// selection, normalized, into memory.
+void NeuralNet::load_holdout(int first_entry) 
 {
-	std::vector<double> outs((Net->test( transform(Event) )));
-	assert ( outs.size() == Actual.size());
-	outs = _softmax_function(outs);
-	for (unsigned int i = 0; i < outs.size(); ++i) 
+	holdout.reset(structure.front(), structure.back());
+	int last_entry = std::min(first_entry + n_holdout, (int)dataset->num_entries());
+	loader.run(first_entry, last_entry, 
+		[&](long entry, Row &row) { read_row(entry, row, {}, true, true); },
+		[&](Row &row) { return row.selected; },
+		[&](Row &row) 
 	{
-		outs.at(i) -= Actual.at(i);
-		outs.at(i) /= log(2);
+		holdout.add(row.input, row.output, row.weight);
+		return true;
+	});
+	holdout.normalize(mean, stddev);
+	best_net.reset();
+	since_best = 0;
+}
+//----------------------------------------------------------------------------
+// Weighted cross-entropy, in bits, of net over the holdout events. Only 
+// reads net, so it runs on the validation thread alongside training.
+double NeuralNet::validation_loss(const Architecture &net) const
+{
+	const int n_events = holdout.size(), n_outs = structure.back();
+	const int chunk = 256;
+	BatchWorkspace batch;
+	std::vector<double> probabilities(chunk * n_outs);
+	double loss = 0, total = 0;
+	for (int first = 0; first < n_events; first += chunk) 
+	{
+		const int n = std::min(chunk, n_events - first);
+		const double *outs = net.test_batch(holdout.row(first), n, batch);
+		std::copy(outs, outs + n * n_outs, probabilities.begin());
+		for (int k = 0; k < n; ++k) 
+		{
+			double *p = probabilities.data() + k * n_outs;
+			const int label = holdout.label(first + k);
+			_softmax_function(p, n_outs);
+			if (label >= 0) 
+			{
+				loss -= holdout.weight(first + k) * log(std::max(p[label], 1e-300)) / log(2);
+			}
+			total += holdout.weight(first + k);
+		}
+	}
+	return (total > 0) ? loss / total : 0;
+}
+//----------------------------------------------------------------------------
+// Collects the previous validation, then starts validating a snapshot of 
+// the current weights in the background. Returns false, starting nothing, 
+// once patience runs out. Stopping therefore lags one check behind.
+bool NeuralNet::validate(bool verbose) 
+{
+	if (!collect_validation(verbose)) 
+	{
+		return false;
 	}
-	Net->backpropagate(outs, transform(Event), weight);
+	pending = std::unique_ptr<Architecture>(new Architecture(*Net));
+	validator = std::thread([this]() { pending_loss = validation_loss(*pending); });
+	return true;
+}
+//----------------------------------------------------------------------------
+// Waits for the running validation, if any, and keeps its snapshot if it 
+// is the best yet. Returns whether training should go on.
+bool NeuralNet::collect_validation(bool verbose) 
+{
+	if (!validator.joinable()) 
+	{
+		return true;
+	}
+	validator.join();
+	if (!best_net || (pending_loss < best_loss)) 
+	{
+		best_loss = pending_loss;
+		best_net = std::move(pending);
+		since_best = 0;
+	}
+	else 
+	{
+		++since_best;
+	}
+	if (verbose)
+	{
+		std::cout << "\nValidation loss: " << pending_loss << " (best " << best_loss << ")" << std::endl;
+	}
+	return (patience == 0) || (since_best < patience);
+}
+//----------------------------------------------------------------------------
+// Ends training on the best weights seen, validating the final ones too.
+void NeuralNet::finish_validation(bool verbose) 
+{
+	if (n_holdout == 0) 
+	{
+		return;
+	}
+	if (!validator.joinable()) 
+	{
+		validate(verbose);
+	}
+	collect_validation(verbose);
+	if (best_net) 
+	{
+		Net = std::move(best_net);
+		if (verbose)
+		{
+			std::cout << "Keeping the weights with validation loss " << best_loss << "." << std::endl;
+		}
+	}
+}
+//----------------------------------------------------------------------------
+// Adds one event to the mini-batch being filled, and trains on the batch 
+// once it holds batch_size events.
+void NeuralNet::train_batched(const std::vector<double> &Event, const std::vector<double> &Actual, double weight) 
+{
+	add_to_batch(batch, Event, Actual, weight);
+	if (batch.weights.size() == (unsigned int)batch_size) 
+	{
+		flush_batch();
+	}
+}
+//----------------------------------------------------------------------------
+// The same for the event-th event held in memory, in the precision it is 
+// held in.
+void NeuralNet::train_batched(int event) 
+{
+	if (!single_precision) 
+	{
+		add_memory_event(batch, dataset_mem, event);
+		if (batch.weights.size() == (unsigned int)batch_size) 
+		{
+			flush_batch(batch);
+		}
+		return;
+	}
+	add_memory_event(float_batch, float_mem, event);
+	if (float_batch.weights.size() == (unsigned int)batch_size) 
+	{
+		flush_batch(float_batch);
+	}
+}
+//----------------------------------------------------------------------------
+// Trains on the events batched so far, if any: one batched forward pass, 
+// then one gradient step for the whole batch.
+template <typename T>
+void NeuralNet::flush_batch(BasicShard<T> &shard) 
+{
+	if (shard.weights.empty()) 
+	{
+		return;
+	}
+	batch_gradient(shard);
+	Net->descend(shard.workspace);
+}
+void NeuralNet::flush_batch() 
+{
+	flush_batch(batch);
+	flush_batch(float_batch);
+}
+//----------------------------------------------------------------------------
+// One epoch over the events in memory on n_threads threads, thread t taking the t-th 
+// share of epoch_order in batches of batch_size. Synchronously, 
+// each step waits for every thread's gradient and applies their sum (in 
+// thread order, so results do not depend on scheduling); Hogwild threads 
+// apply their own gradients as they go. Shards are sized up front, so the 
+// loop itself does not allocate.
+template <typename T>
+void NeuralNet::train_threaded(std::vector<BasicShard<T> > &shards, const MemoryDataset<T> &store, 
+                               int epoch, int n_epochs, bool verbose) 
+{
+	const int n = store.size();
+	const int share = (n + n_threads - 1) / n_threads;
+	const int steps = (share + batch_size - 1) / batch_size;
+	shards.resize(n_threads);
+	for (auto &shard : shards) 
+	{
+		shard.events.reserve(batch_size * structure.front());
+		shard.labels.reserve(batch_size * structure.back());
+		shard.errors.reserve(batch_size * structure.back());
+		shard.weights.reserve(batch_size);
+		Net->reserve_batch(shard.workspace, batch_size);
+	}
+
+	Barrier barrier(n_threads);
+	auto work = [&](int t)
+	{
+		BasicShard<T> &shard = shards[t];
+		int entry = std::min(t * share, n), end = std::min((t + 1) * share, n);
+		for (int step = 0; step < steps; ++step) 
+		{
+			for (int k = 0; (k < batch_size) && (entry < end); ++k, ++entry) 
+			{
+				const int event = epoch_order[entry];
+				add_memory_event(shard, store, event);
+			}
+			if (hogwild) 
+			{
+				if (!shard.weights.empty()) 
+				{
+					batch_gradient(shard);
+					Net->descend(shard.workspace);
+				}
+			}
+			else 
+			{
+				batch_gradient(shard);
+				barrier.wait();
+				if (t == 0) 
+				{
+					for (int u = 1; u < n_threads; ++u) 
+					{
+						Net->reduce_batch(shards[0].workspace, shards[u].workspace);
+					}
+					Net->descend(shards[0].workspace);
+				}
+				barrier.wait();
+			}
+			if (verbose && (t == 0)) 
+			{
+				epoch_progress_bar((((double)(step + 1)) / ((double) steps)) * 100, epoch + 1, n_epochs);
+			}
+		}
+	};
+	run_threads(n_threads, work);
 }
 //----------------------------------------------------------------------------
 std::vector<double> NeuralNet::predict(std::vector<double> Event) 
 {
-	return std::move(_softmax_function(Net->test( transform(Event) )));
+	std::vector<double> outs(Net->test( transform(Event) ));
+	_softmax_function(outs.data(), outs.size());
+	return outs;
 }
 //----------------------------------------------------------------------------
-void NeuralNet::getTransform(bool verbose, bool into_memory, int n_train, bool cdf_weight, bool relative) 
+bool NeuralNet::getTransform(bool verbose, bool into_memory, int n_train, bool cdf_weight, bool relative) 
 {
-	dataset->determine_reweighting(cdf_weight, relative);
+	// with a preprocessed cache, events are written to it as read
+	EventCacheWriter writer;
+	bool caching = into_memory && !preprocessed_file.empty();
+	const uint64_t key = caching ? preprocessed_key(n_train, cdf_weight, relative) : 0;
+	if (caching && map_preprocessed(key))
+	{
+		if (verbose)
+		{
+			std::cout << "Training on preprocessed events from " << preprocessed_file << "." << std::endl;
+		}
+		return true;
+	}
+	if (!dataset->determine_reweighting(cdf_weight, relative))
+	{
+		return false;
+	}
 	int n_estimate = ((n_train < 0) ? (dataset->num_entries() / 20) : n_train);
 	unsigned int n = 0;
 	double pct, temp;    
@@ -233,48 +907,140 @@ void NeuralNet::getTransform(bool verbose, bool into_memory, int n_train, bool c
 
 	std::vector<double> means(n_cols, 0);
 	std::vector<double> stdev(n_cols, 0);
-
-	for (int i = 0; i < n_estimate; ++i)
-	{
-		dataset->at(i);
-		if ((get_value("pt") > 20) && (fabs(get_value("eta"))) < 2.5 && (get_value("flavor_truth_label") < 8) && (get_value("pt") < 1000))
-		{
-			++n;
-		    ENTRY = dataset->input();
-		    if (into_memory)
-		    {
-		    	auto labels = dataset->output();
-		    	dataset_mem.push_back(ENTRY);
-		    	labels_mem.push_back(labels);
-		    	weights_mem.push_back(get_physics_reweighting());
-		    }
-		    // online, numerically stable algorithm 
-		    for (unsigned int j = 0; j < n_cols; ++j)
-		    {
-		        temp = ENTRY[j];
-		        double old_mean = means[j];
-		        means[j] += ((temp - means[j]) / n);
-		        double denom = ((n == 1) ? 1.0 : ((double)n - 1));
-		        stdev[j] = ((n - 2) * stdev[j] + (temp - means[j]) * (temp - old_mean)) / denom;
-		    }
+	if (into_memory)
+	{
+		dataset_mem.reset(n_cols, structure.back());
+		float_mem.reset(n_cols, structure.back());
+		if (caching && !writer.open(preprocessed_file, key, n_cols, structure.back(), 
+		                            single_precision ? sizeof(float) : sizeof(double)))
+		{
+			std::cout << "\nError: could not write preprocessed events to " << preprocessed_file << "." << std::endl;
+			caching = false;
+		}
+		if (caching)
+		{
+			if (verbose)
+			{
+				std::cout << "Writing preprocessed events to " << preprocessed_file << "." << std::endl;
+			}
+		}
+		else if (single_precision)
+		{
+			float_mem.reserve(n_estimate);
+		}
+		else
+		{
+			dataset_mem.reserve(n_estimate);
 		}
+	}
+
+	loader.run(0, n_estimate, 
+		[&](long entry, Row &row) { read_row(entry, row, {}, into_memory, true); },
+		[&](Row &row) { return row.selected; },
+		[&](Row &row) 
+	{
+		++n;
+	    if (caching)
+	    {
+	    	writer.add(row.input, row.output, row.weight);
+	    }
+	    else if (into_memory && single_precision)
+	    {
+	    	float_mem.add(row.input, row.output, row.weight);
+	    }
+	    else if (into_memory)
+	    {
+	    	dataset_mem.add(row.input, row.output, row.weight);
+	    }
+	    // online, numerically stable algorithm 
+	    for (unsigned int j = 0; j < n_cols; ++j)
+	    {
+	        temp = row.input[j];
+	        double old_mean = means[j];
+	        means[j] += ((temp - means[j]) / n);
+	        double denom = ((n == 1) ? 1.0 : ((double)n - 1));
+	        stdev[j] = ((n - 2) * stdev[j] + (temp - means[j]) * (temp - old_mean)) / denom;
+	    }
 		if (verbose)
 		{
-		    pct = (((double)(i)) / ((double) (n_estimate))) * 100;
+		    pct = (((double)(row.entry)) / ((double) (n_estimate))) * 100;
 		    progress_bar(pct);
 		}
-	}
+		return true;
+	});
 	for (unsigned int j = 0; j < n_cols; ++j) 
 	{
 		stdev[j] = sqrt(stdev[j]);
 	}
 	setTransform(means, stdev);
+	if (caching)
+	{
+		// the holdout goes in the cache too, and everything is then 
+		// trained on from the mapped file
+		if (n_holdout > 0)
+		{
+			load_holdout(n_train);
+		}
+		if (!writer.finish(mean, stddev, holdout) || !map_preprocessed(key))
+		{
+			std::cout << "\nError: could not write preprocessed events to " << preprocessed_file << "." << std::endl;
+			return false;
+		}
+	}
+	return true;
+}
+//----------------------------------------------------------------------------
+// Identifies the events getTransform reads: the input file, by path, size 
+// and modification time, the spec and selection, and the options that 
+// change which events are read or how they are weighted and stored.
+uint64_t NeuralNet::preprocessed_key(int n_train, bool cdf_weight, bool relative) const
+{
+	std::ostringstream text;
+	text << root_file << "\n" << tree_name << "\n";
+	struct stat info;
+	if (stat(root_file.c_str(), &info) == 0)
+	{
+		text << info.st_size << " " << info.st_mtime << "\n";
+	}
+	text << spec_text << selection << "\n" << n_train << " " << n_holdout << " " 
+	     << cdf_weight << " " << relative << " " << single_precision;
+	uint64_t hash = 14695981039346656037ULL; // 64 bit FNV-1a
+	for (char c : text.str())
+	{
+		hash = (hash ^ (unsigned char)c) * 1099511628211ULL;
+	}
+	return hash;
+}
+//----------------------------------------------------------------------------
+// Attaches the events in memory and the holdout to the preprocessed cache, 
+// mapped, if it holds the events of key.
+bool NeuralNet::map_preprocessed(uint64_t key)
+{
+	std::shared_ptr<JetTagger::MappedFile> file(new JetTagger::MappedFile);
+	if (!file->open(preprocessed_file))
+	{
+		return false;
+	}
+	dataset_mem.reset(structure.front(), structure.back());
+	float_mem.reset(structure.front(), structure.back());
+	holdout.reset(structure.front(), structure.back());
+	const bool attached = single_precision ? 
+		attach_event_cache(file->begin(), file->size(), key, float_mem, holdout, mean, stddev) : 
+		attach_event_cache(file->begin(), file->size(), key, dataset_mem, holdout, mean, stddev);
+	if (attached)
+	{
+		preprocessed = file;
+	}
+	return attached;
 }
 //----------------------------------------------------------------------------
+// Events held in memory are normalized here, once.
 void NeuralNet::setTransform(std::vector<double> Mean, std::vector<double> Stddev) 
 {
 	mean = Mean;
 	stddev = Stddev;
+	dataset_mem.normalize(mean, stddev);
+	float_mem.normalize(mean, stddev);
 }
 //----------------------------------------------------------------------------
 std::vector<double> NeuralNet::transform(std::vector<double> Event) 
@@ -300,21 +1066,66 @@ std::vector<std::vector<double>> NeuralNet::transform(std::vector<std::vector<do
 	return std::move(Event);
 }
 //----------------------------------------------------------------------------
-void NeuralNet::encode(std::vector<std::vector<double>> input, std::vector<double> weight, bool verbose)
+void NeuralNet::encode(const std::vector<std::vector<double>> &input, const std::vector<double> &weight, bool verbose)
 {
-	Net->encode(transform(input), .007, weight, verbose);
+	std::vector<double> events(input.size() * structure.front());
+	for (unsigned int n = 0; n < input.size(); ++n) 
+	{
+		normalize(input[n], events.data() + n * structure.front());
+	}
+	Net->encode(events.data(), weight.data(), input.size(), .007, verbose, 6, batch_size, n_threads);
 }
 //----------------------------------------------------------------------------
 void NeuralNet::encode(bool verbose)
 {
-	if (dataset_mem.size() == 0)
+	if (dataset_mem.empty() && float_mem.empty())
 	{
 		std::cout << "Warning: skipping encoding, dataset not found in RAM." << std::endl;
 	}
+	else if (single_precision)
+	{
+		// pretraining runs in double
+		std::vector<double> events(float_mem.row(0), float_mem.row(float_mem.size()));
+		Net->encode(events.data(), float_mem.weights(), float_mem.size(), .007, verbose, 6, batch_size, n_threads);
+	}
 	else
 	{
-		encode(dataset_mem, weights_mem, verbose);
+		Net->encode(dataset_mem.row(0), dataset_mem.weights(), dataset_mem.size(), .007, verbose, 6, batch_size, n_threads);
+	}
+}
+//----------------------------------------------------------------------------
+// Checkpoints are binary, in the machine's byte order: the magic, the 
+// epoch, entry and trained event count to resume at, the structure, 
+// learning, momentum, optimizer name and weight generator state, the 
+// normalization, then for every layer its step count and its weights and 
+// optimizer state, as (ins + 1) x outs blocks.
+//----------------------------------------------------------------------------
+static const char checkpoint_magic[8] = {'G', 'A', 'I', 'A', 'C', 'K', 'P', '1'};
+
+template <typename T>
+static void write_value(std::ostream &out, const T &value)
+{
+	out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+template <typename T>
+static bool read_value(std::istream &in, T &value)
+{
+	return (bool)in.read(reinterpret_cast<char*>(&value), sizeof(T));
+}
+static void write_string(std::ostream &out, const std::string &text)
+{
+	write_value(out, (std::int32_t)text.size());
+	out.write(text.data(), text.size());
+}
+static bool read_string(std::istream &in, std::string &text)
+{
+	std::int32_t size;
+	if (!read_value(in, size) || (size < 0) || (size > (1 << 20))) 
+	{
+		return 0;
 	}
+	text.resize(size);
+	return (bool)in.read(&text[0], size);
 }
 //----------------------------------------------------------------------------
 bool NeuralNet::save(const std::string &filename) 
@@ -335,13 +1146,15 @@ bool NeuralNet::save(const std::string &filename)
     for (unsigned int l = 0; l < Net->Bundle.size(); ++l) 
     {
 		net_file << "BUNDLE\n";
-		for (int i = 0; i <= Net->Bundle.at(l)->ins; ++i) 
+		const Layer &layer = *Net->Bundle.at(l);
+		for (int i = 0; i <= layer.ins; ++i) 
 		{
-			for (int j = 0; j < (Net->Bundle.at(l)->outs - 1); ++j) 
+			const double *row = layer.Synapse + i * layer.outs;
+			for (int j = 0; j < (layer.outs - 1); ++j) 
 			{
-				net_file << std::setprecision(11) << Net->Bundle.at(l)->Synapse.at(i).at(j) << ", ";
+				net_file << std::setprecision(11) << row[j] << ", ";
 			}
-			net_file << std::setprecision(11) << Net->Bundle.at(l)->Synapse.at(i).at((Net->Bundle.at(l)->outs - 1)) << "\n";
+			net_file << std::setprecision(11) << row[layer.outs - 1] << "\n";
 		}
 	}
     net_file << "TRANS\n";
@@ -357,129 +1170,249 @@ bool NeuralNet::save(const std::string &filename)
     }
     net_file << stddev.at(stddev.size() - 1) << "\n";
 
+    // The optimizer and its state, so that training can resume where it 
+    // stopped; readers of the net itself stop at TRANS.
+    net_file << "OPTIMIZER\n" << Net->getOptimizer().name() << "\n";
+    for (unsigned int l = 0; l < Net->Bundle.size(); ++l) 
+    {
+		net_file << "BUNDLE\n";
+		const Layer &layer = *Net->Bundle.at(l);
+		net_file << layer.steps << "\n";
+		for (const double *state : {layer.DeltaSynapse, layer.Moment}) 
+		{
+			for (int i = 0; i <= layer.ins; ++i) 
+			{
+				const double *row = state + i * layer.outs;
+				for (int j = 0; j < (layer.outs - 1); ++j) 
+				{
+					net_file << std::setprecision(11) << row[j] << ", ";
+				}
+				net_file << std::setprecision(11) << row[layer.outs - 1] << "\n";
+			}
+		}
+	}
+
 	net_file.close();
 	return 1;
 }
 //----------------------------------------------------------------------------
 bool NeuralNet::load(const std::string &filename) 
 {
-    std::string s;
-    std::ifstream net_file( filename );
+    std::ifstream net_file( filename, std::ios::binary );
     if (!net_file.is_open()) 
     {
         std::cout << "\nError: File name " << filename << " not found." << std::endl;
         return 0;
     }
-    std::getline( net_file, s );
-    if ((s != "#->NNET")) 
+    char magic[sizeof(checkpoint_magic)] = {0};
+    net_file.read(magic, sizeof(magic));
+    if (std::equal(magic, magic + sizeof(magic), checkpoint_magic)) 
     {
-    	std::cout << "\nError: file type not recognised." << std::endl;
-    	return 0;
-    }
-    std::getline( net_file, s );
-    std::istringstream iss( s );
-    std::vector<unsigned int> params;
-    while (std::getline(iss, s, ',')) 
-    {
-        unsigned int fieldvalue = 0u;
-        std::istringstream( s ) >> fieldvalue;
-        params.push_back( fieldvalue );
+    	return load_checkpoint(net_file);
     }
-    std::vector<int> layer_struct;
-    for (unsigned int i = 1; i < params.size(); ++i) 
+    net_file.clear();
+    net_file.seekg(0);
+    std::string text((std::istreambuf_iterator<char>(net_file)), 
+                     std::istreambuf_iterator<char>());
+    JetTagger::NetText parsed;
+    if (!JetTagger::parse_net_text(text, parsed))
     {
-    	layer_struct.push_back(params.at(i));
+    	return 0;
     }
 
-    Net = std::move(std::unique_ptr<Architecture>(new Architecture(layer_struct, sigmoid, dsig)));
-    setActivationFunctions(sigmoid, dsig, softmax);
+    structure = parsed.structure;
+    Net = std::move(std::unique_ptr<Architecture>(new Architecture(structure, sigmoid_inplace, dsig)));
+    setActivationFunctions(sigmoid_inplace, dsig, softmax_inplace);
+    setLearning(parsed.learning);
+    setMomentum(parsed.momentum);
 
-    std::getline( net_file, s );
-    std::istringstream n_iss( s );
-    params.clear();
-    while (std::getline(n_iss, s, '?')) 
+    const double *weights = parsed.weights.data();
+    for (auto &layer : Net->Bundle) 
     {
-        unsigned int fieldvalue = 0.00;
-        std::istringstream( s ) >> fieldvalue;
-        params.push_back( fieldvalue );
+    	std::copy(weights, weights + (layer->ins + 1) * layer->outs, layer->Synapse);
+    	weights += (layer->ins + 1) * layer->outs;
     }
+    mean = std::move(parsed.mean);
+    stddev = std::move(parsed.stddev);
+    return load_optimizer_state(text.c_str() + parsed.end);
+}
+//----------------------------------------------------------------------------
+// Reads the OPTIMIZER section save() writes after TRANS, if there is one; 
+// nets saved without it train on with fresh momentum.
+bool NeuralNet::load_optimizer_state(const char *text) 
+{
+	if (!JetTagger::read_keyword(text, "OPTIMIZER")) 
+	{
+		return 1;
+	}
+	const char *end = std::strchr(text, '\n');
+	std::string name(text, end ? end : text + std::strlen(text));
+	text = end ? end + 1 : text + name.size();
+	if (!name.empty() && name.back() == '\r') 
+	{
+		name.pop_back();
+	}
+	if (!setOptimizer(name)) 
+	{
+		return 0;
+	}
+	std::vector<double> fields;
+	for (auto &layer : Net->Bundle) 
+	{
+		const int n_weights = (layer->ins + 1) * layer->outs;
+		fields.clear();
+		if (!JetTagger::read_keyword(text, "BUNDLE") || 
+		    !JetTagger::read_fields(text, ',', fields) || fields.size() != 1) 
+		{
+			std::cout << "\nError: optimizer state: expected BUNDLE and a step count." << std::endl;
+			return 0;
+		}
+		layer->steps = (long)fields[0];
+		fields.clear();
+		for (int row = 0; row < 2 * (layer->ins + 1); ++row) 
+		{
+			if (!JetTagger::read_fields(text, ',', fields)) 
+			{
+				break;
+			}
+		}
+		if (fields.size() != (std::size_t)(2 * n_weights)) 
+		{
+			std::cout << "\nError: optimizer state: wrong number of values." << std::endl;
+			return 0;
+		}
+		std::copy(fields.begin(), fields.begin() + n_weights, layer->DeltaSynapse);
+		std::copy(fields.begin() + n_weights, fields.end(), layer->Moment);
+	}
+	return 1;
+}
+//----------------------------------------------------------------------------
+// Snapshots the weights, optimizer and generator state, and writes them to 
+// filename on checkpointer while training goes on, once the previous 
+// checkpoint is written.
+void NeuralNet::checkpoint(const std::string &filename, int epoch, long entry) 
+{
+	if (checkpointer.joinable()) 
+	{
+		checkpointer.join();
+	}
+	std::stringstream state;
+	state << generator;
+	const std::string rng = state.str();
+	std::shared_ptr<Architecture> snapshot(new Architecture(*Net));
+	const long events = trained;
+	checkpointer = std::thread([=]() 
+	{
+		write_checkpoint(filename, *snapshot, epoch, entry, events, rng);
+	});
+}
+//----------------------------------------------------------------------------
+// Writes next to filename and renames, so that a job killed mid-write 
+// leaves the previous checkpoint whole. Only reads net and the 
+// normalization, so it runs alongside training.
+bool NeuralNet::write_checkpoint(const std::string &filename, const Architecture &net, int epoch, 
+                                 long entry, long trained, const std::string &rng) const
+{
+	const std::string part = filename + ".part";
+	std::ofstream out(part, std::ios::binary);
+	if (!out.is_open()) 
+	{
+		std::cout << "\nError: File name " << part << " invalid." << std::endl;
+		return 0;
+	}
+	out.write(checkpoint_magic, sizeof(checkpoint_magic));
+	write_value(out, (std::int32_t)epoch);
+	write_value(out, (std::int64_t)entry);
+	write_value(out, (std::int64_t)trained);
+	write_value(out, (std::int32_t)structure.size());
+	for (int n : structure) 
+	{
+		write_value(out, (std::int32_t)n);
+	}
+	write_value(out, learning);
+	write_value(out, momentum);
+	write_string(out, net.getOptimizer().name());
+	write_string(out, rng);
+	out.write(reinterpret_cast<const char*>(mean.data()), mean.size() * sizeof(double));
+	out.write(reinterpret_cast<const char*>(stddev.data()), stddev.size() * sizeof(double));
+	for (auto &layer : net.Bundle) 
+	{
+		const int n_weights = (layer->ins + 1) * layer->outs;
+		write_value(out, (std::int64_t)layer->steps);
+		for (const double *block : {layer->Synapse, layer->DeltaSynapse, layer->Moment}) 
+		{
+			out.write(reinterpret_cast<const char*>(block), n_weights * sizeof(double));
+		}
+	}
+	out.close();
+	if (!out || (std::rename(part.c_str(), filename.c_str()) != 0)) 
+	{
+		std::cout << "\nError: could not write checkpoint " << filename << "." << std::endl;
+		return 0;
+	}
+	return 1;
+}
+//----------------------------------------------------------------------------
+// Restores a checkpoint, the magic already read, so that the next train() 
+// call continues exactly where the checkpointed one was.
+bool NeuralNet::load_checkpoint(std::istream &in) 
+{
+	std::int32_t epoch, n_layers;
+	std::int64_t entry, events;
+	std::string name, rng;
+	std::vector<int> shape;
+	bool good = read_value(in, epoch) && read_value(in, entry) && 
+	            read_value(in, events) && read_value(in, n_layers) && 
+	            (n_layers > 1) && (n_layers < 1000);
+	for (int l = 0; good && (l < n_layers); ++l) 
+	{
+		std::int32_t n;
+		good = read_value(in, n) && (n > 0);
+		shape.push_back(n);
+	}
+	double rate, gamma;
+	good = good && read_value(in, rate) && read_value(in, gamma) && 
+	       read_string(in, name) && read_string(in, rng);
+	if (!good) 
+	{
+		std::cout << "\nError: checkpoint header is truncated or corrupt." << std::endl;
+		return 0;
+	}
 
-    Net->setLearning(params.at(0));
-    Net->setMomentum(params.at(1));
-    bool synapse_phase = 0;
-    int row_count = -1;
-    int layer_count = -1;
-    int trans_count = 0;
-    while (std::getline( net_file, s )) 
-    {
-    	if (s == "BUNDLE") 
-    	{
-    		synapse_phase = 1;
-    		layer_count++;
-    		row_count = -1;
-    	}
-    	else if (s == "TRANS") 
-    	{
-    		synapse_phase = 0;
-    	}
-    	else if (synapse_phase) 
-    	{
-    		row_count++;
-    		std::vector<double> record;
-	        std::istringstream iss( s );
-	        while (std::getline( iss, s, ',' )) 
-	        {
-	            double fieldvalue = 0.0;
-	            std::istringstream( s ) >> fieldvalue;
-	            record.push_back( fieldvalue );
-	        }
-	        for (unsigned int i = 0; i < record.size(); ++i) 
-	        {
-	        	(Net->Bundle.at(layer_count))->Synapse.at(row_count).at(i) = record.at(i);
-	        }
-    	}
-		
-
-    	else if ((!synapse_phase) & (trans_count == 0)) 
-    	{
-    		trans_count++;
-    		std::vector<double> record;
-	        std::istringstream iss( s );
-	        while (std::getline( iss, s, ',' )) 
-	        {
-	            double fieldvalue = 0.0;
-	            std::istringstream( s ) >> fieldvalue;
-	            record.push_back( fieldvalue );
-	        }
-	        mean.resize(record.size());
-	        for (unsigned int i = 0; i < record.size(); ++i) 
-	        {
-	        	mean.at(i) = record.at(i);
-	        }
-    	}
-    	else if ((!synapse_phase) & (trans_count == 1)) 
-    	{
-    		trans_count++;
-    		std::vector<double> record;
-	        std::istringstream iss( s );
-	        while (std::getline( iss, s, ',' )) 
-	        {
-	            double fieldvalue = 0.0;
-	            std::istringstream( s ) >> fieldvalue;
-
-	            record.push_back( fieldvalue );
-	        }
-	        stddev.resize(record.size());
-			
-
-	        for (unsigned int i = 0; i < record.size(); ++i) 
-	        {
-	        	stddev.at(i) = record.at(i);
-	        }
-
-    	}
-    }
-    return net_file.good();
+	structure = shape;
+	Net = std::move(std::unique_ptr<Architecture>(new Architecture(structure, sigmoid_inplace, dsig)));
+	setActivationFunctions(sigmoid_inplace, dsig, softmax_inplace);
+	setLearning(rate);
+	setMomentum(gamma);
+	if (!setOptimizer(name)) 
+	{
+		return 0;
+	}
+	mean.resize(structure.front());
+	stddev.resize(structure.front());
+	in.read(reinterpret_cast<char*>(mean.data()), mean.size() * sizeof(double));
+	in.read(reinterpret_cast<char*>(stddev.data()), stddev.size() * sizeof(double));
+	for (auto &layer : Net->Bundle) 
+	{
+		const int n_weights = (layer->ins + 1) * layer->outs;
+		std::int64_t steps = 0;
+		read_value(in, steps);
+		layer->steps = steps;
+		for (double *block : {layer->Synapse, layer->DeltaSynapse, layer->Moment}) 
+		{
+			in.read(reinterpret_cast<char*>(block), n_weights * sizeof(double));
+		}
+	}
+	if (!in) 
+	{
+		std::cout << "\nError: checkpoint is truncated." << std::endl;
+		return 0;
+	}
+	std::stringstream(rng) >> generator;
+	start_epoch = epoch;
+	start_entry = entry;
+	trained = events;
+	return 1;
 }
 bool NeuralNet::write_perf( const std::string &filename, int start, int end)
 {
@@ -497,140 +1430,296 @@ bool NeuralNet::write_perf( const std::string &filename, int start, int end)
                                              "bottom",
                                              "charm",
                                              "light"};
-	if (filename.empty())
+	ofstream file;
+	if (!filename.empty())
+	{
+		file.open(filename);
+		if (!file.is_open())
+		{
+			std::cout << "\nError: File name " << filename << " invalid." << std::endl;
+			return 0;
+		}
+	}
+	else
 	{
 		std::cout << std::endl;
-		auto output_variables = dataset->get_output_vars();
-		int ptr = 0;
-		for (auto &name : output_variables)
-		{	
-			if (ptr != 0)
-			{
-				std::cout << ", ";
-			}
-			std::cout << "prob_" << name;
-			++ptr;
+	}
+	std::ostream &out = filename.empty() ? std::cout : file;
+
+	auto output_variables = dataset->get_output_vars();
+	int ptr = 0;
+	for (auto &name : output_variables)
+	{	
+		if (ptr != 0)
+		{
+			out << ", ";
 		}
+		out << "prob_" << name;
+		++ptr;
+	}
 
-        for (auto &name : perf_variables)
-        {
-        	std::cout << ", " << name;
-        }
-        std::cout << std::endl;
-        for (int entry = start; entry < end; ++entry)
-        {
-        	get_dataset_entry(entry);
-        	if ((get_value("pt") > 20) && 
-        		(fabs(get_value("eta")) <= 2.5) &&
-        		(get_value("pt") < 10000) && 
-        		(get_value("flavor_truth_label") < 8))
-        	{
-        		ptr = 0;
-        		std::vector<double> predicted_values(_softmax_function(Net->test(transform(input() ))));
-        		for (auto &prob : predicted_values)
-        		{
-        			if (ptr != 0)
-					{
-						std::cout << ", ";
-					}
-        			std::cout << prob;
-        			ptr++;
-        		}
-        		auto perf_values = dataset->get_performance_map(perf_variables);
-        		for (auto &name : perf_variables)
-        		{
-        			std::cout << ", " << perf_values[name];
-        		}
-        		std::cout << "\n";
-        	}
-        }
+    for (auto &name : perf_variables)
+    {
+    	out << ", " << name;
     }
-    else
+    out << std::endl;
+
+    // the cuts need pt, eta (perf_variables 2 and 3) and the truth label, 
+    // read after the variables written out
+    std::vector<std::string> names(perf_variables);
+    names.push_back("flavor_truth_label");
+    const std::vector<int> columns = find_columns(names);
+    const int n_perf = perf_variables.size();
+    std::vector<double> predicted_values;
+    loader.run(start, end, 
+    	[&](long entry, Row &row) { read_row(entry, row, columns, false); },
+    	[&](Row &row) 
     {
-    	ofstream file( filename );
-    	if(file.is_open())
+    	if (!((row.values[2] > 20) && 
+    		(fabs(row.values[3]) <= 2.5) &&
+    		(row.values[2] < 10000) && 
+    		(row.values[n_perf] < 8)))
     	{
-			auto output_variables = dataset->get_output_vars();
-			int ptr = 0;
-			for (auto &name : output_variables)
-			{	
-				if (ptr != 0)
-				{
-					file << ", ";
-				}
-				file << "prob_" << name;
-				++ptr;
+    		return false;
+    	}
+    	normalize(row.input, row.input.data());
+    	return true;
+    },
+    	[&](Row &row) 
+    {
+		const double *outs = Net->test(row.input.data());
+		predicted_values.assign(outs, outs + structure.back());
+		_softmax_function(predicted_values.data(), predicted_values.size());
+		ptr = 0;
+		for (auto &prob : predicted_values)
+		{
+			if (ptr != 0)
+			{
+				out << ", ";
 			}
+			out << prob;
+			ptr++;
+		}
+		for (int i = 0; i < n_perf; ++i)
+		{
+			out << ", " << row.values[i];
+		}
+		out << "\n";
+		return true;
+	});
+	return 1;
+}
 
-	        for (auto &name : perf_variables)
-	        {
-	        	file << ", " << name;
-	        }
-	        file << std::endl;
-	        for (int entry = start; entry < end; ++entry)
-	        {
-	        	get_dataset_entry(entry);
-	        	if ((get_value("pt") > 20) && 
-	        		(fabs(get_value("eta")) <= 2.5) &&
-	        		(get_value("pt") < 10000) && 
-	        		(get_value("flavor_truth_label") < 8))
-	        	{
-	        		ptr = 0;
-	        		std::vector<double> predicted_values(_softmax_function(Net->test(transform(input() ))));
-	        		for (auto &prob : predicted_values)
-	        		{
-	        			if (ptr != 0)
-						{
-							file << ", ";
-						}
-	        			file << prob;
-	        			ptr++;
-	        		}
-	        		auto perf_values = dataset->get_performance_map(perf_variables);
-	        		for (auto &name : perf_variables)
-	        		{
-	        			file << ", " << perf_values[name];
-	        		}
-	        		file << "\n";
-	        	}
-	        }
-	        file.close();
-	    }
-    }
+//----------------------------------------------------------------------------
+// Light and charm rejections of the discriminant log(p_bottom / p_light) at
+// a given b-jet efficiency; labels follow flavor_truth_label.
+static std::pair<double, double> rejections(const std::vector<double> &discriminant, 
+                                            const std::vector<int> &labels, 
+                                            double efficiency)
+{
+	std::vector<double> bottom;
+	for (unsigned int i = 0; i < labels.size(); ++i)
+	{
+		if (labels[i] == 5)
+		{
+			bottom.push_back(discriminant[i]);
+		}
+	}
+	if (bottom.empty())
+	{
+		return std::make_pair(0.0, 0.0);
+	}
+	std::sort(bottom.begin(), bottom.end(), std::greater<double>());
+	unsigned int n_pass = std::min<unsigned int>(bottom.size() - 1, efficiency * bottom.size());
+	double cut = bottom[n_pass];
+	int light = 0, light_pass = 0, charm = 0, charm_pass = 0;
+	for (unsigned int i = 0; i < labels.size(); ++i)
+	{
+		if (labels[i] == 0)
+		{
+			++light;
+			light_pass += (discriminant[i] > cut);
+		}
+		else if (labels[i] == 4)
+		{
+			++charm;
+			charm_pass += (discriminant[i] > cut);
+		}
+	}
+	return std::make_pair(light_pass ? double(light) / light_pass : 0.0, 
+	                      charm_pass ? double(charm) / charm_pass : 0.0);
 }
+//----------------------------------------------------------------------------
+// Calibrates an int8 copy of the saved net on the first n_calibration 
+// selected jets of the dataset, writes it to quantized_file, and reports 
+// how far the next n_test jets move in probability and in rejection.
+bool NeuralNet::quantize(const std::string &spec_file, const std::string &net_file, 
+                         const std::string &quantized_file, int n_calibration, int n_test)
+{
+	JetTagger::NeuralNet reference;
+	std::ifstream spec( spec_file ), nnet( net_file );
+	std::stringstream spec_stream, net_stream;
+	spec_stream << spec.rdbuf();
+	net_stream << nnet.rdbuf();
+	if (!reference.load_specifications(spec_stream) || !reference.load_net(net_stream))
+	{
+		std::cout << "\nError: could not load " << net_file << " for quantization." << std::endl;
+		return false;
+	}
+	const std::vector<std::string> &layout = reference.get_input_layout();
+	const std::vector<std::string> &outputs = reference.get_output_names();
+	int bottom = std::find(outputs.begin(), outputs.end(), "bottom") - outputs.begin();
+	int light = std::find(outputs.begin(), outputs.end(), "light") - outputs.begin();
+	if ((bottom == (int)outputs.size()) || (light == (int)outputs.size()))
+	{
+		std::cout << "\nError: quantization report needs bottom and light outputs." << std::endl;
+		return false;
+	}
+
+	std::vector<double> calibration, test;
+	std::vector<int> labels;
+	const std::vector<int> inputs = find_columns(layout);
+	if (std::find(inputs.begin(), inputs.end(), -1) != inputs.end())
+	{
+		std::cout << "\nError: the net's inputs are not all in the specification." << std::endl;
+		return false;
+	}
+	const int pt = dataset->column("pt"), eta = dataset->column("eta");
+	const int flavor = dataset->column("flavor_truth_label");
+	if ((pt < 0) || (eta < 0) || (flavor < 0))
+	{
+		std::cout << "\nError: quantization report needs pt, eta and flavor_truth_label." << std::endl;
+		return false;
+	}
+	int entry = 0, n_entries = dataset->num_entries();
+	while ((entry < n_entries) && ((int)labels.size() < n_test))
+	{
+		get_dataset_entry(entry++);
+		if ((dataset->get_value(pt) > 20) && 
+			(fabs(dataset->get_value(eta)) <= 2.5) &&
+			(dataset->get_value(pt) < 10000) && 
+			(dataset->get_value(flavor) < 8))
+		{
+			bool calibrating = ((int)calibration.size() < n_calibration * (int)layout.size());
+			std::vector<double> &target = calibrating ? calibration : test;
+			for (int column : inputs)
+			{
+				target.push_back(dataset->get_value(column));
+			}
+			if (!calibrating)
+			{
+				labels.push_back(dataset->get_value(flavor));
+			}
+		}
+	}
+	if (calibration.empty() || labels.empty())
+	{
+		std::cout << "\nError: not enough jets to calibrate and test the quantized net." << std::endl;
+		return false;
+	}
 
+	JetTagger::QuantizedNeuralNet quantized(reference, calibration.data(), 
+	                                        calibration.size() / layout.size());
+	if (!quantized.save(quantized_file))
+	{
+		return false;
+	}
 
+	int n_jets = labels.size(), n_outputs = outputs.size();
+	std::vector<float> test_float(test.begin(), test.end());
+	std::vector<double> exact(n_jets * n_outputs);
+	std::vector<float> approximate(n_jets * n_outputs);
+	reference.predict_batch(test.data(), n_jets, exact.data());
+	quantized.predict_batch(test_float.data(), n_jets, approximate.data());
+
+	double max_deviation = 0, mean_deviation = 0;
+	std::vector<double> exact_discriminant(n_jets), approximate_discriminant(n_jets);
+	for (int n = 0; n < n_jets; ++n)
+	{
+		for (int i = 0; i < n_outputs; ++i)
+		{
+			double deviation = fabs(exact[n * n_outputs + i] - approximate[n * n_outputs + i]);
+			max_deviation = std::max(max_deviation, deviation);
+			mean_deviation += deviation / (n_jets * n_outputs);
+		}
+		// floored so that a probability rounded to zero stays finite
+		exact_discriminant[n] = log(std::max(exact[n * n_outputs + bottom], 1e-30) / 
+		                            std::max(exact[n * n_outputs + light], 1e-30));
+		approximate_discriminant[n] = log(std::max<double>(approximate[n * n_outputs + bottom], 1e-30) / 
+		                                  std::max<double>(approximate[n * n_outputs + light], 1e-30));
+	}
 
+	std::cout << "\nQuantized net written to " << quantized_file;
+	std::cout << "\nCalibration jets: " << calibration.size() / layout.size();
+	std::cout << ", test jets: " << n_jets;
+	std::cout << "\nWeight bytes: " << quantized.weight_bytes();
+	std::cout << "\nProbability deviation: max " << max_deviation << ", mean " << mean_deviation;
+	std::cout << "\n\nb-eff    light rej (double / int8 / shift)    c rej (double / int8 / shift)\n";
+	const double working_points[] = {0.60, 0.70, 0.77, 0.85};
+	for (double efficiency : working_points)
+	{
+		auto exact_rejection = rejections(exact_discriminant, labels, efficiency);
+		auto approximate_rejection = rejections(approximate_discriminant, labels, efficiency);
+		std::cout << std::setw(4) << efficiency * 100 << "%    " 
+		          << std::setw(8) << exact_rejection.first << " / " 
+		          << std::setw(8) << approximate_rejection.first << " / " 
+		          << std::setw(7) << std::showpos 
+		          << (approximate_rejection.first - exact_rejection.first) << std::noshowpos << "    "
+		          << std::setw(8) << exact_rejection.second << " / " 
+		          << std::setw(8) << approximate_rejection.second << " / " 
+		          << std::setw(7) << std::showpos 
+		          << (approximate_rejection.second - exact_rejection.second) << std::noshowpos << "\n";
+	}
+	std::cout << std::endl;
+	return true;
+}
+//----------------------------------------------------------------------------
+// Reads the branches and the training selection of a spec file.
+// \return Returns false if the file is missing or malformed, or its 
+// selection does not parse.
 bool NeuralNet::load_specifications(const std::string &filename)
 {
 	std::string line;
     std::ifstream FILE( filename );
-    bool input_phase = false, output_phase = false, control_phase = false;
+    bool input_phase = false, output_phase = false, control_phase = false, selection_phase = false;
+    std::string cuts;
     if (!FILE.is_open()) 
     {
         std::cout << "\nError: Specification file name " << filename << " not found." << std::endl;
         return 0;
     }
+    spec_text.clear();
     while(std::getline( FILE, line ))
     {
+    	spec_text += line + "\n";
     	line = trim(line);
     	if (line == "input:")
     	{
     		input_phase = true;
     		output_phase = false;
     		control_phase = false;
+    		selection_phase = false;
     	}
     	if (line == "output:")
     	{
     		output_phase = true;
     		input_phase = false;
     		control_phase = false;
+    		selection_phase = false;
     	}
     	if (line == "control:")
     	{
     		control_phase = true;
     		input_phase = false;
     		output_phase = false;
+    		selection_phase = false;
+    	}
+    	if (line == "selection:")
+    	{
+    		selection_phase = true;
+    		input_phase = false;
+    		output_phase = false;
+    		control_phase = false;
     	}
     	if (line[0] != '#')
     	{
@@ -667,6 +1756,11 @@ bool NeuralNet::load_specifications(const std::string &filename)
 	    			set_control_branch(trim(name), trim(type));
 	    		}
 	    	}
+	    	else if (selection_phase && (line != "selection:") && (line != ""))
+	    	{
+	    		// one or more cuts per line, all of which must pass
+	    		cuts += (cuts.empty() ? "" : ", ") + line;
+	    	}
     	}
     	else
     	{
@@ -674,7 +1768,13 @@ bool NeuralNet::load_specifications(const std::string &filename)
     		return false;
     	}
     }
-    return FILE.good();
+    dataset->prepare_cache(cache_size);
+    if (!setSelection(cuts.empty() ? default_selection : cuts))
+    {
+    	return false;
+    }
+    // read to its end, the stream is no longer good(), only not bad()
+    return !FILE.bad();
 }
 
 
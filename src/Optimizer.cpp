@@ -0,0 +1,97 @@
+//------------------------------------------------------
+//				Optimizer.cpp
+//------------------------------------------------------
+
+#include "Optimizer.h"
+#include <cmath>
+
+//----------------------------------------------------------------------------
+// The plain gradient step for weight k, which every rule starts from.
+static inline double sgd_step(const WeightBlock &block, const double *gradient, 
+                              double rate, double decay, int k)
+{
+	return -rate * gradient[k] - ((k < block.n_decayed) ? decay * block.weights[k] : 0.0);
+}
+
+//----------------------------------------------------------------------------
+void MomentumOptimizer::step(const WeightBlock &block, const double *gradient, 
+                             double rate, double decay) const
+{
+	const double gamma = block.momentum, onemingamma = 1.0 - block.momentum;
+	for (int k = 0; k < block.n_weights; ++k) 
+	{
+		block.velocity[k] = (onemingamma * sgd_step(block, gradient, rate, decay, k)) + gamma * block.velocity[k];
+		block.weights[k] += block.velocity[k];
+	}
+}
+
+//----------------------------------------------------------------------------
+void NesterovOptimizer::step(const WeightBlock &block, const double *gradient, 
+                             double rate, double decay) const
+{
+	const double gamma = block.momentum, onemingamma = 1.0 - block.momentum;
+	for (int k = 0; k < block.n_weights; ++k) 
+	{
+		const double step = onemingamma * sgd_step(block, gradient, rate, decay, k);
+		block.velocity[k] = step + gamma * block.velocity[k];
+		block.weights[k] += step + gamma * block.velocity[k];
+	}
+}
+
+//----------------------------------------------------------------------------
+void RMSPropOptimizer::step(const WeightBlock &block, const double *gradient, 
+                            double rate, double decay) const
+{
+	for (int k = 0; k < block.n_weights; ++k) 
+	{
+		const double g = gradient[k];
+		block.moment[k] = rho * block.moment[k] + (1.0 - rho) * g * g;
+		block.weights[k] += -rate * g / (std::sqrt(block.moment[k]) + epsilon) - 
+		                    ((k < block.n_decayed) ? decay * block.weights[k] : 0.0);
+	}
+}
+
+//----------------------------------------------------------------------------
+void AdamOptimizer::step(const WeightBlock &block, const double *gradient, 
+                         double rate, double decay) const
+{
+	const double corrected = rate * std::sqrt(1.0 - std::pow(beta2, block.steps)) / 
+	                         (1.0 - std::pow(beta1, block.steps));
+	for (int k = 0; k < block.n_weights; ++k) 
+	{
+		const double g = gradient[k];
+		block.velocity[k] = beta1 * block.velocity[k] + (1.0 - beta1) * g;
+		block.moment[k] = beta2 * block.moment[k] + (1.0 - beta2) * g * g;
+		block.weights[k] += -corrected * block.velocity[k] / (std::sqrt(block.moment[k]) + epsilon) - 
+		                    ((k < block.n_decayed) ? decay * block.weights[k] : 0.0);
+	}
+}
+
+//----------------------------------------------------------------------------
+std::unique_ptr<Optimizer> make_optimizer(const std::string &name)
+{
+	if (name == "momentum") 
+	{
+		return std::unique_ptr<Optimizer>(new MomentumOptimizer());
+	}
+	if (name == "nesterov") 
+	{
+		return std::unique_ptr<Optimizer>(new NesterovOptimizer());
+	}
+	if (name == "rmsprop") 
+	{
+		return std::unique_ptr<Optimizer>(new RMSPropOptimizer());
+	}
+	if (name == "adam") 
+	{
+		return std::unique_ptr<Optimizer>(new AdamOptimizer());
+	}
+	return std::unique_ptr<Optimizer>();
+}
+
+//----------------------------------------------------------------------------
+const Optimizer& default_optimizer()
+{
+	static const MomentumOptimizer momentum;
+	return momentum;
+}
@@ -39,6 +39,10 @@ int main(int argc, char *argv[])
                 tree_name, 
                 root_filename, 
                 resume_file,
+                quantize_filename,
+                optimizer = "",
+                selection = "",
+                preprocessed_file = "",
                 spec_file = "";
 
     bool in_flag = false,
@@ -51,15 +55,28 @@ int main(int argc, char *argv[])
          struct_flag = false,
          cdf = false,
          relative = false,
-         encode = false;
+         encode = false,
+         quantize_flag = false,
+         hogwild = false,
+         shuffle = false,
+         single_precision = false;
 
     int n_train = 0, 
         n_test = 0, 
-        n_epochs = 20;
+        n_epochs = 20,
+        batch_size = 1,
+        n_threads = 1,
+        validation_interval = 0,
+        patience = 0,
+        checkpoint_interval = 0,
+        shuffle_buffer = 10000,
+        cache_mb = -1,
+        root_threads = -1;
 
     unsigned int holdout = 0;
     std::vector<int> structure;
     double momentum = 0.9, learning = 0.002;
+    unsigned long shuffle_seed = 0;
 //-----------------------------------------------------------------------------
 //  Parse *argv[] for flags
 //-----------------------------------------------------------------------------
@@ -109,6 +126,10 @@ int main(int argc, char *argv[])
             {
                 memory = true;
             } 
+            else if ((std::string(argv[i]) == "-float")) 
+            {
+                single_precision = true;
+            } 
 
             else if ((std::string(argv[i]) == "-load") && !(load_flag))  
             {
@@ -122,6 +143,12 @@ int main(int argc, char *argv[])
                 write_flag = true;
                 ++i;
             }
+            else if ((std::string(argv[i]) == "-quantize") && !(quantize_flag))  
+            {
+                quantize_filename = std::string(argv[i + 1]);
+                quantize_flag = true;
+                ++i;
+            }
             else if ((std::string(argv[i]) == "-holdout"))  
             {
                 holdout = (int)std::stoi(std::string(argv[i + 1]));
@@ -172,6 +199,71 @@ int main(int argc, char *argv[])
                 n_epochs = (int)std::stoi(std::string(argv[i + 1]));
                 ++i;
             } 
+            else if ((std::string(argv[i]) == "-batch"))  
+            {
+                batch_size = (int)std::stoi(std::string(argv[i + 1]));
+                ++i;
+            } 
+            else if ((std::string(argv[i]) == "-threads"))  
+            {
+                n_threads = (int)std::stoi(std::string(argv[i + 1]));
+                ++i;
+            } 
+            else if ((std::string(argv[i]) == "-hogwild")) 
+            {
+                hogwild = true;
+            }
+            else if ((std::string(argv[i]) == "-validate"))  
+            {
+                validation_interval = (int)std::stoi(std::string(argv[i + 1]));
+                ++i;
+            } 
+            else if ((std::string(argv[i]) == "-patience"))  
+            {
+                patience = (int)std::stoi(std::string(argv[i + 1]));
+                ++i;
+            } 
+            else if ((std::string(argv[i]) == "-checkpoint"))  
+            {
+                checkpoint_interval = (int)std::stoi(std::string(argv[i + 1]));
+                ++i;
+            } 
+            else if ((std::string(argv[i]) == "-shuffle"))  
+            {
+                shuffle = true;
+                shuffle_seed = std::stoul(std::string(argv[i + 1]));
+                ++i;
+            } 
+            else if ((std::string(argv[i]) == "-shuffle-buffer"))  
+            {
+                shuffle_buffer = (int)std::stoi(std::string(argv[i + 1]));
+                ++i;
+            } 
+            else if ((std::string(argv[i]) == "-cache"))  
+            {
+                cache_mb = (int)std::stoi(std::string(argv[i + 1]));
+                ++i;
+            } 
+            else if ((std::string(argv[i]) == "-select"))  
+            {
+                selection = std::string(argv[i + 1]);
+                ++i;
+            } 
+            else if ((std::string(argv[i]) == "-preprocessed"))  
+            {
+                preprocessed_file = std::string(argv[i + 1]);
+                ++i;
+            } 
+            else if ((std::string(argv[i]) == "-root-threads"))  
+            {
+                root_threads = (int)std::stoi(std::string(argv[i + 1]));
+                ++i;
+            } 
+            else if ((std::string(argv[i]) == "-optimizer"))  
+            {
+                optimizer = std::string(argv[i + 1]);
+                ++i;
+            } 
             else  
             {
                 std::cout << "Invalid argument \'" << std::string(argv[i]);
@@ -196,9 +288,9 @@ int main(int argc, char *argv[])
         std::cout << "Error: Executable must be passed a neural network structure." << std::endl;
         bad = true;
     }
-    if ((resume) & (!load_flag)) 
+    if ((resume) & (load_flag)) 
     {
-        std::cout << "Error: To resume training, you must pass a .nnet file with the -load flag." << std::endl;
+        std::cout << "Error: -resume continues training from a checkpoint or .nnet file; it cannot be combined with -load." << std::endl;
         bad = true;
     }
     if (write_flag && (!load_flag)) 
@@ -206,6 +298,38 @@ int main(int argc, char *argv[])
         std::cout << "Error: To write out discriminator distributions, you must load a .nnet file." << std::endl;
         bad = true;
     }
+    if (quantize_flag && (!load_flag)) 
+    {
+        std::cout << "Error: To quantize a net, you must load a .nnet file." << std::endl;
+        bad = true;
+    }
+    if (((validation_interval > 0) || (patience > 0)) && (holdout == 0)) 
+    {
+        std::cout << "Error: -validate and -patience need a -holdout sample." << std::endl;
+        bad = true;
+    }
+    if ((n_threads > 1) && (!memory)) 
+    {
+        std::cout << "Error: Multithreaded training (-threads) runs on events held with -memory." << std::endl;
+        bad = true;
+    }
+    if (single_precision && (!memory)) 
+    {
+        std::cout << "Error: Single-precision training (-float) runs on events held with -memory." << std::endl;
+        bad = true;
+    }
+    if (single_precision && hogwild && (n_threads > 1)) 
+    {
+        // every update refreshes the single-precision weights the other 
+        // threads are reading, which only synchronous training can order
+        std::cout << "Error: Single-precision training (-float) needs synchronous threads, not -hogwild." << std::endl;
+        bad = true;
+    }
+    if ((preprocessed_file != "") && (!memory)) 
+    {
+        std::cout << "Error: A preprocessed cache (-preprocessed) holds events to train on with -memory." << std::endl;
+        bad = true;
+    }
     if (spec_file == "")
     {
         std::cout << "Error: you must provide a spec file with variables and types present within the TTree." << std::endl;
@@ -229,25 +353,52 @@ int main(int argc, char *argv[])
 //  Train from ROOT file
 //-----------------------------------------------------------------------------
 
+    if (root_threads >= 0) 
+    {
+        Dataset::enable_parallel_unzip(root_threads);
+    }
     net.set_dataset(root_filename, tree_name);
 
-    net.load_specifications(spec_file);
-
-
-    if (resume)
+    if (!net.load_specifications(spec_file)) 
+    {
+        return -1;
+    }
+    if (cache_mb >= 0) 
+    {
+        net.setReadCache((long long)cache_mb << 20);
+    }
+    if (!selection.empty() && !net.setSelection(selection)) 
     {
-        std::cout << "Resuming training from " << resume_file << "..." << std::endl;
-        net.load(resume_file);
+        return -1;
     }
 
+
     if(!(load_flag)) //training case for charm tag    
     {
 
         net.setMomentum(momentum);
         net.setLearning(learning);
+        net.setBatchSize(batch_size);
+        net.setThreads(n_threads, hogwild);
+        net.setSinglePrecision(single_precision);
+        net.setValidation(holdout, validation_interval, patience);
+        net.setCheckpoints(checkpoint_interval);
+        if (preprocessed_file != "")
+        {
+            net.setPreprocessedCache(preprocessed_file);
+        }
+        if (shuffle)
+        {
+            net.setShuffle(shuffle_seed, shuffle_buffer);
+        }
+        if ((optimizer != "") && !net.setOptimizer(optimizer))
+        {
+            return -1;
+        }
         if (verbose)
         {
             std::cout << "\nTaggerFramework Training Procedure:\n------------------------------------------------";     
+            std::cout << "\nActivation kernels: " << activation_kernels();
         } 
         if (verbose)
         {
@@ -255,7 +406,10 @@ int main(int argc, char *argv[])
         }
 
         int trans = (memory) ? n_train : -1;
-        net.getTransform(verbose, memory, trans, cdf, relative);
+        if (!net.getTransform(verbose, memory, trans, cdf, relative))
+        {
+            return -1;
+        }
 
         //Train the net!
         //----------------------------------------------------------------------------
@@ -264,7 +418,17 @@ int main(int argc, char *argv[])
             std::cout << "Training:\n";
         }
 
-        if (memory && encode)
+        // a checkpoint brings back its normalization, optimizer state and 
+        // position, so it is loaded after the transform and not pretrained
+        if (resume)
+        {
+            std::cout << "Resuming training from " << resume_file << "..." << std::endl;
+            if (!net.load(resume_file))
+            {
+                return -1;
+            }
+        }
+        else if (memory && encode)
         {
             net.encode(verbose);
         }
@@ -279,6 +443,12 @@ int main(int argc, char *argv[])
         std::cout << "\nLoading NeuralNet file:";
         net.load(net_file);
 
+        if (quantize_flag)
+        {
+            // -train jets calibrate the int8 net, the next -test jets measure it
+            net.quantize(spec_file, net_file, quantize_filename, n_train, n_test);
+        }
+
         net.write_perf(write_filename, n_train, n_test + n_train);
 
         auto ranking = net.get_ranking();